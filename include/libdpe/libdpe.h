@@ -74,6 +74,20 @@ typedef enum {
 typedef struct Pe Pe;
 typedef struct Pe_Scn Pe_Scn;
 
+/* One piece of the image covered by the Authenticode digest: size bytes
+ * at offset, followed by pad zero bytes when the caller wants the
+ * trailing data padded to 8 bytes. */
+typedef struct {
+	size_t offset;
+	size_t size;
+	size_t pad;
+} Pe_HashRange;
+
+typedef struct {
+	unsigned int nranges;
+	Pe_HashRange ranges[];
+} Pe_HashPlan;
+
 extern Pe *pe_begin(int fildes, Pe_Cmd cmd, Pe *ref);
 extern Pe *pe_clone(Pe *pe, Pe_Cmd cmd);
 extern Pe *pe_memory(char *image, size_t size);
@@ -85,6 +99,7 @@ extern Pe_Scn *pe_getscn(Pe *pe, size_t idx);
 extern struct section_header *pe_getshdr(Pe_Scn *scn, struct section_header *dst);
 extern struct pe_hdr *pe_getpehdr(Pe *pe, struct pe_hdr *pehdr);
 extern char *pe_rawfile(Pe *pe, size_t *ptr);
+extern int pe_copyfile(Pe *pe, int fildes);
 extern int pe_getdatadir(Pe *pe, data_directory **dd);
 extern void *pe_getopthdr(Pe *pe);
 extern uint32_t pe_get_file_alignment(Pe *pe);
@@ -99,6 +114,10 @@ extern int pe_clearcert(Pe *pe);
 extern int pe_alloccert(Pe *pe, size_t len);
 extern int pe_populatecert(Pe *pe, void *cert, size_t len);
 
+extern const Pe_HashPlan *pe_gethashplan(Pe *pe);
+
+extern uint64_t pe_msynctime(Pe *pe);
+
 extern int pe_errno(void);
 extern const char *pe_errmsg(int error);
 
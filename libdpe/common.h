@@ -74,18 +74,24 @@ get_shnum(void *map_address, size_t maxsize __attribute__((__unused__)))
 
 static inline Pe_Kind
 __attribute__ ((unused))
-determine_kind(void *buf, size_t len __attribute__((__unused__)))
+determine_kind(void *buf, size_t len)
 {
 	Pe_Kind retval = PE_K_NONE;
 	uint16_t mz_magic = MZ_MAGIC;
 	struct mz_hdr *mz = (struct mz_hdr *)buf;
 
+	if (len < sizeof (*mz))
+		return retval;
+
 	if (cmp_le16(&mz->magic, &mz_magic))
 		return retval;
 		
 	retval = PE_K_MZ;
 
 	off_t hdr = (off_t)le32_to_cpu(mz->peaddr);
+	if ((size_t)hdr > len || len - hdr < sizeof (struct pe_hdr))
+		return retval;
+
 	struct pe_hdr *pe = (struct pe_hdr *)(buf + hdr);
 	uint32_t pe_magic = PE_MAGIC;
 
@@ -100,10 +106,13 @@ determine_kind(void *buf, size_t len __attribute__((__unused__)))
 
 		struct pe32_opt_hdr *peo =
 			(struct pe32_opt_hdr *)(buf + hdr + sizeof(*pe));
+		uint16_t magic = 0;
+		if (len - hdr - sizeof(*pe) >= sizeof (peo->magic))
+			magic = le16_to_cpu(peo->magic);
 
 		/* if we don't have an optional header, fall back to testing
 		 * our machine type list... */
-		switch (le16_to_cpu(peo->magic)) {
+		switch (magic) {
 			case PE_OPT_MAGIC_PE32:
 				retval = PE_K_PE_EXE;
 				break;
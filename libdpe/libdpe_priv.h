@@ -44,6 +44,7 @@ enum {
 	PE_E_FD_DISABLED,
 	PE_E_FD_MISMATCH,
 	PE_E_UPDATE_RO,
+	PE_E_BAD_LAYOUT,
 	PE_E_NUM /* terminating entry */
 };
 
@@ -88,6 +89,13 @@ struct Pe {
 
 	int ref_count;
 
+	/* cached by pe_gethashplan(); anything that changes the size of
+	 * the file or the certificate table throws it away. */
+	Pe_HashPlan *hashplan;
+
+	/* nanoseconds spent in msync(); see pe_msynctime() */
+	uint64_t msync_time;
+
 	union {
 		struct {
 			struct mz_hdr *mzhdr;
@@ -175,5 +183,7 @@ extern off_t __pe_updatemmap(Pe *pe, size_t shnum);
 extern int __pe_updatefile(Pe *pe, size_t shnum);
 extern off_t __pe_updatenull(Pe *pe, size_t shnum);
 extern char *__libpe_readall(Pe *pe);
+extern void __pe_discard_hashplan(Pe *pe);
+extern int __pe_msync(Pe *pe, void *addr, size_t len, int flags);
 
 #endif /* LIBDPE_PRIV_H */
@@ -32,6 +32,7 @@ pe_clearcert(Pe *pe)
 	if (dd->certs.virtual_address != 0) {
 		pe_freespace(pe, dd->certs.virtual_address, dd->certs.size);
 		memset(&dd->certs, '\0', sizeof (dd->certs));
+		__pe_discard_hashplan(pe);
 	}
 
 	return 0;
@@ -60,6 +61,7 @@ pe_alloccert(Pe *pe, size_t size)
 
 	dd->certs.virtual_address = compute_file_addr(pe, addr);
 	dd->certs.size += size;
+	__pe_discard_hashplan(pe);
 
 	return 0;
 }
@@ -89,7 +91,7 @@ pe_populatecert(Pe *pe, void *cert, size_t size)
 	pe_extend_file(pe, 0, &new_space, page_size);
 	uint64_t new_max_size = pe->maximum_size;
 	mem = compute_mem_addr(pe, 0);
-	msync(mem, new_max_size, MS_SYNC);
+	__pe_msync(pe, mem, new_max_size, MS_SYNC);
 	new_max_size -= max_size;
 	pe_shorten_file(pe, new_max_size);
 
@@ -111,6 +111,7 @@ pe_extend_file(Pe *pe, size_t size, uint32_t *new_space, int align)
 	*new_space = compute_file_addr(pe, addr + align);
 
 	pe->maximum_size = pe->maximum_size + extra;
+	__pe_discard_hashplan(pe);
 
 	return 0;
 }
@@ -132,6 +133,7 @@ pe_shorten_file(Pe *pe, size_t size)
 		return -1;
 
 	pe->maximum_size -= size;
+	__pe_discard_hashplan(pe);
 	return 0;
 }
 
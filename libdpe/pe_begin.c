@@ -40,6 +40,51 @@ file_read_pe_obj(int fildes __attribute__((__unused__)),
 	return NULL;
 }
 
+/*
+ * Make sure the optional header, data directories, and section table
+ * we're about to point into are actually inside the file.
+ */
+static int
+check_exe_headers(void *map_address, size_t maxsize, Pe_Kind kind,
+		  size_t scncnt)
+{
+	struct mz_hdr *mz = (struct mz_hdr *)map_address;
+	size_t off = le32_to_cpu(mz->peaddr) + sizeof (struct pe_hdr);
+	size_t ddsize = 0;
+
+	switch (kind) {
+		case PE_K_PE_EXE: {
+			struct pe32_opt_hdr *opthdr = (struct pe32_opt_hdr *)
+				((char *)map_address + off);
+			if (off > maxsize || maxsize - off < sizeof (*opthdr))
+				return -1;
+			ddsize = le32_to_cpu(opthdr->data_dirs);
+			off += sizeof (*opthdr);
+			break;
+		}
+		case PE_K_PE64_EXE: {
+			struct pe32plus_opt_hdr *opthdr =
+				(struct pe32plus_opt_hdr *)
+				((char *)map_address + off);
+			if (off > maxsize || maxsize - off < sizeof (*opthdr))
+				return -1;
+			ddsize = le32_to_cpu(opthdr->data_dirs);
+			off += sizeof (*opthdr);
+			break;
+		}
+		default:
+			break;
+	}
+
+	if (off > maxsize || ddsize > (maxsize - off) / sizeof (data_dirent))
+		return -1;
+	off += ddsize * sizeof (data_dirent);
+
+	if (scncnt > (maxsize - off) / sizeof (struct section_header))
+		return -1;
+	return 0;
+}
+
 static inline Pe *
 file_read_pe_exe(int fildes, void *map_address, unsigned char *p_ident,
 		 size_t maxsize, Pe_Cmd cmd __attribute__((__unused__)),
@@ -55,6 +100,12 @@ file_read_pe_exe(int fildes, void *map_address, unsigned char *p_ident,
 	if (scncnt > SIZE_MAX / sizeof(Pe_Scn) + sizeof (struct section_header))
 		return NULL;
 
+	if (map_address != NULL &&
+			check_exe_headers(map_address, maxsize, kind, scncnt) < 0) {
+		__libpe_seterrno(PE_E_BAD_LAYOUT);
+		return NULL;
+	}
+
 	const size_t scnmax = (scncnt ?: (cmd == PE_C_RDWR || cmd == PE_C_RDWR_MMAP) ? 1: 0);
 	Pe *pe = allocate_pe(fildes, map_address, maxsize, cmd, parent,
 			kind, scnmax * sizeof (Pe_Scn));
@@ -0,0 +1,90 @@
+/*
+ * Copyright 2026 agent <agent@local>
+ * All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 2 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Author(s): agent <agent@local>
+ */
+
+#include <errno.h>
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "libdpe_priv.h"
+
+/* Errors that just mean this file system (or kernel) can't do it. */
+static int
+not_supported(int error)
+{
+	return error == EXDEV || error == EINVAL || error == ENOSYS ||
+	       error == EOPNOTSUPP || error == ETXTBSY || error == EBADF ||
+	       error == EPERM;
+}
+
+/*
+ * Make fildes a copy of the file pe was read from, so it can be opened
+ * RDWR and only the pages that change are ever written.  If both are on
+ * a file system with reflinks, nothing is copied at all; otherwise the
+ * kernel copies it if it can, and we write it from our map if it can't.
+ */
+int
+pe_copyfile(Pe *pe, int fildes)
+{
+	size_t size;
+	char *addr = pe_rawfile(pe, &size);
+	off_t pos = 0;
+	struct stat sb;
+
+	if (addr == NULL)
+		return -1;
+
+	if (pe->fildes >= 0 && fstat(pe->fildes, &sb) == 0 &&
+			S_ISREG(sb.st_mode) && (size_t)sb.st_size == size) {
+		if (ioctl(fildes, FICLONE, pe->fildes) == 0)
+			return 0;
+
+		if (ftruncate(fildes, 0) < 0)
+			goto write_error;
+
+		while ((size_t)pos < size) {
+			off_t inpos = pos;
+			ssize_t n = copy_file_range(pe->fildes, &inpos, fildes,
+						    &pos, size - pos, 0);
+			if (n < 0 && errno == EINTR)
+				continue;
+			if (n < 0 && not_supported(errno))
+				break;
+			if (n <= 0)
+				goto write_error;
+		}
+	}
+
+	while ((size_t)pos < size) {
+		ssize_t n = pwrite(fildes, addr + pos, size - pos, pos);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			goto write_error;
+		pos += n;
+	}
+
+	if (ftruncate(fildes, size) < 0) {
+write_error:
+		__libpe_seterrno(PE_E_WRITE_ERROR);
+		return -1;
+	}
+	return 0;
+}
@@ -84,6 +84,7 @@ pe_end(Pe *pe)
 		else if (pe->flags & PE_F_MMAPPED)
 			xmunmap(pe->map_address, pe->maximum_size);
 	}
+	__pe_discard_hashplan(pe);
 	xfree(pe);
 
 	return (parent != NULL && parent->ref_count ? pe_end(parent) : 0);
@@ -0,0 +1,229 @@
+/*
+ * Copyright 2026 agent <agent@local>
+ * All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 2 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Author(s): agent <agent@local>
+ */
+
+#include "libdpe_priv.h"
+
+static int
+compare_shdrs (const void *a, const void *b)
+{
+	const struct section_header *shdra = (const struct section_header *)a;
+	const struct section_header *shdrb = (const struct section_header *)b;
+	int rc;
+
+	if (shdra->data_addr > shdrb->data_addr)
+		return 1;
+	if (shdrb->data_addr > shdra->data_addr)
+		return -1;
+
+	if (shdra->virtual_address > shdrb->virtual_address)
+		return 1;
+	if (shdrb->virtual_address > shdra->virtual_address)
+		return -1;
+
+	rc = strcmp(shdra->name, shdrb->name);
+	if (rc != 0)
+		return rc;
+
+	if (shdra->virtual_size > shdrb->virtual_size)
+		return 1;
+	if (shdrb->virtual_size > shdra->virtual_size)
+		return -1;
+
+	if (shdra->raw_data_size > shdrb->raw_data_size)
+		return 1;
+	if (shdrb->raw_data_size > shdra->raw_data_size)
+		return -1;
+
+	return 0;
+}
+
+static int
+check_pointer_and_size(Pe *pe, void *ptr, size_t size)
+{
+	void *map = pe->map_address;
+	size_t map_size = pe->maximum_size;
+
+	if (!map || map_size < 1)
+		return 0;
+
+	if ((uintptr_t)ptr < (uintptr_t)map)
+		return 0;
+
+	if ((uintptr_t)ptr + size > (uintptr_t)map + map_size)
+		return 0;
+
+	if (ptr <= map && size >= map_size)
+		return 0;
+
+	return 1;
+}
+
+void
+__pe_discard_hashplan(Pe *pe)
+{
+	xfree(pe->hashplan);
+}
+
+/*
+ * Work out which parts of the image the Authenticode digest covers, in
+ * the order they get hashed.  This is purely a function of the layout, so
+ * we keep it on the handle until something changes the file size or the
+ * certificate table.  Plans aren't meant to be compared between images:
+ * working one out costs no more than comparing it would, and what's
+ * hashed is each file's own bytes whatever its layout.
+ */
+const Pe_HashPlan *
+pe_gethashplan(Pe *pe)
+{
+	struct pe32_opt_hdr *pe32opthdr = NULL;
+	struct pe32plus_opt_hdr *pe64opthdr = NULL;
+	struct section_header *shdrs = NULL;
+	Pe_HashPlan *plan = NULL;
+	struct pe_hdr pehdr;
+	data_directory *dd;
+	Pe_Scn *scn = NULL;
+	char *map, *hash_base;
+	size_t map_size, hash_size;
+	unsigned long hashed_bytes;
+
+	if (pe == NULL) {
+		__libpe_seterrno(PE_E_INVALID_HANDLE);
+		return NULL;
+	}
+
+	if (pe->hashplan)
+		return pe->hashplan;
+
+	map = pe_rawfile(pe, &map_size);
+	if (!map)
+		return NULL;
+
+	if (pe_getpehdr(pe, &pehdr) == NULL) {
+		__libpe_seterrno(PE_E_INVALID_FILE);
+		return NULL;
+	}
+
+	/* three pieces of header, the sections, and the trailing data */
+	plan = calloc(1, sizeof (*plan) +
+			 (pehdr.sections + 4) * sizeof (plan->ranges[0]));
+	if (!plan) {
+		__libpe_seterrno(PE_E_NOMEM);
+		return NULL;
+	}
+
+#define add_range(base, len) ({					\
+		if (!check_pointer_and_size(pe, (base), (len)))		\
+			goto bad_layout;				\
+		plan->ranges[plan->nranges].offset =			\
+			(char *)(base) - map;				\
+		plan->ranges[plan->nranges].size = (len);		\
+		plan->nranges++;					\
+	})
+
+	/* The image header from the start to the beginning of the
+	 * checksum... */
+	hash_base = map;
+	switch (pe_kind(pe)) {
+	case PE_K_PE_EXE:
+		pe32opthdr = pe_getopthdr(pe);
+		hash_size = (char *)&pe32opthdr->csum - hash_base;
+		break;
+	case PE_K_PE64_EXE:
+		pe64opthdr = pe_getopthdr(pe);
+		hash_size = (char *)&pe64opthdr->csum - hash_base;
+		break;
+	default:
+		__libpe_seterrno(PE_E_INVALID_FILE);
+		goto err;
+	}
+	add_range(hash_base, hash_size);
+
+	/* ... from the end of the checksum to the start of the cert
+	 * dirent... */
+	hash_base += hash_size;
+	hash_base += pe32opthdr ? sizeof(pe32opthdr->csum)
+				: sizeof(pe64opthdr->csum);
+
+	if (pe_getdatadir(pe, &dd) < 0 || !dd ||
+			!check_pointer_and_size(pe, dd, sizeof(*dd)))
+		goto bad_layout;
+
+	hash_size = (char *)&dd->certs - hash_base;
+	add_range(hash_base, hash_size);
+
+	/* ... and from the end of the cert dirent to the end of the image
+	 * header. */
+	hash_base = (char *)&dd->base_relocations;
+	hash_size = (pe32opthdr ? pe32opthdr->header_size
+				: pe64opthdr->header_size) -
+		(hash_base - map);
+	add_range(hash_base, hash_size);
+
+	hashed_bytes = pe32opthdr ? pe32opthdr->header_size
+				  : pe64opthdr->header_size;
+
+	/* Then every section with any data in it, in file order. */
+	shdrs = calloc(pehdr.sections, sizeof (*shdrs));
+	if (!shdrs) {
+		__libpe_seterrno(PE_E_NOMEM);
+		goto err;
+	}
+	for (int i = 0; i < pehdr.sections; i++) {
+		scn = pe_nextscn(pe, scn);
+		if (scn == NULL)
+			break;
+		pe_getshdr(scn, &shdrs[i]);
+	}
+	if (pehdr.sections > 1)
+		qsort(shdrs, pehdr.sections - 1, sizeof (*shdrs),
+		      compare_shdrs);
+
+	for (int i = 0; i < pehdr.sections; i++) {
+		if (shdrs[i].raw_data_size == 0)
+			continue;
+
+		hash_base = map + shdrs[i].data_addr;
+		hash_size = shdrs[i].raw_data_size;
+		add_range(hash_base, hash_size);
+
+		hashed_bytes += hash_size;
+	}
+
+	/* And finally anything after the sections that isn't the
+	 * certificate table. */
+	if (map_size > hashed_bytes) {
+		hash_base = map + hashed_bytes;
+		hash_size = map_size - dd->certs.size - hashed_bytes;
+		add_range(hash_base, hash_size);
+		plan->ranges[plan->nranges - 1].pad =
+			ALIGNMENT_PADDING(hash_size, 8);
+	}
+#undef add_range
+
+	xfree(shdrs);
+	pe->hashplan = plan;
+	return plan;
+
+bad_layout:
+	__libpe_seterrno(PE_E_BAD_LAYOUT);
+err:
+	xfree(shdrs);
+	xfree(plan);
+	return NULL;
+}
@@ -0,0 +1,52 @@
+/*
+ * Copyright 2026 agent <agent@local>
+ * All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 2 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Author(s): agent <agent@local>
+ */
+
+#include <sys/mman.h>
+#include <time.h>
+
+#include "libdpe_priv.h"
+
+static uint64_t
+now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/* Every msync() on an image goes through here, so callers can tell how
+ * much of writing it out was spent waiting on the disk. */
+int
+__pe_msync(Pe *pe, void *addr, size_t len, int flags)
+{
+	uint64_t start = now_ns();
+	int rc = msync(addr, len, flags);
+
+	pe->msync_time += now_ns() - start;
+	return rc;
+}
+
+uint64_t
+pe_msynctime(Pe *pe)
+{
+	if (pe == NULL)
+		return 0;
+	return pe->msync_time;
+}
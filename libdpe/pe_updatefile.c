@@ -130,7 +130,7 @@ __pe_updatemmap(Pe *pe, size_t shnum __attribute__((__unused__)))
 	}
 
 	char *msync_end = (char *)dd + sizeof(*dd);
-	msync(msync_start, msync_end - msync_start, MS_SYNC);
+	__pe_msync(pe, msync_start, msync_end - msync_start, MS_SYNC);
 
 	#warning this is not done yet.
 	//struct section_header *sh = __get_last_section(pe);
@@ -140,7 +140,7 @@ __pe_updatemmap(Pe *pe, size_t shnum __attribute__((__unused__)))
 	for (unsigned int i = 0; i < dd_size; i++, dde++) {
 		if (dde->size != 0) {
 			char *addr = compute_mem_addr(pe, dde->virtual_address);
-			msync(addr, dde->size, MS_SYNC);
+			__pe_msync(pe, addr, dde->size, MS_SYNC);
 		}
 	}
 
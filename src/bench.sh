@@ -0,0 +1,157 @@
+#!/bin/bash
+set -e
+set -u
+
+#
+# Generate a set of synthetic PE images with mkpe and time each stage of
+# hashing and signing them with pebench, then check that pesign itself
+# signs each of them with a single sign_blob() and without needing much
+# more memory than the image.
+#
+#  BENCHDIR       keep the generated images here instead of a temp dir
+#  BENCH_ROUNDS   number of times to run each stage (default 5)
+#  BENCH_CERTDIR  NSS database holding a signing certificate
+#  BENCH_CERT     nickname of that certificate
+#  BENCH_TOKEN    token holding its key (default "NSS Certificate DB")
+#  BENCH_DAEMON   also check pesignd, signing with pesign-client; this
+#                 needs root, a "pesign" user, /var/run/pesign, and no
+#                 other pesignd running
+#
+# Without BENCH_CERTDIR and BENCH_CERT, a throwaway self-signed
+# certificate is made with certutil.  Without certutil either, the bench
+# fails, since signing is what it checks.
+#
+
+# License: GPLv2
+srcdir=$(dirname "$0")
+rounds=${BENCH_ROUNDS:-5}
+token=${BENCH_TOKEN:-NSS Certificate DB}
+tmpdir=
+daemon=
+
+cleanup() {
+	test -n "$daemon" && kill "$daemon" 2>/dev/null
+	test -n "$tmpdir" && rm -rf "$tmpdir"
+}
+trap cleanup EXIT
+
+if [ -n "${BENCHDIR:-}" ]; then
+	dir=$BENCHDIR
+	mkdir -p "$dir"
+else
+	tmpdir=$(mktemp -d)
+	dir=$tmpdir
+fi
+
+mkimage() {
+	name=$1 && shift
+	"$srcdir/mkpe" -o "$dir/$name.efi" "$@"
+	echo "$dir/$name.efi"
+}
+
+declare -a images=()
+images[${#images[@]}]=$(mkimage pe32-4x1M --pe32 -s 4 -S 1M)
+images[${#images[@]}]=$(mkimage pe32plus-4x1M -s 4 -S 1M)
+images[${#images[@]}]=$(mkimage pe32plus-64x64K -s 64 -S 64K)
+images[${#images[@]}]=$(mkimage unsorted-16x256K -s 16 -S 256K --unsorted)
+images[${#images[@]}]=$(mkimage trailing-4x1M -s 4 -S 1M -t 1000003)
+images[${#images[@]}]=$(mkimage signed8-4x1M -s 4 -S 1M -n 8)
+images[${#images[@]}]=$(mkimage pe32plus-4x16M -s 4 -S 16M)
+# an unaligned appended payload much bigger than the rest of the image;
+# signing it mustn't take much more memory than the image itself
+images[${#images[@]}]=$(mkimage trailing-4x1M-300M -s 4 -S 1M -t 300000001)
+
+if [ -n "${BENCH_CERTDIR:-}" -a -n "${BENCH_CERT:-}" ]; then
+	certdir=$BENCH_CERTDIR
+	cert=$BENCH_CERT
+elif type certutil >/dev/null 2>&1; then
+	certdir=$dir/db
+	cert=pebench
+	mkdir "$certdir"
+	certutil -N -d "$certdir" --empty-password
+	head -c 1024 /dev/urandom > "$dir/noise"
+	certutil -S -d "$certdir" -n "$cert" -s "CN=pesign benchmark" \
+		-t CT,CT,CT -x -k rsa -g 2048 -v 12 -z "$dir/noise" \
+		--keyUsage digitalSignature >/dev/null
+else
+	echo "certutil not found; set BENCH_CERTDIR and BENCH_CERT" >&2
+	exit 1
+fi
+
+"$srcdir/pebench" -r "$rounds" -n "$certdir" -c "$cert" -t "$token" \
+	"${images[@]}"
+
+fail() {
+	echo "bench: $*" >&2
+	exit 1
+}
+
+# pesign maps the image it signs, so its peak RSS is about the size of
+# the image; a copy of any big part of it shows up on top of that.
+check_rss() {
+	local report=$1 image=$2 what=$3
+	local rss=$(echo "$report" | awk '$1 == "peak_rss" { print $2 }')
+	local limit=$(( $(stat -c %s "$image") / 1024 + 65536 ))
+	test -n "$rss" || fail "$what reported no peak RSS for $image"
+	test "$rss" -le "$limit" ||
+		fail "$what peaked at ${rss}kB signing $image (limit ${limit}kB)"
+}
+
+# pebench times its own copy of the signing steps; this goes through
+# pesign's, where an attached signature takes exactly one sign_blob()
+# and doesn't need much more memory than the image.
+signed=$dir/signed.efi
+for image in "${images[@]}"; do
+	rm -f "$signed"
+	report=$(PESIGN_TIMING=1 "$srcdir/pesign" -n "$certdir" -c "$cert" \
+		-t "$token" -s -i "$image" -o "$signed" 2>&1 >/dev/null) ||
+		fail "pesign could not sign $image: $report"
+	blobs=$(echo "$report" | awk '$1 == "sign_blob" { print $2 }')
+	test "$blobs" = 1 ||
+		fail "pesign took ${blobs:-no} sign_blob() calls for $image"
+	check_rss "$report" "$image" pesign
+
+	cp "$image" "$signed"
+	report=$(PESIGN_TIMING=1 "$srcdir/pesign" -n "$certdir" -c "$cert" \
+		-t "$token" -s --in-place -i "$signed" 2>&1 >/dev/null) ||
+		fail "pesign could not sign $image in place: $report"
+	blobs=$(echo "$report" | awk '$1 == "sign_blob" { print $2 }')
+	test "$blobs" = 1 ||
+		fail "pesign --in-place took ${blobs:-no} sign_blob() calls" \
+			"for $image"
+	check_rss "$report" "$image" "pesign --in-place"
+done
+
+# and pesignd's, for one binary at a time and for a batch of them
+if [ -n "${BENCH_DAEMON:-}" ]; then
+	client=$srcdir/client
+	chmod -R a+rX "$dir"
+	"$srcdir/pesign" --daemonize --nofork -n "$certdir" \
+		> "$dir/pesignd.log" 2>&1 &
+	daemon=$!
+	for i in $(seq 50); do
+		"$client" --stats >/dev/null 2>&1 && break
+		kill -0 "$daemon" 2>/dev/null ||
+			fail "pesignd didn't start: $(cat "$dir/pesignd.log")"
+		sleep 0.1
+	done
+
+	: > "$dir/manifest"
+	for image in "${images[@]}"; do
+		rm -f "$signed"
+		"$client" -t "$token" -c "$cert" -s -i "$image" -o "$signed" ||
+			fail "pesign-client could not sign $image"
+		echo "$image $image.signed" >> "$dir/manifest"
+	done
+	"$client" -t "$token" -c "$cert" --batch "$dir/manifest" ||
+		fail "pesign-client could not sign a batch"
+
+	# the "sign" phase is counted once for each sign_blob()
+	blobs=$("$client" --stats | awk '$1 == "sign" { print $2 }')
+	"$client" -k
+	wait "$daemon" || :
+	daemon=
+	test "$blobs" = $((2 * ${#images[@]})) ||
+		fail "pesignd took ${blobs:-no} sign_blob() calls for" \
+			"$((2 * ${#images[@]})) signatures"
+fi
@@ -260,31 +260,68 @@ check_db(db_specifier which, pesigcheck_context *ctx, checkfn check,
 	return NOT_FOUND;
 }
 
+static SECOidTag
+hash_type_to_oid(efi_guid_t *sigtype)
+{
+	efi_guid_t efi_sha256 = efi_guid_sha256;
+	efi_guid_t efi_sha1 = efi_guid_sha1;
+
+	if (memcmp(sigtype, &efi_sha256, sizeof(efi_guid_t)) == 0)
+		return SEC_OID_SHA256;
+	if (memcmp(sigtype, &efi_sha1, sizeof(efi_guid_t)) == 0)
+		return SEC_OID_SHA1;
+	return SEC_OID_UNKNOWN;
+}
+
 static db_status
 check_hash(pesigcheck_context *ctx, SECItem *sig, efi_guid_t *sigtype,
 	   SECItem *pkcs7sig __attribute__((__unused__)))
 {
-	efi_guid_t efi_sha256 = efi_guid_sha256;
-	efi_guid_t efi_sha1 = efi_guid_sha1;
-	void *digest;
-
-	if (memcmp(sigtype, &efi_sha256, sizeof(efi_guid_t)) == 0) {
-		digest = ctx->cms_ctx->digests[0].pe_digest->data;
-		if (memcmp (digest, sig->data, 32) == 0)
-			return FOUND;
-	} else if (memcmp(sigtype, &efi_sha1, sizeof(efi_guid_t)) == 0) {
-		digest = ctx->cms_ctx->digests[1].pe_digest->data;
-		if (memcmp (digest, sig->data, 20) == 0)
-			return FOUND;
-	}
+	SECItem *digest;
+
+	digest = find_pe_digest(ctx->cms_ctx, hash_type_to_oid(sigtype));
+	if (!digest || digest->len != sig->len)
+		return NOT_FOUND;
+
+	if (memcmp(digest->data, sig->data, digest->len) == 0)
+		return FOUND;
 
 	return NOT_FOUND;
 }
 
 db_status
-check_db_hash(db_specifier which, pesigcheck_context *ctx)
+check_db_hash(db_specifier which, pesigcheck_context *ctx, SECItem *match)
 {
-	return check_db(which, ctx, check_hash, NULL, 0, NULL);
+	return check_db(which, ctx, check_hash, NULL, 0, match);
+}
+
+/* Add every hash type listed in db and dbx to the set of digests we'll
+ * compute for the binary. */
+void
+add_db_hash_types(pesigcheck_context *ctx)
+{
+	dblist *dbls[] = { ctx->db, ctx->dbx };
+
+	for (unsigned int i = 0; i < sizeof (dbls) / sizeof (dbls[0]); i++) {
+		for (dblist *dbl = dbls[i]; dbl; dbl = dbl->next) {
+			EFI_SIGNATURE_LIST *certlist = dbl->data;
+			size_t dbsize = dbl->datalen;
+
+			while (dbsize > 0 &&
+			       dbsize >= certlist->SignatureListSize) {
+				SECOidTag oid;
+
+				oid = hash_type_to_oid(&certlist->SignatureType);
+				if (oid != SEC_OID_UNKNOWN)
+					digest_set_add(ctx->cms_ctx, oid);
+
+				dbsize -= certlist->SignatureListSize;
+				certlist = (EFI_SIGNATURE_LIST *)
+					((uint8_t *)certlist +
+					 certlist->SignatureListSize);
+			}
+		}
+	}
 }
 
 static void
@@ -41,7 +41,9 @@ typedef struct {
 	uint32_t	SignatureSize;
 } EFI_SIGNATURE_LIST;
 
-extern db_status check_db_hash(db_specifier which, pesigcheck_context *ctx);
+extern db_status check_db_hash(db_specifier which, pesigcheck_context *ctx,
+				SECItem *match);
+extern void add_db_hash_types(pesigcheck_context *ctx);
 extern db_status check_db_cert(db_specifier which, pesigcheck_context *ctx,
 				void *data, ssize_t datalen, SECItem *match);
 
@@ -16,9 +16,12 @@
  * Author(s): Peter Jones <pjones@redhat.com>
  */
 
+#include <dirent.h>
 #include <err.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <inttypes.h>
+#include <poll.h>
 #include <popt.h>
 #include <pwd.h>
 #include <stddef.h>
@@ -27,15 +30,20 @@
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/un.h>
+#include <time.h>
 
 #include "pesign.h"
 
+#include <nss.h>
+#include <prerror.h>
+
 #define NO_FLAGS		0x00
 #define UNLOCK_TOKEN		0x01
 #define KILL_DAEMON		0x02
 #define SIGN_BINARY		0x04
 #define IS_TOKEN_UNLOCKED	0x08
-#define FLAG_LIST_END		0x10
+#define GET_STATS		0x10
+#define FLAG_LIST_END		0x20
 
 static struct {
 	int flag;
@@ -45,6 +53,7 @@ static struct {
 	{KILL_DAEMON, "kill"},
 	{SIGN_BINARY, "sign"},
 	{IS_TOKEN_UNLOCKED, "is-unlocked"},
+	{GET_STATS, "stats"},
 	{FLAG_LIST_END, NULL},
 };
 
@@ -57,6 +66,9 @@ print_flag_name(FILE *f, int flag)
 	}
 }
 
+static void
+negotiate(int sd);
+
 static int
 connect_to_server(void)
 {
@@ -88,48 +100,109 @@ connect_to_server(void)
 		exit(1);
 	}
 
+	negotiate(sd);
 	return sd;
 }
 
-static int32_t
-check_response(int sd, char **srvmsg);
-
+/*
+ * What we've agreed with the daemon on this connection: the protocol,
+ * and if it's 2 or later, the version of every command it knows and how
+ * much it will take on at once.
+ */
+static uint32_t protocol = 1;
+static uint32_t last_id;
+static pesignd_cmd_version *server_cmds;
+static size_t num_server_cmds;
+static pesignd_limits server_limits;
+
+/*
+ * Send one request, with its payload.  Protocol 2 requests get the next
+ * id and carry their file descriptors along with them; for protocol 1,
+ * the caller has to send those afterwards with send_fd().
+ */
 static void
-check_cmd_version(int sd, uint32_t command, char *name, int32_t version)
+send_request(int sd, uint32_t command, void *payload, uint32_t size,
+	     int *fds, int nfds)
 {
 	struct msghdr msg;
-	struct iovec iov[1];
-	pesignd_msghdr pm;
-
-	pm.version = PESIGND_VERSION;
-	pm.command = CMD_GET_CMD_VERSION;
-	pm.size = sizeof(command);
-	iov[0].iov_base = &pm;
-	iov[0].iov_len = sizeof(pm);
+	struct iovec iov[2];
+	pesignd_msghdr_v2 pm = {
+		.command = command,
+		.size = size,
+	};
+	size_t controllen = CMSG_SPACE(sizeof(int) * nfds);
+	char *control = NULL;
 
 	memset(&msg, '\0', sizeof(msg));
+	iov[0].iov_base = &pm;
+	if (protocol >= 2) {
+		pm.version = PESIGND_VERSION_2;
+		pm.id = ++last_id;
+		iov[0].iov_len = sizeof(pm);
+	} else {
+		pm.version = PESIGND_VERSION;
+		iov[0].iov_len = sizeof(pesignd_msghdr);
+	}
+	iov[1].iov_base = payload;
+	iov[1].iov_len = size;
 	msg.msg_iov = iov;
-	msg.msg_iovlen = 1;
+	msg.msg_iovlen = size ? 2 : 1;
 
-	ssize_t n;
-	n = sendmsg(sd, &msg, 0);
+	if (protocol >= 2 && nfds > 0) {
+		control = calloc(1, controllen);
+		if (!control) {
+			fprintf(stderr, "pesign-client: could not allocate "
+				"memory: %m\n");
+			exit(1);
+		}
+		msg.msg_control = control;
+		msg.msg_controllen = controllen;
+
+		struct cmsghdr *cm = CMSG_FIRSTHDR(&msg);
+		cm->cmsg_len = CMSG_LEN(sizeof(int) * nfds);
+		cm->cmsg_level = SOL_SOCKET;
+		cm->cmsg_type = SCM_RIGHTS;
+		memcpy(CMSG_DATA(cm), fds, sizeof(int) * nfds);
+	}
+
+	ssize_t n = sendmsg(sd, &msg, MSG_NOSIGNAL);
 	if (n < 0) {
-		fprintf(stderr, "check-cmd-version: kill daemon failed: %m\n");
+		fprintf(stderr, "pesign-client: sendmsg failed: %m\n");
 		exit(1);
 	}
+	free(control);
+}
 
-	iov[0].iov_base = &command;
-	iov[0].iov_len = sizeof(command);
+static int32_t
+read_response(int sd, char **data, size_t *len);
 
-	msg.msg_iov = iov;
-	msg.msg_iovlen = 1;
+static int32_t
+check_response(int sd, char **srvmsg);
 
-	n = sendmsg(sd, &msg, 0);
-	if (n < 0)
-		err(1, "check-cmd-version: sendmsg failed");
+static int32_t
+get_cmd_version(int sd, uint32_t command)
+{
+	if (protocol >= 2) {
+		for (size_t i = 0; i < num_server_cmds; i++) {
+			if (server_cmds[i].command == command)
+				return server_cmds[i].version;
+		}
+		return -1;
+	}
+
+	send_request(sd, CMD_GET_CMD_VERSION, &command, sizeof(command),
+		     NULL, 0);
 
 	char *srvmsg = NULL;
 	int32_t rc = check_response(sd, &srvmsg);
+	free(srvmsg);
+	return rc;
+}
+
+static void
+check_cmd_version(int sd, uint32_t command, char *name, int32_t version)
+{
+	int32_t rc = get_cmd_version(sd, command);
 	if (rc < 0)
 		errx(1, "command \"%s\" not known by server", name);
 	if (rc != version)
@@ -137,86 +210,183 @@ check_cmd_version(int sd, uint32_t command, char *name, int32_t version)
 			name, version, rc);
 }
 
+/*
+ * Move to the newest protocol the daemon speaks.  Older daemons don't
+ * know how to negotiate, and we just keep talking to them the old way.
+ */
 static void
-send_kill_daemon(int sd)
+negotiate(int sd)
 {
-	struct msghdr msg;
-	struct iovec iov;
-	pesignd_msghdr pm;
+	/* every new connection starts out talking protocol 1 */
+	protocol = 1;
+	if (get_cmd_version(sd, CMD_NEGOTIATE) != 1)
+		return;
+
+	uint32_t proto = PESIGND_PROTOCOL;
+	send_request(sd, CMD_NEGOTIATE, &proto, sizeof(proto), NULL, 0);
+
+	char *data = NULL;
+	size_t len = 0;
+	int32_t rc = read_response(sd, &data, &len);
+	if (rc < 2) {
+		free(data);
+		return;
+	}
 
-	check_cmd_version(sd, CMD_KILL_DAEMON, "kill-daemon", 0);
+	if (len < sizeof(server_limits)) {
+		fprintf(stderr, "pesign-client: got invalid negotiation "
+			"response from server\n");
+		exit(1);
+	}
+	memcpy(&server_limits, data, sizeof(server_limits));
+	len -= sizeof(server_limits);
+	memmove(data, data + sizeof(server_limits), len);
+
+	protocol = rc;
+	free(server_cmds);
+	server_cmds = (pesignd_cmd_version *)data;
+	num_server_cmds = len / sizeof(*server_cmds);
+}
 
-	pm.version = PESIGND_VERSION;
-	pm.command = CMD_KILL_DAEMON;
-	pm.size = 0;
+#define BUSY_RETRIES	10
 
-	iov.iov_base = &pm;
-	iov.iov_len = sizeof(pm);
+/* How long to wait, in milliseconds, before trying again after being
+ * turned away. */
+static unsigned int
+busy_delay(int tries)
+{
+	static int seeded;
 
-	memset(&msg, '\0', sizeof(msg));
-	msg.msg_iov = &iov;
-	msg.msg_iovlen = 1;
+	if (!seeded) {
+		srand(getpid() ^ time(NULL));
+		seeded = 1;
+	}
 
-	ssize_t n;
+	unsigned int ms = 50 << (tries < 6 ? tries : 6);
+	return ms + rand() % ms;
+}
 
-	n = sendmsg(sd, &msg, 0);
-	if (n < 0) {
-		fprintf(stderr, "pesign-client: kill daemon failed: %m\n");
-		exit(1);
-	}
+/*
+ * The server turned a request away because it's busy; wait a little
+ * longer each time before sending it again, and give up eventually.
+ */
+static int
+wait_for_server(int *tries)
+{
+	if (++*tries > BUSY_RETRIES)
+		return -1;
+	usleep(busy_delay(*tries) * 1000);
+	return 0;
+}
+
+static void
+send_kill_daemon(int sd)
+{
+	check_cmd_version(sd, CMD_KILL_DAEMON, "kill-daemon", 0);
+	send_request(sd, CMD_KILL_DAEMON, NULL, 0, NULL, 0);
 }
 
+/*
+ * Read one response from the server, to whichever request it answers;
+ * with protocol 2, that request's id is put in *id.  Whatever it carries
+ * after the return code - usually an error message - is put in a NUL
+ * terminated buffer in *data, with its length in *len.
+ */
 static int32_t
-check_response(int sd, char **srvmsg)
+read_message(int sd, uint32_t *id, char **data, size_t *len)
 {
+	pesignd_msghdr_v2 pm;
+	pesignd_cmd_response *resp;
+	uint32_t version = protocol >= 2 ? PESIGND_VERSION_2
+					 : PESIGND_VERSION;
+	size_t hdrsize = protocol >= 2 ? sizeof(pesignd_msghdr_v2)
+				       : sizeof(pesignd_msghdr);
 	ssize_t n;
-	struct msghdr msg;
-	struct iovec iov;
-	char buffer[1024];
-
-	pesignd_msghdr *pm;
-
-	msg.msg_name = NULL;
-	msg.msg_namelen = 0;
-
-	memset(&msg, '\0', sizeof(msg));
-	memset(buffer, '\0', sizeof(buffer));
-
-	iov.iov_base = buffer;
-	iov.iov_len = 1023;
-	msg.msg_iov = &iov;
-	msg.msg_iovlen = 1;
 
-	n = recvmsg(sd, &msg, 0);
+	n = recv(sd, &pm, hdrsize, MSG_WAITALL);
 	if (n < 0) {
 		fprintf(stderr, "pesign-client: could not get response from "
 			"server: %m\n");
 		exit(1);
 	}
+	if ((size_t)n != hdrsize) {
+		fprintf(stderr, "pesign-client: could not get response from "
+			"server: connection closed\n");
+		exit(1);
+	}
 
-	pm = (pesignd_msghdr *)buffer;
-
-	if (pm->version != PESIGND_VERSION) {
+	if (pm.version != version) {
 		fprintf(stderr, "pesign-client: got version %d, "
-			"expected version %d\n", pm->version, PESIGND_VERSION);
+			"expected version %d\n", pm.version, version);
 		exit(1);
 	}
 
-	if (pm->command != CMD_RESPONSE) {
+	if (pm.command != CMD_RESPONSE) {
 		fprintf(stderr, "pesign-client: got unexpected response: %d\n",
-			pm->command);
+			pm.command);
+		exit(1);
+	}
+
+	if (pm.size < sizeof(resp->rc)) {
+		fprintf(stderr, "pesign-client: got response with invalid "
+			"size %u\n", pm.size);
+		exit(1);
+	}
+
+	char *buffer = calloc(1, pm.size + 1);
+	if (!buffer) {
+		fprintf(stderr, "pesign-client: could not allocate memory: "
+			"%m\n");
+		exit(1);
+	}
+
+	n = recv(sd, buffer, pm.size, MSG_WAITALL);
+	if (n < 0 || (size_t)n != pm.size) {
+		fprintf(stderr, "pesign-client: could not get response from "
+			"server: %s\n", n < 0 ? strerror(errno) :
+			"connection closed");
 		exit(1);
 	}
 
-	pesignd_cmd_response *resp = (pesignd_cmd_response *)((uint8_t *)pm +
-					offsetof(pesignd_msghdr, size) +
-					sizeof(pm->size));
+	resp = (pesignd_cmd_response *)buffer;
+	int32_t rc = resp->rc;
 
-	if (resp->rc == 0)
+	*len = pm.size - sizeof(resp->rc);
+	memmove(buffer, resp->errmsg, *len + 1);
+	*data = buffer;
+	*id = protocol >= 2 ? pm.id : 0;
+	return rc;
+}
+
+/* Read the response to the request we just sent. */
+static int32_t
+read_response(int sd, char **data, size_t *len)
+{
+	uint32_t id;
+
+	int32_t rc = read_message(sd, &id, data, len);
+	if (protocol >= 2 && id != last_id) {
+		fprintf(stderr, "pesign-client: got response to request %u, "
+			"expected %u\n", id, last_id);
+		exit(1);
+	}
+	return rc;
+}
+
+static int32_t
+check_response(int sd, char **srvmsg)
+{
+	char *data = NULL;
+	size_t len;
+
+	int32_t rc = read_response(sd, &data, &len);
+	if (rc == 0) {
+		free(data);
 		return 0;
+	}
 
-	*srvmsg = strdup((char *)resp->errmsg);
-	return resp->rc;
+	*srvmsg = data;
+	return rc;
 }
 
 static char *
@@ -278,34 +448,12 @@ get_token_pin(int pinfd, char *pinfile, char *envname)
 static void
 unlock_token(int sd, char *tokenname, char *pin)
 {
-	struct msghdr msg;
-	struct iovec iov[2];
-	pesignd_msghdr pm;
-
 	uint32_t size0 = pesignd_string_size(tokenname);
 
 	uint32_t size1 = pesignd_string_size(pin);
 
 	check_cmd_version(sd, CMD_UNLOCK_TOKEN, "unlock-token", 0);
 
-	pm.version = PESIGND_VERSION;
-	pm.command = CMD_UNLOCK_TOKEN;
-	pm.size = size0 + size1;
-	iov[0].iov_base = &pm;
-	iov[0].iov_len = sizeof (pm);
-
-	memset(&msg, '\0', sizeof(msg));
-	msg.msg_iov = iov;
-	msg.msg_iovlen = 1;
-
-	ssize_t n;
-	n = sendmsg(sd, &msg, 0);
-	if (n < 0) {
-		fprintf(stderr, "pesign-client: unlock token: sendmsg failed: "
-			"%m\n");
-		exit(1);
-	}
-
 	uint8_t *buffer = NULL;
 	buffer = calloc(1, size0 + size1);
 	if (!buffer) {
@@ -316,24 +464,11 @@ unlock_token(int sd, char *tokenname, char *pin)
 
 	pesignd_string *tn = (pesignd_string *)buffer;
 	pesignd_string_set(tn, tokenname);
-	iov[0].iov_base = tn;
-	iov[0].iov_len = size0;
 
 	pesignd_string *tp = pesignd_string_next(tn);
 	pesignd_string_set(tp, pin);
 
-	iov[1].iov_base = tp;
-	iov[1].iov_len = size1;
-
-	msg.msg_iov = iov;
-	msg.msg_iovlen = 2;
-
-	n = sendmsg(sd, &msg, 0);
-	if (n < 0) {
-		fprintf(stderr, "pesign-client: unlock token: sendmsg failed: "
-			"%m\n");
-		exit(1);
-	}
+	send_request(sd, CMD_UNLOCK_TOKEN, buffer, size0 + size1, NULL, 0);
 
 	char *srvmsg = NULL;
 	int rc = check_response(sd, &srvmsg);
@@ -349,29 +484,10 @@ unlock_token(int sd, char *tokenname, char *pin)
 static void
 is_token_unlocked(int sd, char *tokenname)
 {
-	struct msghdr msg;
-	struct iovec iov[1];
-	pesignd_msghdr pm;
-
 	uint32_t size0 = pesignd_string_size(tokenname);
 
 	check_cmd_version(sd, CMD_IS_TOKEN_UNLOCKED, "is-token-unlocked", 0);
 
-	pm.version = PESIGND_VERSION;
-	pm.command = CMD_IS_TOKEN_UNLOCKED;
-	pm.size = size0;
-	iov[0].iov_base = &pm;
-	iov[0].iov_len = sizeof (pm);
-
-	memset(&msg, '\0', sizeof(msg));
-	msg.msg_iov = iov;
-	msg.msg_iovlen = 1;
-
-	ssize_t n;
-	n = sendmsg(sd, &msg, 0);
-	if (n < 0)
-		err(1, "is_token_unlocked: sendmsg failed");
-
 	uint8_t *buffer = NULL;
 	buffer = calloc(1, size0);
 	if (!buffer)
@@ -379,15 +495,8 @@ is_token_unlocked(int sd, char *tokenname)
 
 	pesignd_string *tn = (pesignd_string *)buffer;
 	pesignd_string_set(tn, tokenname);
-	iov[0].iov_base = tn;
-	iov[0].iov_len = size0;
 
-	msg.msg_iov = iov;
-	msg.msg_iovlen = 1;
-
-	n = sendmsg(sd, &msg, 0);
-	if (n < 0)
-		err(1, "is_token_unlocked: sendmsg failed");
+	send_request(sd, CMD_IS_TOKEN_UNLOCKED, buffer, size0, NULL, 0);
 
 	char *srvmsg = NULL;
 	int rc = check_response(sd, &srvmsg);
@@ -398,6 +507,121 @@ is_token_unlocked(int sd, char *tokenname)
 	free(buffer);
 }
 
+static char *
+format_us(char *buf, size_t size, uint64_t us)
+{
+	if (us < 10000)
+		snprintf(buf, size, "%"PRIu64"us", us);
+	else if (us < 10000000)
+		snprintf(buf, size, "%"PRIu64"ms", us / 1000);
+	else
+		snprintf(buf, size, "%"PRIu64"s", us / 1000000);
+	return buf;
+}
+
+/* The upper bound of the bucket the q'th fraction of samples falls in. */
+static uint64_t
+percentile(pesignd_histogram *hist, double q)
+{
+	uint64_t want = hist->count * q + 0.5, seen = 0;
+
+	if (want == 0)
+		want = 1;
+	for (int i = 0; i < PESIGND_STATS_BUCKETS; i++) {
+		seen += hist->buckets[i];
+		if (seen >= want)
+			return 1ull << i;
+	}
+	return 1ull << (PESIGND_STATS_BUCKETS - 1);
+}
+
+/*
+ * Print a section of the statistics the daemon sent, and step past it.
+ * Returns -1 if it's not all there.
+ */
+static int
+print_histograms(char **pos, size_t *left, uint32_t count, char *title)
+{
+	char mean[16], p50[16], p90[16], p99[16];
+
+	printf("\n%-32s %8s %8s %8s %8s %8s %8s\n", title, "count",
+	       "errors", "mean", "p50", "p90", "p99");
+	for (uint32_t i = 0; i < count; i++) {
+		pesignd_histogram hist;
+		pesignd_string *name;
+
+		if (*left < sizeof (hist) + sizeof (name->size))
+			return -1;
+		memcpy(&hist, *pos, sizeof (hist));
+		*pos += sizeof (hist);
+		*left -= sizeof (hist);
+
+		name = (pesignd_string *)*pos;
+		if (*left - sizeof (name->size) < name->size ||
+				name->size == 0 ||
+				name->value[name->size - 1] != '\0')
+			return -1;
+		*pos = (char *)pesignd_string_next(name);
+		*left -= sizeof (name->size) + name->size;
+
+		if (hist.count == 0)
+			continue;
+		printf("  %-30s %8"PRIu64" %8"PRIu64" %8s %8s %8s %8s\n",
+		       name->value, hist.count, hist.errors,
+		       format_us(mean, sizeof (mean),
+				 hist.total_us / hist.count),
+		       format_us(p50, sizeof (p50), percentile(&hist, 0.5)),
+		       format_us(p90, sizeof (p90), percentile(&hist, 0.9)),
+		       format_us(p99, sizeof (p99), percentile(&hist, 0.99)));
+	}
+	return 0;
+}
+
+static void
+get_stats(int sd)
+{
+	pesignd_stats stats;
+
+	check_cmd_version(sd, CMD_GET_STATS, "get-stats", 0);
+	send_request(sd, CMD_GET_STATS, NULL, 0, NULL, 0);
+
+	char *data = NULL;
+	size_t len = 0;
+	int32_t rc = read_response(sd, &data, &len);
+	if (rc < 0)
+		errx(1, "%s", data);
+	if (len < sizeof (stats))
+		errx(1, "got invalid statistics from server");
+
+	char *pos = data;
+	memcpy(&stats, pos, sizeof (stats));
+	pos += sizeof (stats);
+	len -= sizeof (stats);
+
+	printf("uptime:       %"PRIu64"s, %"PRIu64" workers\n",
+	       stats.uptime, stats.workers);
+	printf("connections:  %"PRIu64" open, %"PRIu64" accepted, "
+	       "%"PRIu64" closed for bad requests\n",
+	       stats.connections, stats.accepted, stats.bad_requests);
+	printf("requests:     %"PRIu64" queued, %"PRIu64" in flight, "
+	       "%"PRIu64" turned away, %"PRIu64" token busy, "
+	       "%"PRIu64" timed out\n",
+	       stats.queued, stats.in_flight, stats.rejected,
+	       stats.token_busy, stats.expired);
+	printf("bytes hashed: %"PRIu64"\n", stats.bytes_hashed);
+	printf("contexts:     %"PRIu64" created, %"PRIu64" reused\n",
+	       stats.contexts_created, stats.contexts_reused);
+	printf("heap:         %"PRIu64" bytes in use\n", stats.heap_in_use);
+
+	if (print_histograms(&pos, &len, stats.ncommands, "command") < 0 ||
+			print_histograms(&pos, &len, stats.nphases,
+					 "phase") < 0 ||
+			print_histograms(&pos, &len, stats.nkeys, "key") < 0)
+		errx(1, "got invalid statistics from server");
+
+	free(data);
+}
+
 static void
 send_fd(int sd, int fd)
 {
@@ -441,101 +665,880 @@ send_fd(int sd, int fd)
 	}
 }
 
+/*
+ * Hand the daemon the files themselves, and let it hash the binary and
+ * write the output.
+ */
+static int
+sign_fds(int sd, int infd, int outfd, char *tokenname, char *certname,
+	 int attached)
+{
+	uint32_t size0 = pesignd_string_size(tokenname);
+	uint32_t size1 = pesignd_string_size(certname);
+	int fds[] = { infd, outfd };
+
+	check_cmd_version(sd, attached ? CMD_SIGN_ATTACHED : CMD_SIGN_DETACHED,
+			attached ? "sign-attached" : "sign-detached", 0);
+
+	char *buffer;
+	buffer = malloc(size0 + size1);
+	if (!buffer) {
+		fprintf(stderr, "pesign-client: could not allocate memory: "
+			"%m\n");
+		exit(1);
+	}
+
+	pesignd_string *tn = (pesignd_string *)buffer;
+	pesignd_string_set(tn, tokenname);
+
+	pesignd_string *cn = pesignd_string_next(tn);
+	pesignd_string_set(cn, certname);
+
+	char *srvmsg = NULL;
+	int rc, tries = 0;
+	while (1) {
+		send_request(sd, attached ? CMD_SIGN_ATTACHED
+					  : CMD_SIGN_DETACHED,
+			     buffer, size0 + size1, fds, 2);
+
+		if (protocol < 2) {
+			send_fd(sd, infd);
+			send_fd(sd, outfd);
+		}
+
+		rc = check_response(sd, &srvmsg);
+		if (rc != PESIGND_BUSY || wait_for_server(&tries) < 0)
+			break;
+		free(srvmsg);
+		srvmsg = NULL;
+	}
+	free(buffer);
+
+	if (rc < 0) {
+		fprintf(stderr, "pesign-client: signing failed: \"%s\"\n",
+			srvmsg);
+		free(srvmsg);
+		return -1;
+	}
+	free(srvmsg);
+	return 0;
+}
+
+/* A binary we're hashing here, for the daemon to sign the digest of. */
+typedef struct {
+	cms_context *cms;
+	Pe *inpe, *outpe;
+	int outfd;
+	int attached;
+} digest_job;
+
+/*
+ * Hash the binary, laid out the way it will be once it's signed, setting
+ * up the output to take the signature if it's attached.  NSS has to be
+ * initialized already.  Whatever happens, end_digest() cleans up after.
+ */
+static int
+hash_binary(digest_job *job, int infd, int outfd, char *digest, int attached)
+{
+	Pe *pe;
+
+	memset(job, '\0', sizeof (*job));
+	job->outfd = outfd;
+	job->attached = attached;
+
+	if (cms_context_alloc(&job->cms) < 0) {
+		fprintf(stderr, "pesign-client: could not allocate memory: "
+			"%m\n");
+		exit(1);
+	}
+	if (set_digest_parameters(job->cms, digest) < 0) {
+		fprintf(stderr, "pesign-client: digest \"%s\" not found\n",
+			digest);
+		return -1;
+	}
+
+	pe = job->inpe = pe_begin(infd, PE_C_READ_MMAP, NULL);
+	if (!job->inpe) {
+		fprintf(stderr, "pesign-client: could not load input file: "
+			"%s\n", pe_errmsg(pe_errno()));
+		return -1;
+	}
+
+	if (parse_signatures(&job->cms->signatures, &job->cms->num_signatures,
+			     job->inpe) < 0) {
+		fprintf(stderr, "pesign-client: could not parse signature "
+			"list in EFI binary\n");
+		return -1;
+	}
+
+	if (attached) {
+		if (pe_copyfile(job->inpe, outfd) < 0) {
+			fprintf(stderr, "pesign-client: could not write output "
+				"file: %m\n");
+			return -1;
+		}
+
+		pe = job->outpe = pe_begin(outfd, PE_C_RDWR_MMAP, NULL);
+		if (!job->outpe) {
+			fprintf(stderr, "pesign-client: could not load output "
+				"file: %s\n", pe_errmsg(pe_errno()));
+			return -1;
+		}
+		pe_clearcert(job->outpe);
+
+		if (reserve_cert_table(job->outpe) < 0) {
+			fprintf(stderr, "pesign-client: could not allocate "
+				"space for signature: %s\n",
+				pe_errmsg(pe_errno()));
+			return -1;
+		}
+	}
+
+	if (generate_digest(job->cms, pe, 1) < 0) {
+		fprintf(stderr, "pesign-client: could not generate digest\n");
+		return -1;
+	}
+
+	/* the signatures it had are copied, and that's all we need now */
+	pe_end(job->inpe);
+	job->inpe = NULL;
+	return 0;
+}
+
+static SECItem *
+job_digest(digest_job *job)
+{
+	return job->cms->digests[job->cms->selected_digest].pe_digest;
+}
+
+/* Put the signature the daemon sent back in the output; it's ours to
+ * free now. */
+static int
+implant_signature(digest_job *job, void *sig, size_t siglen)
+{
+	job->cms->newsig.data = sig;
+	job->cms->newsig.len = siglen;
+
+	if (job->attached) {
+		insert_signature(job->cms, job->cms->num_signatures);
+		if (finalize_cms_signatures(job->cms, job->outpe) < 0) {
+			fprintf(stderr, "pesign-client: could not add "
+				"signature to output file\n");
+			return -1;
+		}
+		update_cms_image(job->cms, job->outpe, PE_C_RDWR_MMAP);
+	} else {
+		ftruncate(job->outfd, 0);
+		ssize_t len = export_signature(job->cms, job->outfd, 0);
+		if (len < 0) {
+			fprintf(stderr, "pesign-client: could not write "
+				"signature\n");
+			return -1;
+		}
+		ftruncate(job->outfd, len);
+	}
+	return 0;
+}
+
 static void
+end_digest(digest_job *job, int rc)
+{
+	if (job->outpe)
+		pe_end(job->outpe);
+	if (job->inpe)
+		pe_end(job->inpe);
+	if (rc < 0)
+		ftruncate(job->outfd, 0);
+	if (job->cms) {
+		teardown_digests(job->cms);
+		cms_context_fini(job->cms);
+	}
+	memset(job, '\0', sizeof (*job));
+}
+
+/*
+ * Hash the binary here, and only send the daemon the digest.  It sends
+ * back the signature, which we put in the output ourselves.
+ */
+static int
+sign_digest(int sd, int infd, int outfd, char *tokenname, char *certname,
+	    char *digest, int attached)
+{
+	digest_job job;
+	char *sig = NULL;
+	int ret = -1;
+
+	if (NSS_NoDB_Init(NULL) != SECSuccess) {
+		fprintf(stderr, "pesign-client: could not initialize NSS: "
+			"%s\n", PORT_ErrorToString(PORT_GetError()));
+		return -1;
+	}
+
+	if (hash_binary(&job, infd, outfd, digest, attached) < 0)
+		goto out;
+	SECItem *pe_digest = job_digest(&job);
+
+	uint32_t size0 = pesignd_string_size(tokenname);
+	uint32_t size1 = pesignd_string_size(certname);
+	uint32_t size2 = pesignd_string_size(digest);
+	uint32_t size3 = sizeof(uint32_t) + pe_digest->len;
+
+	char *buffer = malloc(size0 + size1 + size2 + size3);
+	if (!buffer) {
+		fprintf(stderr, "pesign-client: could not allocate memory: "
+			"%m\n");
+		exit(1);
+	}
+
+	pesignd_string *tn = (pesignd_string *)buffer;
+	pesignd_string_set(tn, tokenname);
+	pesignd_string *cn = pesignd_string_next(tn);
+	pesignd_string_set(cn, certname);
+	pesignd_string *dn = pesignd_string_next(cn);
+	pesignd_string_set(dn, digest);
+	pesignd_string *dv = pesignd_string_next(dn);
+	dv->size = pe_digest->len;
+	memcpy(dv->value, pe_digest->data, pe_digest->len);
+
+	size_t siglen = 0;
+	int32_t rc;
+	int tries = 0;
+	while (1) {
+		send_request(sd, CMD_SIGN_DIGEST, buffer,
+			     size0 + size1 + size2 + size3, NULL, 0);
+		rc = read_response(sd, &sig, &siglen);
+		if (rc != PESIGND_BUSY || wait_for_server(&tries) < 0)
+			break;
+		free(sig);
+		sig = NULL;
+	}
+	free(buffer);
+
+	if (rc != 0 || siglen == 0) {
+		fprintf(stderr, "pesign-client: signing failed: \"%s\"\n",
+			rc != 0 && sig ? sig : "no signature returned");
+		goto out;
+	}
+
+	ret = implant_signature(&job, sig, siglen);
+	sig = NULL;
+out:
+	free(sig);
+	end_digest(&job, ret);
+	NSS_Shutdown();
+	return ret;
+}
+
+/*
+ * Daemons new enough to sign a bare digest get just that; older ones get
+ * the files.
+ */
+static int
 sign(int sd, char *infile, char *outfile, char *tokenname, char *certname,
-	int attached)
+	char *digest, int attached)
 {
+	int rc;
+
 	int infd = open(infile, O_RDONLY);
 	if (infd < 0) {
 		fprintf(stderr, "pesign-client: could not open input file "
 			"\"%s\": %m\n", infile);
-		exit(1);
+		return -1;
 	}
 
 	int outfd = open(outfile, O_RDWR|O_CREAT, 0600);
 	if (outfd < 0) {
 		fprintf(stderr, "pesign-client: could not open output file "
 			"\"%s\": %m\n", outfile);
-		exit(1);
+		close(infd);
+		return -1;
 	}
 
-	struct msghdr msg;
-	struct iovec iov[2];
+	if (get_cmd_version(sd, CMD_SIGN_DIGEST) == 0)
+		rc = sign_digest(sd, infd, outfd, tokenname, certname, digest,
+				 attached);
+	else
+		rc = sign_fds(sd, infd, outfd, tokenname, certname, attached);
 
-	uint32_t size0 = pesignd_string_size(tokenname);
-	uint32_t size1 = pesignd_string_size(certname);
+	close(infd);
+	close(outfd);
+	return rc;
+}
 
-	pesignd_msghdr *pm;
-	pm = calloc(1, sizeof(*pm));
-	if (!pm) {
-oom:
+typedef struct {
+	char *infile;
+	char *outfile;
+	int attached;
+	int infd, outfd;
+	digest_job job;		/* while it's waiting to be signed */
+} batch_file;
+
+static void
+add_batch_file(batch_file **files, int *nfiles, char *infile, char *outfile,
+	       int attached)
+{
+	batch_file *file;
+
+	*files = realloc(*files, (*nfiles + 1) * sizeof (**files));
+	if (!*files) {
 		fprintf(stderr, "pesign-client: could not allocate memory: "
 			"%m\n");
 		exit(1);
 	}
+	file = &(*files)[(*nfiles)++];
+	memset(file, '\0', sizeof (*file));
+	file->infile = infile;
+	file->outfile = outfile;
+	file->attached = attached;
+	file->infd = file->outfd = -1;
+}
 
-	check_cmd_version(sd, attached ? CMD_SIGN_ATTACHED : CMD_SIGN_DETACHED,
-			attached ? "sign-attached" : "sign-detached", 0);
+/*
+ * Read a batch manifest: one binary per line, as "infile outfile", and
+ * optionally "attached" or "detached" to override the default.  Blank
+ * lines and lines starting with '#' are skipped.
+ */
+static batch_file *
+read_manifest(char *manifest, int attached, int *nfiles)
+{
+	FILE *f = strcmp(manifest, "-") ? fopen(manifest, "r") : stdin;
+	if (!f) {
+		fprintf(stderr, "pesign-client: could not open \"%s\": %m\n",
+			manifest);
+		exit(1);
+	}
 
-	pm->version = PESIGND_VERSION;
-	pm->command = attached ? CMD_SIGN_ATTACHED : CMD_SIGN_DETACHED;
-	pm->size = size0 + size1;
-	iov[0].iov_base = pm;
-	iov[0].iov_len = sizeof (*pm);
+	batch_file *files = NULL;
+	char *line = NULL;
+	size_t size = 0;
+	int lineno = 0;
+
+	*nfiles = 0;
+	while (getline(&line, &size, f) >= 0) {
+		char *save = NULL, *infile, *outfile, *mode;
+
+		lineno++;
+		infile = strtok_r(line, " \t\n", &save);
+		if (!infile || infile[0] == '#')
+			continue;
+		outfile = strtok_r(NULL, " \t\n", &save);
+		mode = strtok_r(NULL, " \t\n", &save);
+		if (!outfile || strtok_r(NULL, " \t\n", &save) ||
+				(mode && strcmp(mode, "attached") &&
+				 strcmp(mode, "detached"))) {
+			fprintf(stderr, "pesign-client: %s:%d: invalid "
+				"manifest entry\n", manifest, lineno);
+			exit(1);
+		}
 
-	memset(&msg, '\0', sizeof(msg));
-	msg.msg_iov = iov;
-	msg.msg_iovlen = 1;
+		infile = strdup(infile);
+		outfile = strdup(outfile);
+		if (!infile || !outfile) {
+			fprintf(stderr, "pesign-client: could not allocate "
+				"memory: %m\n");
+			exit(1);
+		}
+		add_batch_file(&files, nfiles, infile, outfile,
+			       mode ? !strcmp(mode, "attached") : attached);
+	}
 
-	ssize_t n;
-	n = sendmsg(sd, &msg, 0);
+	free(line);
+	if (f != stdin)
+		fclose(f);
+	return files;
+}
+
+/* Does this look like a PE binary?  Anything else in a directory isn't
+ * ours to sign. */
+static int
+is_pe_file(char *path)
+{
+	char magic[2];
+	struct stat sb;
+
+	int fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return 0;
+	int rc = fstat(fd, &sb) == 0 && S_ISREG(sb.st_mode) &&
+		 read(fd, magic, sizeof(magic)) == sizeof(magic) &&
+		 magic[0] == 'M' && magic[1] == 'Z';
+	close(fd);
+	return rc;
+}
+
+/*
+ * Make a batch of every PE binary in dir, each to be signed into a file
+ * of the same name in outdir, or for a detached signature, that name with
+ * ".sig" on the end.
+ */
+static batch_file *
+read_dir(char *dir, char *outdir, int attached, int *nfiles)
+{
+	struct stat insb, outsb;
+	struct dirent **names = NULL;
+
+	if (stat(dir, &insb) < 0 || !S_ISDIR(insb.st_mode)) {
+		fprintf(stderr, "pesign-client: \"%s\" is not a directory\n",
+			dir);
+		exit(1);
+	}
+	if (stat(outdir, &outsb) < 0 || !S_ISDIR(outsb.st_mode)) {
+		fprintf(stderr, "pesign-client: \"%s\" is not a directory\n",
+			outdir);
+		exit(1);
+	}
+	if (attached && insb.st_dev == outsb.st_dev &&
+			insb.st_ino == outsb.st_ino) {
+		fprintf(stderr, "pesign-client: signed binaries can't be "
+			"written to the directory they're read from\n");
+		exit(1);
+	}
+
+	int n = scandir(dir, &names, NULL, alphasort);
 	if (n < 0) {
-		fprintf(stderr, "pesign-client: sign: sendmsg failed: "
+		fprintf(stderr, "pesign-client: could not read \"%s\": %m\n",
+			dir);
+		exit(1);
+	}
+
+	batch_file *files = NULL;
+	*nfiles = 0;
+	for (int i = 0; i < n; i++) {
+		char *name = names[i]->d_name;
+		char *infile = NULL, *outfile = NULL;
+
+		if (name[0] == '.') {
+			free(names[i]);
+			continue;
+		}
+		if (asprintf(&infile, "%s/%s", dir, name) < 0) {
+oom:
+			fprintf(stderr, "pesign-client: could not allocate "
+				"memory: %m\n");
+			exit(1);
+		}
+		if (!is_pe_file(infile)) {
+			free(infile);
+			free(names[i]);
+			continue;
+		}
+		if (asprintf(&outfile, "%s/%s%s", outdir, name,
+			     attached ? "" : ".sig") < 0)
+			goto oom;
+		add_batch_file(&files, nfiles, infile, outfile, attached);
+		free(names[i]);
+	}
+	free(names);
+	return files;
+}
+
+typedef struct {
+	int sd;
+	int outstanding;
+} batch_conn;
+
+/* Each hashed binary keeps its output open until its signature comes
+ * back; don't have more than this waiting at once. */
+#define MAX_HASHED	256
+
+/* Some of a batch's binaries, hashed and sent to the server as one
+ * CMD_SIGN_BATCH. */
+typedef struct {
+	batch_file **files;
+	int nfiles;
+	char *payload;
+	uint32_t size;
+	int tries;		/* times the server has turned it away */
+	uint64_t retry_at;	/* and when we can send it again */
+	int conn;		/* which connection it's in flight on, or -1 */
+	uint32_t id;		/* and the id of that request */
+} batch_chunk;
+
+static uint64_t
+now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void
+close_batch_file(batch_file *file, int rc)
+{
+	end_digest(&file->job, rc);
+	if (file->infd >= 0)
+		close(file->infd);
+	if (file->outfd >= 0)
+		close(file->outfd);
+	file->infd = file->outfd = -1;
+}
+
+static int
+hash_batch_file(batch_file *file, char *digest)
+{
+	file->infd = open(file->infile, O_RDONLY);
+	if (file->infd < 0) {
+		fprintf(stderr, "pesign-client: could not open input file "
+			"\"%s\": %m\n", file->infile);
+		return -1;
+	}
+	file->outfd = open(file->outfile, O_RDWR|O_CREAT, 0600);
+	if (file->outfd < 0) {
+		fprintf(stderr, "pesign-client: could not open output file "
+			"\"%s\": %m\n", file->outfile);
+		close(file->infd);
+		file->infd = -1;
+		return -1;
+	}
+	if (hash_binary(&file->job, file->infd, file->outfd, digest,
+			file->attached) < 0) {
+		fprintf(stderr, "pesign-client: signing \"%s\" failed\n",
+			file->infile);
+		close_batch_file(file, -1);
+		return -1;
+	}
+	close(file->infd);
+	file->infd = -1;
+	return 0;
+}
+
+/*
+ * Hash up to size of the files starting at *next, and put them in a
+ * chunk, along with the request that signs their digests.  Returns how
+ * many couldn't be hashed.
+ */
+static int
+fill_chunk(batch_chunk *chunk, batch_file *files, int nfiles, int *next,
+	   int size, char *tokenname, char *certname, char *digest)
+{
+	uint32_t size0 = pesignd_string_size(tokenname);
+	uint32_t size1 = pesignd_string_size(certname);
+	uint32_t size2 = pesignd_string_size(digest);
+	uint32_t count = 0;
+	size_t len = sizeof(count);
+	int failed = 0;
+
+	chunk->files = calloc(size, sizeof (*chunk->files));
+	chunk->payload = malloc(len);
+	if (!chunk->files || !chunk->payload) {
+oom:
+		fprintf(stderr, "pesign-client: could not allocate memory: "
 			"%m\n");
 		exit(1);
 	}
+	chunk->conn = -1;
 
-	char *buffer;
-	buffer = malloc(size0 + size1);
-	if (!buffer)
-		goto oom;
+	for (; *next < nfiles && (int)count + failed < size; (*next)++) {
+		batch_file *file = &files[*next];
 
-	pesignd_string *tn = (pesignd_string *)buffer;
-	pesignd_string_set(tn, tokenname);
-	iov[0].iov_base = tn;
-	iov[0].iov_len = size0;
+		if (hash_batch_file(file, digest) < 0) {
+			failed++;
+			continue;
+		}
 
-	pesignd_string *cn = pesignd_string_next(tn);
-	pesignd_string_set(cn, certname);
-	iov[1].iov_base = cn;
-	iov[1].iov_len = size1;
+		SECItem *pe_digest = job_digest(&file->job);
+		uint32_t flags = PESIGND_BATCH_DIGEST;
+		if (file->attached)
+			flags |= PESIGND_BATCH_ATTACHED;
+
+		size_t entry = sizeof(flags) + size0 + size1 + size2 +
+			       sizeof(uint32_t) + pe_digest->len;
+		char *payload = realloc(chunk->payload, len + entry);
+		if (!payload)
+			goto oom;
+		chunk->payload = payload;
+
+		char *pos = chunk->payload + len;
+		memcpy(pos, &flags, sizeof(flags));
+		pos += sizeof(flags);
+		pesignd_string *tn = (pesignd_string *)pos;
+		pesignd_string_set(tn, tokenname);
+		pesignd_string *cn = pesignd_string_next(tn);
+		pesignd_string_set(cn, certname);
+		pesignd_string *dn = pesignd_string_next(cn);
+		pesignd_string_set(dn, digest);
+		pesignd_string *dv = pesignd_string_next(dn);
+		dv->size = pe_digest->len;
+		memcpy(dv->value, pe_digest->data, pe_digest->len);
+
+		len += entry;
+		chunk->files[count++] = file;
+	}
 
-	msg.msg_iov = iov;
-	msg.msg_iovlen = 2;
+	memcpy(chunk->payload, &count, sizeof(count));
+	chunk->size = len;
+	chunk->nfiles = count;
+	return failed;
+}
 
-	n = sendmsg(sd, &msg, 0);
-	if (n < 0) {
-		fprintf(stderr, "pesign-client: sign: sendmsg failed: "
+/*
+ * The server has answered a chunk, or turned it away too many times; put
+ * each signature it sent back in its output, report each binary in it
+ * that wasn't signed, and return how many.
+ */
+static int
+finish_chunk(batch_chunk *chunk, int32_t rc, char *data, size_t len)
+{
+	char *pos = data;
+	int failed = 0;
+
+	for (int i = 0; i < chunk->nfiles; i++) {
+		batch_file *file = chunk->files[i];
+		char *msg = data;
+		int32_t entry_rc = rc;
+
+		if (rc != PESIGND_BUSY) {
+			pesignd_string *str = (pesignd_string *)
+						(pos + sizeof(entry_rc));
+			if (len < sizeof(entry_rc) + sizeof(str->size) ||
+					len - sizeof(entry_rc) -
+					sizeof(str->size) < str->size) {
+invalid:
+				fprintf(stderr, "pesign-client: got invalid "
+					"batch response from server\n");
+				exit(1);
+			}
+			memcpy(&entry_rc, pos, sizeof(entry_rc));
+			len -= sizeof(entry_rc) + sizeof(str->size) +
+			       str->size;
+			pos = (char *)pesignd_string_next(str);
+
+			if (entry_rc >= 0) {
+				/* the signature */
+				if (str->size == 0)
+					goto invalid;
+				void *sig = malloc(str->size);
+				if (!sig) {
+					fprintf(stderr, "pesign-client: could "
+						"not allocate memory: %m\n");
+					exit(1);
+				}
+				memcpy(sig, str->value, str->size);
+				entry_rc = implant_signature(&file->job, sig,
+							     str->size);
+				msg = "could not write output";
+			} else if (str->size &&
+				   str->value[str->size - 1] != '\0') {
+				goto invalid;
+			} else {
+				msg = str->size ? (char *)str->value : "";
+			}
+		}
+
+		if (entry_rc < 0) {
+			fprintf(stderr, "pesign-client: signing \"%s\" failed: "
+				"\"%s\"\n", file->infile, msg);
+			failed++;
+		}
+		close_batch_file(file, entry_rc);
+	}
+
+	free(chunk->payload);
+	free(chunk->files);
+	return failed;
+}
+
+/*
+ * Sign a batch of binaries over nconns connections.  They go to the
+ * server in chunks, one for each of its workers to sign, and we send as
+ * many chunks as it says it will take before answering any of them,
+ * taking the answers in whatever order they come.  A failure is reported
+ * for each binary that couldn't be signed.  If the server turns a chunk
+ * away anyway, we send fewer at a time, and that one goes again when
+ * another is answered, or after a little while if none are left.
+ * Returns how many failed, and frees the batch.
+ */
+static int
+sign_batch(batch_file *files, int nfiles, char *tokenname, char *certname,
+	   char *digest, int nconns)
+{
+	int failed = 0, done = 0;
+
+	if (nfiles == 0)
+		return 0;
+	if (nconns > nfiles)
+		nconns = nfiles;
+
+	batch_conn *conns = calloc(nconns, sizeof (*conns));
+	struct pollfd *pfds = calloc(nconns, sizeof (*pfds));
+	batch_chunk *chunks = calloc(nfiles, sizeof (*chunks));
+	int *line = calloc(nfiles, sizeof (*line));
+	if (!conns || !pfds || !chunks || !line) {
+		fprintf(stderr, "pesign-client: could not allocate memory: "
 			"%m\n");
 		exit(1);
 	}
-	free(buffer);
 
-	send_fd(sd, infd);
-	send_fd(sd, outfd);
+	conns[0].sd = connect_to_server();
+
+	/* daemons from before protocol 2 get them one at a time */
+	if (protocol < 2) {
+		for (int i = 0; i < nfiles; i++) {
+			if (sign(conns[0].sd, files[i].infile,
+				 files[i].outfile, tokenname, certname,
+				 digest, files[i].attached) < 0) {
+				fprintf(stderr, "pesign-client: signing \"%s\" "
+					"failed\n", files[i].infile);
+				failed++;
+			}
+		}
+		close(conns[0].sd);
+		goto out;
+	}
+
+	check_cmd_version(conns[0].sd, CMD_SIGN_BATCH, "sign-batch", 1);
 
-	char *srvmsg = NULL;
-	int rc = check_response(sd, &srvmsg);
-	if (rc < 0) {
-		fprintf(stderr, "pesign-client: signing failed: \"%s\"\n",
-			srvmsg);
+	if (NSS_NoDB_Init(NULL) != SECSuccess) {
+		fprintf(stderr, "pesign-client: could not initialize NSS: "
+			"%s\n", PORT_ErrorToString(PORT_GetError()));
 		exit(1);
 	}
 
-	close(infd);
-	close(outfd);
+	for (int c = 0; c < nconns; c++) {
+		if (c > 0)
+			conns[c].sd = connect_to_server();
+		pfds[c].fd = conns[c].sd;
+		pfds[c].events = POLLIN;
+	}
+
+	int chunk_size = server_limits.workers;
+	if (chunk_size < 1)
+		chunk_size = 1;
+	if (chunk_size > PESIGND_MAX_BATCH)
+		chunk_size = PESIGND_MAX_BATCH;
+
+	/* how many chunks we'll have sent without an answer, on all of the
+	 * connections */
+	int max_window = server_limits.max_in_flight;
+	if (max_window > MAX_HASHED / chunk_size)
+		max_window = MAX_HASHED / chunk_size;
+	if (max_window < 1)
+		max_window = 1;
+	int window = max_window, outstanding = 0;
+
+	/* the chunks that were turned away and are waiting to go again, as
+	 * a ring; new ones start with the file at next */
+	int head = 0, waiting = 0, next = 0, nchunks = 0;
+
+	while (done < nfiles) {
+		int timeout = -1;
+
+		while (outstanding < window) {
+			batch_chunk *chunk;
+			uint64_t now = now_ms();
+
+			if (waiting && chunks[line[head]].retry_at <= now) {
+				chunk = &chunks[line[head]];
+				head = (head + 1) % nfiles;
+				waiting--;
+			} else if (next < nfiles) {
+				chunk = &chunks[nchunks];
+				int n = fill_chunk(chunk, files, nfiles, &next,
+						   chunk_size, tokenname,
+						   certname, digest);
+				failed += n;
+				done += n;
+				if (chunk->nfiles == 0) {
+					finish_chunk(chunk, 0, NULL, 0);
+					continue;
+				}
+				nchunks++;
+			} else {
+				if (waiting)
+					timeout = chunks[line[head]].retry_at
+						  - now;
+				break;
+			}
+
+			int c = 0;
+			for (int i = 1; i < nconns; i++) {
+				if (conns[i].outstanding < conns[c].outstanding)
+					c = i;
+			}
+
+			send_request(conns[c].sd, CMD_SIGN_BATCH,
+				     chunk->payload, chunk->size, NULL, 0);
+			chunk->conn = c;
+			chunk->id = last_id;
+			conns[c].outstanding++;
+			outstanding++;
+		}
+		if (done == nfiles)
+			break;
+
+		if (poll(pfds, nconns, timeout) < 0) {
+			if (errno == EINTR)
+				continue;
+			fprintf(stderr, "pesign-client: poll failed: %m\n");
+			exit(1);
+		}
 
-	return;
+		for (int c = 0; c < nconns; c++) {
+			batch_conn *conn = &conns[c];
+			batch_chunk *chunk = NULL;
+			char *data = NULL;
+			size_t len = 0;
+			uint32_t id;
+
+			if (!pfds[c].revents)
+				continue;
+			if (!conn->outstanding) {
+				fprintf(stderr, "pesign-client: server closed "
+					"the connection\n");
+				exit(1);
+			}
+
+			int32_t rc = read_message(conn->sd, &id, &data, &len);
+			for (int i = 0; i < nchunks; i++) {
+				if (chunks[i].conn == c && chunks[i].id == id) {
+					chunk = &chunks[i];
+					break;
+				}
+			}
+			if (!chunk) {
+				fprintf(stderr, "pesign-client: got response "
+					"to request %u, which wasn't sent\n",
+					id);
+				exit(1);
+			}
+			chunk->conn = -1;
+			conn->outstanding--;
+			outstanding--;
+
+			/* with others still outstanding, it can go again
+			 * once one of them is answered */
+			if (rc == PESIGND_BUSY &&
+					++chunk->tries <= BUSY_RETRIES) {
+				window = outstanding > 0 ? outstanding : 1;
+				chunk->retry_at = outstanding > 0 ? 0 :
+					now_ms() + busy_delay(chunk->tries);
+				line[(head + waiting++) % nfiles] =
+							chunk - chunks;
+			} else {
+				done += chunk->nfiles;
+				failed += finish_chunk(chunk, rc, data, len);
+				if (rc != PESIGND_BUSY && window < max_window)
+					window++;
+			}
+			free(data);
+		}
+	}
+
+	for (int c = 0; c < nconns; c++)
+		close(conns[c].sd);
+	NSS_Shutdown();
+out:
+	free(line);
+	free(chunks);
+	free(pfds);
+	free(conns);
+	for (int i = 0; i < nfiles; i++) {
+		free(files[i].infile);
+		free(files[i].outfile);
+	}
+	free(files);
+	return failed;
 }
 
 int
@@ -543,12 +1546,16 @@ main(int argc, char *argv[])
 {
 	char *tokenname = "NSS Certificate DB";
 	char *certname = NULL;
+	char *digest = "sha256";
 	poptContext optCon;
 	int rc;
 	int action = NO_FLAGS;
 	char *infile = NULL;
 	char *outfile = NULL;
 	char *exportfile = NULL;
+	char *manifest = NULL;
+	char *dir = NULL;
+	int nconns = 1;
 	int attached = 1;
 	int pinfd = -1;
 	char *pinfile = NULL;
@@ -569,6 +1576,11 @@ main(int argc, char *argv[])
 		 .arg = &certname,
 		 .descrip = "NSS certificate name",
 		 .argDescrip = "<nickname>" },
+		{.longName = "digest_type",
+		 .shortName = 'd',
+		 .argInfo = POPT_ARG_STRING|POPT_ARGFLAG_SHOW_DEFAULT,
+		 .arg = &digest,
+		 .descrip = "digest type to use for pe hash" },
 		{.longName = "unlock",
 		 .shortName = 'u',
 		 .argInfo = POPT_ARG_VAL|POPT_ARGFLAG_OR,
@@ -587,6 +1599,11 @@ main(int argc, char *argv[])
 		 .arg = &action,
 		 .val = KILL_DAEMON,
 		 .descrip = "kill running daemon" },
+		{.longName = "stats",
+		 .argInfo = POPT_ARG_VAL|POPT_ARGFLAG_OR,
+		 .arg = &action,
+		 .val = GET_STATS,
+		 .descrip = "show daemon statistics" },
 		{.longName = "sign",
 		 .shortName = 's',
 		 .argInfo = POPT_ARG_VAL|POPT_ARGFLAG_OR,
@@ -611,6 +1628,22 @@ main(int argc, char *argv[])
 		 .arg = &exportfile,
 		 .descrip = "create detached signature",
 		 .argDescrip = "<outfile>" },
+		{.longName = "batch",
+		 .argInfo = POPT_ARG_STRING,
+		 .arg = &manifest,
+		 .descrip = "sign every binary listed in a manifest",
+		 .argDescrip = "<manifest>" },
+		{.longName = "dir",
+		 .argInfo = POPT_ARG_STRING,
+		 .arg = &dir,
+		 .descrip = "sign every binary in a directory, into the "
+			    "directory given with --outfile or --export",
+		 .argDescrip = "<directory>" },
+		{.longName = "connections",
+		 .argInfo = POPT_ARG_INT|POPT_ARGFLAG_SHOW_DEFAULT,
+		 .arg = &nconns,
+		 .descrip = "connections to sign a batch over",
+		 .argDescrip = "<count>" },
 		{.longName = "pinfd",
 		 .shortName = 'f',
 		 .argInfo = POPT_ARG_INT,
@@ -656,13 +1689,42 @@ main(int argc, char *argv[])
 		exit(1);
 	}
 
+	if (manifest && dir) {
+		fprintf(stderr, "pesign-client: both --batch and --dir "
+			"specified\n");
+		exit(1);
+	}
+	if (manifest || dir) {
+		if (action != NO_FLAGS && action != SIGN_BINARY) {
+			fprintf(stderr, "pesign-client: --%s can only be "
+				"used with --sign\n", dir ? "dir" : "batch");
+			exit(1);
+		}
+		if (manifest && (infile || outfile || exportfile)) {
+			fprintf(stderr, "pesign-client: --batch can't be used "
+				"with --infile, --outfile, or --export\n");
+			exit(1);
+		}
+		if (dir && infile) {
+			fprintf(stderr, "pesign-client: --dir can't be used "
+				"with --infile\n");
+			exit(1);
+		}
+		if (nconns < 1 || nconns > 16) {
+			fprintf(stderr, "pesign-client: invalid connection "
+				"count %d\n", nconns);
+			exit(1);
+		}
+		action = SIGN_BINARY;
+	}
+
 	if (action == NO_FLAGS) {
 		poptPrintUsage(optCon, stdout, 0);
 		poptFreeContext(optCon);
 		exit(0);
 	}
 
-	if (action & SIGN_BINARY && (!outfile && !exportfile)) {
+	if (action & SIGN_BINARY && !manifest && (!outfile && !exportfile)) {
 		fprintf(stderr, "pesign-client: neither --outfile nor --export "
 			"specified\n");
 		exit(1);
@@ -706,7 +1768,31 @@ main(int argc, char *argv[])
 		sd = connect_to_server();
 		send_kill_daemon(sd);
 		break;
+	case GET_STATS:
+		sd = connect_to_server();
+		get_stats(sd);
+		break;
 	case SIGN_BINARY:
+		if (manifest || dir) {
+			batch_file *files;
+			int nfiles = 0;
+
+			if (!certname) {
+				fprintf(stderr, "pesign-client: no certificate "
+					"name specified\n");
+				exit(1);
+			}
+			if (manifest)
+				files = read_manifest(manifest, attached,
+						      &nfiles);
+			else
+				files = read_dir(dir, outfile, attached,
+						 &nfiles);
+			if (sign_batch(files, nfiles, tokenname, certname,
+				       digest, nconns) > 0)
+				exit(1);
+			break;
+		}
 		if (!infile) {
 			fprintf(stderr, "pesign-client: no input file "
 				"specified\n");
@@ -723,7 +1809,9 @@ main(int argc, char *argv[])
 			exit(1);
 		}
 		sd = connect_to_server();
-		sign(sd, infile, outfile, tokenname, certname, attached);
+		if (sign(sd, infile, outfile, tokenname, certname, digest,
+			 attached) < 0)
+			exit(1);
 		break;
 	default:
 		fprintf(stderr, "Incompatible flags (0x%08x): ", action);
@@ -97,6 +97,17 @@ digest_get_digest_size(cms_context *cms)
 	return digest_params[i].size;
 }
 
+static void
+join_digest_threads(cms_context *cms)
+{
+	for (int i = 0; i < n_digest_params; i++) {
+		if (cms->digests[i].running) {
+			pthread_join(cms->digests[i].thread, NULL);
+			cms->digests[i].running = 0;
+		}
+	}
+}
+
 void
 teardown_digests(cms_context *ctx)
 {
@@ -105,6 +116,7 @@ teardown_digests(cms_context *ctx)
 	if (!digests)
 		return;
 
+	join_digest_threads(ctx);
 	for (int i = 0; i < n_digest_params; i++) {
 		if (digests[i].pk11ctx) {
 			PK11_Finalize(digests[i].pk11ctx);
@@ -155,33 +167,20 @@ cms_context_init(cms_context *cms)
 	return 0;
 }
 
+/*
+ * Drop everything that belongs to the binary we just signed or checked,
+ * but keep the certificate, key, and chain around so the same context
+ * can be used for the next one.
+ */
 void
-cms_context_fini(cms_context *cms)
+cms_context_reset(cms_context *cms)
 {
-	if (cms->cert) {
-		CERT_DestroyCertificate(cms->cert);
-		cms->cert = NULL;
-	}
-
-	if (cms->privkey) {
-		free(cms->privkey);
-		cms->privkey = NULL;
-	}
-
-	/* These were freed when the arena was destroyed */
-	if (cms->tokenname)
-		cms->tokenname = NULL;
-	if (cms->certname)
-		cms->certname = NULL;
-
 	if (cms->newsig.data) {
 		free_poison(cms->newsig.data, cms->newsig.len);
 		free(cms->newsig.data);
 		memset(&cms->newsig, '\0', sizeof (cms->newsig));
 	}
 
-	cms->selected_digest = -1;
-
 	if (cms->ci_digest) {
 		free_poison(cms->ci_digest->data, cms->ci_digest->len);
 		/* XXX sure seems like we should be freeing it here, but
@@ -220,17 +219,86 @@ cms_context_fini(cms_context *cms)
 
 	xfree(cms->signatures);
 	cms->num_signatures = 0;
+}
+
+/* Let go of everything but the arena and the timings. */
+static void
+cms_context_release(cms_context *cms)
+{
+	if (cms->cert) {
+		CERT_DestroyCertificate(cms->cert);
+		cms->cert = NULL;
+	}
+
+	if (cms->signing_key) {
+		SECKEY_DestroyPrivateKey(cms->signing_key);
+		cms->signing_key = NULL;
+	}
+
+	/* This lives in the arena */
+	cms->certificate_list = NULL;
+
+	if (cms->privkey) {
+		free(cms->privkey);
+		cms->privkey = NULL;
+	}
+
+	/* So do these */
+	if (cms->tokenname)
+		cms->tokenname = NULL;
+	if (cms->certname)
+		cms->certname = NULL;
+
+	cms->selected_digest = -1;
+
+	cms_context_reset(cms);
 
 	if (cms->authbuf) {
 		xfree(cms->authbuf);
 		cms->authbuf_len = 0;
 	}
+}
+
+void
+cms_context_fini(cms_context *cms)
+{
+	cms_context_release(cms);
+	timing_disable(cms);
 
 	PORT_FreeArena(cms->arena, PR_TRUE);
 	memset(cms, '\0', sizeof(*cms));
 	xfree(cms);
 }
 
+/*
+ * Make a context as good as new, for something that signs one binary
+ * after another, without giving its arena back and getting another one.
+ * The first call only marks the arena, so call it before the context is
+ * used, on the thread that will be recycling it.
+ */
+int
+cms_context_recycle(cms_context *cms)
+{
+	PRArenaPool *arena = cms->arena;
+	struct timing *timing = cms->timing;
+
+	cms_context_release(cms);
+
+	if (cms->arena_mark)
+		PORT_ArenaRelease(arena, cms->arena_mark);
+	memset(cms, '\0', sizeof (*cms));
+	cms->arena = arena;
+	cms->log = cms_common_log;
+	cms->selected_digest = -1;
+	cms->timing = timing;
+	timing_clear(cms);
+
+	cms->arena_mark = PORT_ArenaMark(arena);
+	if (!cms->arena_mark)
+		cmsreterr(-1, cms, "could not mark cryptographic arena");
+	return 0;
+}
+
 int
 cms_context_alloc(cms_context **cmsp)
 {
@@ -247,6 +315,75 @@ cms_context_alloc(cms_context **cmsp)
 	return 0;
 }
 
+/*
+ * Give cms its own references to src's certificate, private key, and
+ * certificate chain, so it can sign without going back to the token.
+ */
+int
+cms_context_copy_signer(cms_context *cms, cms_context *src)
+{
+	if (src->cert)
+		cms->cert = CERT_DupCertificate(src->cert);
+	if (src->signing_key) {
+		cms->signing_key = SECKEY_CopyPrivateKey(src->signing_key);
+		if (!cms->signing_key)
+			cmsreterr(-1, cms, "could not copy private key");
+	}
+
+	if (src->certificate_list) {
+		int n = 0;
+		while (src->certificate_list[n])
+			n++;
+
+		SECItem **certificates = PORT_ArenaZAlloc(cms->arena,
+					sizeof (SECItem *) * (n + 1));
+		if (!certificates)
+			cmsreterr(-1, cms, "could not allocate certificate list");
+		for (int i = 0; i < n; i++) {
+			certificates[i] = SECITEM_ArenaDupItem(cms->arena,
+						src->certificate_list[i]);
+			if (!certificates[i])
+				cmsreterr(-1, cms, "could not allocate "
+					"certificate entry");
+		}
+		cms->certificate_list = certificates;
+	}
+	return 0;
+}
+
+/*
+ * Set cms up to sign with the same token, certificate, key, chain, and
+ * digest as src, without going back to the token.  This gives each
+ * worker thread its own context and arena.
+ */
+int
+cms_context_share_signer(cms_context *cms, cms_context *src)
+{
+	if (src->tokenname) {
+		cms->tokenname = PORT_ArenaStrdup(cms->arena, src->tokenname);
+		if (!cms->tokenname)
+			cmsreterr(-1, cms, "could not allocate token name");
+	}
+	if (src->certname) {
+		cms->certname = PORT_ArenaStrdup(cms->arena, src->certname);
+		if (!cms->certname)
+			cmsreterr(-1, cms, "could not allocate certificate name");
+	}
+
+	if (cms_context_copy_signer(cms, src) < 0)
+		return -1;
+
+	cms->func = src->func;
+	cms->pwdata = src->pwdata;
+	cms->selected_digest = src->selected_digest;
+	cms->digest_set = src->digest_set;
+	cms->sign_queue = src->sign_queue;
+	cms->log = src->log;
+	cms->log_priv = src->log_priv;
+
+	return 0;
+}
+
 void cms_set_pw_callback(cms_context *cms, PK11PasswordFunc func)
 {
 	cms->func = func;
@@ -264,6 +401,7 @@ set_digest_parameters(cms_context *cms, char *name)
 		for (int i = 0; i < n_digest_params; i++) {
 			if (!strcmp(name, digest_params[i].name)) {
 				cms->selected_digest = i;
+				cms->digest_set |= 1u << i;
 				return 0;
 			}
 		}
@@ -277,6 +415,77 @@ set_digest_parameters(cms_context *cms, char *name)
 	return -1;
 }
 
+static int
+find_digest_param(SECOidTag digest_tag)
+{
+	for (int i = 0; i < n_digest_params; i++) {
+		if (digest_params[i].digest_tag == digest_tag)
+			return i;
+	}
+	return -1;
+}
+
+/*
+ * Use a digest computed somewhere else (by pesign-client, say) as the PE
+ * digest for the selected algorithm, so generate_signature() can sign a
+ * binary it never sees.
+ */
+int
+set_pe_digest(cms_context *cms, const void *data, size_t len)
+{
+	int i = cms->selected_digest;
+
+	if (len != (size_t)digest_params[i].size) {
+		cms->log(cms, LOG_ERR, "%s:%s:%d %s digest has invalid size "
+			"%zu", __FILE__, __func__, __LINE__,
+			digest_params[i].name, len);
+		return -1;
+	}
+
+	if (!cms->digests) {
+		cms->digests = PORT_ZAlloc(n_digest_params *
+					   sizeof (*cms->digests));
+		if (!cms->digests)
+			cmsreterr(-1, cms, "could not allocate digest context");
+	}
+
+	SECItem *digest = SECITEM_AllocItem(cms->arena, NULL, len);
+	if (!digest)
+		cmsreterr(-1, cms, "could not allocate digest");
+	memcpy(digest->data, data, len);
+	cms->digests[i].pe_digest = digest;
+	return 0;
+}
+
+/* Ask generate_digest() to compute digest_tag as well as anything
+ * already in the set. */
+int
+digest_set_add(cms_context *cms, SECOidTag digest_tag)
+{
+	int i = find_digest_param(digest_tag);
+	if (i < 0)
+		return -1;
+
+	cms->digest_set |= 1u << i;
+	return 0;
+}
+
+SECItem *
+find_pe_digest(cms_context *cms, SECOidTag digest_tag)
+{
+	int i = find_digest_param(digest_tag);
+	if (i < 0 || !cms->digests)
+		return NULL;
+
+	return cms->digests[i].pe_digest;
+}
+
+static int
+digest_wanted(cms_context *cms, int i)
+{
+	return !cms->digest_set || (cms->digest_set & (1u << i));
+}
+
 struct cbdata {
 	CERTCertificate *cert;
 	PK11SlotListElement *psle;
@@ -389,8 +598,8 @@ unlock_nss_token(cms_context *cms)
 	return 0;
 }
 
-int
-find_certificate(cms_context *cms, int needs_private_key)
+static int
+find_certificate_in_token(cms_context *cms, int needs_private_key)
 {
 	if (!cms->certname || !*cms->certname) {
 		cms->log(cms, LOG_ERR, "no certificate name specified");
@@ -486,6 +695,16 @@ find_certificate(cms_context *cms, int needs_private_key)
 	return 0;
 }
 
+int
+find_certificate(cms_context *cms, int needs_private_key)
+{
+	uint64_t start = timing_begin(cms);
+	int rc = find_certificate_in_token(cms, needs_private_key);
+
+	timing_end(cms, TIMING_FIND_CERTIFICATE, start);
+	return rc;
+}
+
 int
 find_slot_for_token(cms_context *cms, PK11SlotInfo **slot)
 {
@@ -946,6 +1165,11 @@ generate_digest_begin(cms_context *cms)
 	}
 
 	for (int i = 0; i < n_digest_params; i++) {
+		digests[i].pe_digest = NULL;
+		digests[i].status = SECSuccess;
+		if (!digest_wanted(cms, i))
+			continue;
+
 		digests[i].pk11ctx = PK11_CreateDigestContext(
 						digest_params[i].digest_tag);
 		if (!digests[i].pk11ctx) {
@@ -975,8 +1199,68 @@ err:
 void
 generate_digest_step(cms_context *cms, void *data, size_t len)
 {
-	for (int i = 0; i < n_digest_params; i++)
-		PK11_DigestOp(cms->digests[i].pk11ctx, data, len);
+	for (int i = 0; i < n_digest_params; i++) {
+		if (cms->digests[i].pk11ctx)
+			PK11_DigestOp(cms->digests[i].pk11ctx, data, len);
+	}
+}
+
+static void
+digest_ranges(struct digest *digest)
+{
+	for (int i = 0; i < digest->n_ranges; i++) {
+		SECStatus status;
+
+		status = PK11_DigestOp(digest->pk11ctx,
+				       digest->ranges[i].data,
+				       digest->ranges[i].len);
+		if (status != SECSuccess)
+			digest->status = status;
+	}
+}
+
+static void *
+digest_thread(void *arg)
+{
+	digest_ranges((struct digest *)arg);
+	return NULL;
+}
+
+/*
+ * Feed the same list of ranges to every digest we're computing.  When
+ * there's more than one, each of the others gets a thread of its own and
+ * we do the last one here, so this takes as long as the slowest algorithm
+ * rather than all of them put together.  The ranges have to stay valid
+ * until generate_digest_finish(), which is where the threads are joined.
+ */
+void
+generate_digest_ranges(cms_context *cms, const struct digest_range *ranges,
+		       int n_ranges)
+{
+	int active = 0;
+
+	for (int i = 0; i < n_digest_params; i++) {
+		if (cms->digests[i].pk11ctx)
+			active++;
+	}
+
+	for (int i = 0; i < n_digest_params; i++) {
+		struct digest *digest = &cms->digests[i];
+
+		if (!digest->pk11ctx)
+			continue;
+
+		digest->ranges = ranges;
+		digest->n_ranges = n_ranges;
+		digest->status = SECSuccess;
+
+		if (--active > 0 && pthread_create(&digest->thread, NULL,
+						   digest_thread, digest) == 0) {
+			digest->running = 1;
+			continue;
+		}
+		digest_ranges(digest);
+	}
 }
 
 int
@@ -984,7 +1268,19 @@ generate_digest_finish(cms_context *cms)
 {
 	void *mark = PORT_ArenaMark(cms->arena);
 
+	join_digest_threads(cms);
 	for (int i = 0; i < n_digest_params; i++) {
+		if (cms->digests[i].status != SECSuccess) {
+			cms->log(cms, LOG_ERR, "%s:%s:%d could not digest "
+				"data", __FILE__, __func__, __LINE__);
+			goto err;
+		}
+	}
+
+	for (int i = 0; i < n_digest_params; i++) {
+		if (!cms->digests[i].pk11ctx)
+			continue;
+
 		SECItem *digest = PORT_ArenaZAlloc(cms->arena,sizeof (SECItem));
 		if (digest == NULL) {
 			cms->log(cms, LOG_ERR, "%s:%s:%d could not allocate "
@@ -21,6 +21,7 @@
 
 #include <errno.h>
 #include <cert.h>
+#include <pthread.h>
 #include <secpkcs7.h>
 #include <signal.h>
 #include <stdarg.h>
@@ -49,12 +50,26 @@
 	})
 
 
+struct digest_range {
+	const void *data;
+	size_t len;
+};
+
 struct digest {
 	PK11Context *pk11ctx;
 	SECItem *pe_digest;
+
+	/* set while a worker thread is feeding ranges to pk11ctx */
+	pthread_t thread;
+	int running;
+	const struct digest_range *ranges;
+	int n_ranges;
+	SECStatus status;
 };
 
 struct cms_context;
+struct sign_queue;
+struct timing;
 
 typedef int (*cms_common_logger)(struct cms_context *, int priority,
 		char *fmt, ...)
@@ -62,16 +77,29 @@ typedef int (*cms_common_logger)(struct cms_context *, int priority,
 
 typedef struct cms_context {
 	PRArenaPool *arena;
+	/* what cms_context_recycle() releases the arena back to */
+	void *arena_mark;
 	void *privkey;
 
 	char *tokenname;
 	char *certname;
 	CERTCertificate *cert;
+	/* looked up once by cache_signing_key() and
+	 * cache_certificate_list() when many binaries get signed with
+	 * the same certificate */
+	SECKEYPrivateKey *signing_key;
+	SECItem **certificate_list;
+	/* if set, private key operations are handed to this instead of
+	 * being done on the calling thread */
+	struct sign_queue *sign_queue;
 	PK11PasswordFunc func;
 	void *pwdata;
 
 	struct digest *digests;
 	int selected_digest;
+	/* bitmask of the digest algorithms generate_digest() should
+	 * compute; 0 means all of them. */
+	unsigned int digest_set;
 
 	SECItem newsig;
 
@@ -88,6 +116,9 @@ typedef struct cms_context {
 
 	cms_common_logger log;
 	void *log_priv;
+
+	/* per-phase timings; NULL unless timing_enable() was called */
+	struct timing *timing;
 } cms_context;
 
 typedef enum {
@@ -108,6 +139,10 @@ extern SEC_ASN1Template SpcLinkTemplate[];
 extern int cms_context_alloc(cms_context **ctxp);
 extern int cms_context_init(cms_context *ctx);
 extern void cms_context_fini(cms_context *ctx);
+extern int cms_context_recycle(cms_context *ctx);
+extern void cms_context_reset(cms_context *ctx);
+extern int cms_context_copy_signer(cms_context *cms, cms_context *src);
+extern int cms_context_share_signer(cms_context *cms, cms_context *src);
 
 extern void teardown_digests(cms_context *ctx);
 
@@ -138,6 +173,8 @@ extern int generate_spc_string(cms_context *cms, SECItem *ssp, char *str,
 				int len);
 
 extern int generate_digest(cms_context *cms, Pe *pe, int padded);
+extern int finalize_cms_signatures(cms_context *cms, Pe *pe);
+extern loff_t update_cms_image(cms_context *cms, Pe *pe, Pe_Cmd cmd);
 extern int generate_signature(cms_context *ctx);
 extern int unlock_nss_token(cms_context *ctx);
 extern int find_certificate(cms_context *ctx, int needs_private_key);
@@ -157,9 +194,15 @@ extern void cms_set_pw_callback(cms_context *cms, PK11PasswordFunc func);
 extern void cms_set_pw_data(cms_context *cms, void *pwdata);
 
 extern int set_digest_parameters(cms_context *ctx, char *name);
+extern int digest_set_add(cms_context *cms, SECOidTag digest_tag);
+extern SECItem *find_pe_digest(cms_context *cms, SECOidTag digest_tag);
+extern int set_pe_digest(cms_context *cms, const void *data, size_t len);
 
 extern int generate_digest_begin(cms_context *cms);
 extern void generate_digest_step(cms_context *cms, void *data, size_t len);
+extern void generate_digest_ranges(cms_context *cms,
+				   const struct digest_range *ranges,
+				   int n_ranges);
 extern int generate_digest_finish(cms_context *cms);
 
 typedef struct {
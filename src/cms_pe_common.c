@@ -40,42 +40,17 @@
 #include <secerr.h>
 #include <certt.h>
 
+/* Trailing data never needs more than 7 bytes of padding. */
+static const uint8_t zero_pad[8];
+
 static int
-check_pointer_and_size(Pe *pe, void *ptr, size_t size)
+digest_image(cms_context *cms, Pe *pe, int padded)
 {
+	const Pe_HashPlan *plan;
+	struct digest_range *ranges = NULL;
+	int n_ranges = 0;
 	void *map = NULL;
 	size_t map_size = 0;
-
-	map = pe_rawfile(pe, &map_size);
-	if (!map || map_size < 1)
-		return 0;
-
-	if ((uintptr_t)ptr < (uintptr_t)map)
-		return 0;
-
-	if ((uintptr_t)ptr + size > (uintptr_t)map + map_size)
-		return 0;
-
-	if (ptr <= map && size >= map_size)
-		return 0;
-
-	return 1;
-}
-
-#if 1
-#define dprintf(fmt, ...)
-#else
-#define dprintf(fmt, args...) printf(fmt, ## args)
-#endif
-
-int
-generate_digest(cms_context *cms, Pe *pe, int padded)
-{
-	void *hash_base;
-	size_t hash_size;
-	struct pe32_opt_hdr *pe32opthdr = NULL;
-	struct pe32plus_opt_hdr *pe64opthdr = NULL;
-	unsigned long hashed_bytes = 0;
 	int rc = -1;
 
 	if (!pe) {
@@ -87,164 +62,89 @@ generate_digest(cms_context *cms, Pe *pe, int padded)
 	if (rc < 0)
 		return rc;
 
-	struct pe_hdr pehdr;
-	if (pe_getpehdr(pe, &pehdr) == NULL)
-		pereterr(-1, "invalid PE file header");
-
-	void *map = NULL;
-	size_t map_size = 0;
+	plan = pe_gethashplan(pe);
+	if (!plan) {
+		cms->log(cms, LOG_ERR, "%s:%s:%d could not work out what to "
+			"hash: %s", __FILE__, __func__, __LINE__,
+			pe_errmsg(pe_errno()));
+		return -1;
+	}
 
-	/* 1. Load the image header into memory - should be done
-	 * 2. Initialize SHA hash context. */
 	map = pe_rawfile(pe, &map_size);
 	if (!map)
 		pereterr(-1, "could not get raw output file address");
 
-	/* 3. Calculate the distance from the base of the image header to the
-	 * image checksum.
-	 * 4. Hash the image header from start to the beginning of the
-	 * checksum. */
-	hash_base = map;
-	switch (pe_kind(pe)) {
-	case PE_K_PE_EXE: {
-		void *opthdr = pe_getopthdr(pe);
-		pe32opthdr = opthdr;
-		hash_size = (uintptr_t)&pe32opthdr->csum - (uintptr_t)hash_base;
-		break;
-	}
-	case PE_K_PE64_EXE: {
-		void *opthdr = pe_getopthdr(pe);
-		pe64opthdr = opthdr;
-		hash_size = (uintptr_t)&pe64opthdr->csum - (uintptr_t)hash_base;
-		break;
-	}
-	default:
-		goto error;
-	}
-	if (!check_pointer_and_size(pe, hash_base, hash_size)) {
-		cms->log(cms, LOG_ERR, "%s:%s:%d PE header is invalid",
-			__FILE__, __func__, __LINE__);
+	/* room for every range in the plan, and the padding after each */
+	ranges = calloc(plan->nranges * 2, sizeof (*ranges));
+	if (!ranges)
 		goto error;
-	}
-	dprintf("beginning of hash\n");
-	dprintf("digesting %lx + %lx\n", hash_base - map, hash_size);
-	generate_digest_step(cms, hash_base, hash_size);
-
-	/* 5. Skip over the image checksum
-	 * 6. Get the address of the beginning of the cert dir entry
-	 * 7. Hash from the end of the csum to the start of the cert dirent. */
-	hash_base += hash_size;
-	hash_base += pe32opthdr ? sizeof(pe32opthdr->csum)
-				: sizeof(pe64opthdr->csum);
-	data_directory *dd;
-
-	rc = pe_getdatadir(pe, &dd);
-	if (rc < 0 || !dd || !check_pointer_and_size(pe, dd, sizeof(*dd))) {
-		cms->log(cms, LOG_ERR, "%s:%s:%d PE data directory is invalid",
-			__FILE__, __func__, __LINE__);
-		goto error;
-	}
 
-	hash_size = (uintptr_t)&dd->certs - (uintptr_t)hash_base;
-	if (!check_pointer_and_size(pe, hash_base, hash_size)) {
-		cms->log(cms, LOG_ERR, "%s:%s:%d PE data directory is invalid",
-			__FILE__, __func__, __LINE__);
-		goto error;
-	}
-	generate_digest_step(cms, hash_base, hash_size);
-	dprintf("digesting %lx + %lx\n", hash_base - map, hash_size);
-
-	/* 8. Skip over the crt dir
-	 * 9. Hash everything up to the end of the image header. */
-	hash_base = &dd->base_relocations;
-	hash_size = (pe32opthdr ? pe32opthdr->header_size
-				: pe64opthdr->header_size) -
-		((uintptr_t)&dd->base_relocations - (uintptr_t)map);
-
-	if (!check_pointer_and_size(pe, hash_base, hash_size)) {
-		cms->log(cms, LOG_ERR, "%s:%s:%d PE relocations table is "
-			"invalid", __FILE__, __func__, __LINE__);
-		goto error;
-	}
-	generate_digest_step(cms, hash_base, hash_size);
-	dprintf("digesting %lx + %lx\n", hash_base - map, hash_size);
+	for (unsigned int i = 0; i < plan->nranges; i++) {
+		const Pe_HashRange *range = &plan->ranges[i];
 
-	/* 10. Set SUM_OF_BYTES_HASHED to the size of the header. */
-	hashed_bytes = pe32opthdr ? pe32opthdr->header_size
-				: pe64opthdr->header_size;
+		ranges[n_ranges].data = (uint8_t *)map + range->offset;
+		ranges[n_ranges].len = range->size;
+		n_ranges++;
 
-	struct section_header *shdrs = calloc(pehdr.sections, sizeof (*shdrs));
-	if (!shdrs)
-		goto error;
-	Pe_Scn *scn = NULL;
-	for (int i = 0; i < pehdr.sections; i++) {
-		scn = pe_nextscn(pe, scn);
-		if (scn == NULL)
-			break;
-		pe_getshdr(scn, &shdrs[i]);
-	}
-	sort_shdrs(shdrs, pehdr.sections - 1);
-
-	for (int i = 0; i < pehdr.sections; i++) {
-		if (shdrs[i].raw_data_size == 0)
-			continue;
-
-		hash_base = (void *)((uintptr_t)map + shdrs[i].data_addr);
-		hash_size = shdrs[i].raw_data_size;
-
-		if (!check_pointer_and_size(pe, hash_base, hash_size)) {
-			cms->log(cms, LOG_ERR, "%s:%s:%d PE section \"%s\" "
-				"has invalid address",
-				__FILE__, __func__, __LINE__, shdrs[i].name);
-			goto error_shdrs;
+		if (range->pad && padded) {
+			if (range->pad > sizeof (zero_pad))
+				goto error;
+			ranges[n_ranges].data = zero_pad;
+			ranges[n_ranges].len = range->pad;
+			n_ranges++;
 		}
-
-		generate_digest_step(cms, hash_base, hash_size);
-		dprintf("digesting %lx + %lx\n", hash_base - map, hash_size);
-
-		hashed_bytes += hash_size;
 	}
 
-	if (map_size > hashed_bytes) {
-		hash_base = (void *)((uintptr_t)map + hashed_bytes);
-		hash_size = map_size - dd->certs.size - hashed_bytes;
-
-		if (!check_pointer_and_size(pe, hash_base, hash_size)) {
-			cms->log(cms, LOG_ERR, "%s:%s:%d PE has invalid "
-				"trailing data", __FILE__, __func__, __LINE__);
-			goto error_shdrs;
-		}
-		if (hash_size % 8 != 0 && padded) {
-			size_t tmp_size = hash_size +
-					  ALIGNMENT_PADDING(hash_size, 8);
-			uint8_t tmp_array[tmp_size];
-			memset(tmp_array, '\0', tmp_size);
-			memcpy(tmp_array, hash_base, hash_size);
-			generate_digest_step(cms, tmp_array, tmp_size);
-			dprintf("digesting %lx + %lx\n", (unsigned long)tmp_array, tmp_size);
-		} else {
-			generate_digest_step(cms, hash_base, hash_size);
-			dprintf("digesting %lx + %lx\n", hash_base - map, hash_size);
-		}
-	}
-	dprintf("end of hash\n");
-
+	generate_digest_ranges(cms, ranges, n_ranges);
 	rc = generate_digest_finish(cms);
 	if (rc < 0)
-		goto error_shdrs;
-
-	if (shdrs) {
-		free(shdrs);
-		shdrs = NULL;
-	}
+		goto error;
 
+	free(ranges);
 	return 0;
 
-error_shdrs:
-	if (shdrs)
-		free(shdrs);
 error:
+	free(ranges);
 	return -1;
 }
 
+int
+generate_digest(cms_context *cms, Pe *pe, int padded)
+{
+	uint64_t start = timing_begin(cms);
+	int rc = digest_image(cms, pe, padded);
+
+	timing_end(cms, TIMING_GENERATE_DIGEST, start);
+	return rc;
+}
+
+/* finalize_signatures() for cms->signatures, with the time spent in
+ * msync() writing them out accounted for on its own. */
+int
+finalize_cms_signatures(cms_context *cms, Pe *pe)
+{
+	uint64_t start = timing_begin(cms);
+	uint64_t synced = pe_msynctime(pe);
 
+	int rc = finalize_signatures(cms->signatures, cms->num_signatures, pe);
+
+	synced = pe_msynctime(pe) - synced;
+	timing_add(cms, TIMING_MSYNC, synced);
+	timing_end(cms, TIMING_FINALIZE_SIGNATURES, start + synced);
+	return rc;
+}
+
+/* pe_update(), likewise with its msync() time kept apart. */
+loff_t
+update_cms_image(cms_context *cms, Pe *pe, Pe_Cmd cmd)
+{
+	uint64_t start = timing_begin(cms);
+	uint64_t synced = pe_msynctime(pe);
+
+	loff_t rc = pe_update(pe, cmd);
+
+	synced = pe_msynctime(pe) - synced;
+	timing_add(cms, TIMING_MSYNC, synced);
+	timing_end(cms, TIMING_PE_UPDATE, start + synced);
+	return rc;
+}
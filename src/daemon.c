@@ -20,18 +20,24 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <glob.h>
+#include <limits.h>
+#include <malloc.h>
 #include <poll.h>
+#include <pthread.h>
 #include <pwd.h>
 #include <signal.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <sys/epoll.h>
 #include <sys/prctl.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/time.h>
 #include <sys/un.h>
 #include <syslog.h>
+#include <time.h>
 #include <unistd.h>
 #include <grp.h>
 
@@ -39,9 +45,16 @@
 
 #include <prerror.h>
 #include <nss.h>
+#include <pk11pub.h>
 
 static int should_exit = 0;
 
+struct daemon_pool;
+struct signing;
+
+/* Requests a worker can have waiting for a token while it does others. */
+#define MAX_PARKED		2
+
 typedef struct {
 	cms_context *cms;
 	cms_context *backup_cms;
@@ -51,9 +64,506 @@ typedef struct {
 	int sd;
 	int priority;
 	char *errstr;
+	struct daemon_pool *pool;
+	int is_worker;			/* one of the pool's threads */
+	struct worker_stats *stats;	/* workers only */
+	cms_context *spare_cms[MAX_PARKED + 1];	/* for the next requests */
+	int nspare;
+
+	/* under pool->lock */
+	int parked;			/* waiting for a token */
+	struct signing *finished;	/* the token's done with these */
+} context;
+
+/* Nothing a client legitimately sends us comes anywhere near this. */
+#define MAX_REQUEST_SIZE	65536
+
+/* File descriptors a protocol 2 request can carry with it. */
+#define MAX_REQUEST_FDS		(2 * PESIGND_MAX_BATCH)
+
+/*
+ * One per client connection.  The dispatcher reads whatever the socket
+ * has without blocking until it has a whole request (header, payload, and
+ * with protocol 2, any file descriptors), and queues that for a worker.
+ * A protocol 1 connection then belongs to the worker until the request
+ * is finished; with protocol 2 the dispatcher goes on reading, and any
+ * number of requests can be running at once.
+ */
+typedef struct connection {
+	int fd;
+	uid_t uid;			/* SO_PEERCRED */
+	int proto;			/* 1, or 2 once negotiated */
+	int busy;			/* protocol 1: a worker has it */
+	int ready;			/* on the dispatcher's ready list */
+	int closing;			/* waiting for requests to finish */
+	int refs;			/* requests not yet reclaimed */
+	pthread_mutex_t write_lock;	/* responses go out whole */
+
+	pesignd_msghdr_v2 hdr;		/* v1 headers are a prefix of this */
+	size_t hdrlen;			/* bytes of hdr read so far */
+	char *payload;			/* hdr.size bytes, once hdr is valid */
+	size_t paylen;			/* bytes of payload read so far */
+	uint64_t started;		/* when its first byte came in */
+	int fds[MAX_REQUEST_FDS];
+	int nfds;
+
+	struct connection *next;	/* ready list */
+	struct connection *prev_conn, *next_conn;
+} connection;
+
+/* A whole request, from when the dispatcher queues it until a worker has
+ * answered it and it's back on the done list. */
+typedef struct daemon_request {
+	connection *conn;
+	int fd;
+	int proto;
+	uint32_t id;			/* protocol 2 only */
+	uint32_t command;
+	uint32_t size;
+	char *payload;
+	int fds[MAX_REQUEST_FDS];
+	int nfds, nextfd;
+	int hung_up;
+	int parked;			/* a worker will finish it later */
+	int answered;			/* its in_flight slot is free again */
+	int32_t rc;			/* what we answered with */
+	uint64_t started;		/* when a worker took it */
+	uint64_t receive_ns;		/* first byte to last */
+	uint64_t queued_at;
+	struct uid_queue *queue;
+	struct sign_batch *batch;	/* set for batch helpers */
+	struct daemon_request *next;
+} daemon_request;
+
+typedef struct {
+	int attached;
+	char *tokenname, *certname, *digestname;
+	pesignd_string *digest;		/* PESIGND_BATCH_DIGEST only */
+	int infd, outfd;		/* and these only without it */
+	int32_t rc;
+	char *errmsg;
+	void *sig;			/* what digest was signed with */
+	size_t siglen;
+} batch_entry;
+
+/*
+ * A CMD_SIGN_BATCH being worked on.  The worker that got the request and
+ * any idle workers that pick up the helpers it queues each take the next
+ * entry until there are none left.
+ */
+typedef struct sign_batch {
+	batch_entry *entries;
+	uint32_t count;
+	uint32_t next;			/* next entry nobody's taken */
+	int running;			/* helpers working on it */
+	pthread_cond_t idle;		/* running went to 0 */
+	struct uid_queue *queue;	/* where its helpers go */
+} sign_batch;
+
+/*
+ * A certificate, its chain, and its private key, looked up once for a
+ * (token, nickname) pair.  The cms_context here never signs anything;
+ * requests get their own references with cms_context_copy_signer().
+ */
+typedef struct signer {
+	cms_context *cms;		/* holds tokenname and certname too */
+	PK11SlotInfo *slot;
+	struct token_executor *executor;
+	int series;			/* PK11_GetSlotSeries() when found */
+	unsigned int hash;
+	struct signer *next;
+} signer;
+
+#define SIGNER_BUCKETS		64
+
+/*
+ * The threads that make signatures with keys on one token.  Each token
+ * gets its own, sized to what it can do at once, so a slow smartcard
+ * only ever holds up the requests that need it.  Once one has half of
+ * what the workers can have parked waiting for it, protocol 2 requests
+ * for it are answered with PESIGND_BUSY before we've hashed anything.
+ */
+typedef struct token_executor {
+	char *tokenname;
+	sign_queue *queue;
+	int nthreads;
+	struct token_executor *next;
+} token_executor;
+
+/*
+ * One binary being signed.  When its token has an executor, the worker
+ * that hashed it hands the private key operation over and goes on to the
+ * next request while the token works, and finishes this one when it's
+ * given back.
+ */
+typedef struct signing {
+	context *owner;
+	daemon_request *req;
+	cms_context *cms;
+	int infd, outfd;
+	int attached;
+	Pe *inpe, *outpe;
+	uint64_t start, write_ns, submitted;
+	SECItem signature;		/* from SEC_SignData(), not the arena */
+	SECStatus status;
+	int error;
+	struct signing *next;
+} signing;
+
+typedef enum {
+	STATS_RECEIVE,
+	STATS_QUEUE,
+	STATS_CERT_LOOKUP,
+	STATS_DIGEST,
+	STATS_SIGN,
+	STATS_WRITE,
+	N_STATS_PHASES
+} stats_phase;
+
+static const char *stats_phase_names[N_STATS_PHASES] = {
+	[STATS_RECEIVE] = "receive",
+	[STATS_QUEUE] = "queue",
+	[STATS_CERT_LOOKUP] = "cert-lookup",
+	[STATS_DIGEST] = "digest",
+	[STATS_SIGN] = "sign",
+	[STATS_WRITE] = "write",
+};
+
+/* Keys past this many share one histogram. */
+#define STATS_KEYS		32
+
+typedef struct {
+	char *tokenname, *certname;
+	pesignd_histogram hist;
+} key_stats;
+
+/*
+ * What one worker has done.  Only that worker ever writes to it, so it
+ * needs no lock; CMD_GET_STATS adds up everybody's when it's asked.
+ * Keys are only ever appended, and nkeys is published after the names
+ * are filled in.
+ */
+typedef struct worker_stats {
+	pesignd_histogram commands[CMD_LIST_END];
+	pesignd_histogram phases[N_STATS_PHASES];
+	key_stats keys[STATS_KEYS];
+	uint32_t nkeys;
+	pesignd_histogram other_keys;
+	uint64_t bytes_hashed;
+	uint64_t expired;
+	uint64_t token_busy;
+	uint64_t contexts_created, contexts_reused;
+} worker_stats;
+
+/*
+ * Requests from one user, waiting for a worker.  Workers take the next
+ * request from whichever user's queue has the lowest pass, which goes up
+ * by less for users with a higher weight (stride scheduling), so one user
+ * with thousands of requests queued doesn't keep anybody else waiting
+ * for long.
+ */
+typedef struct uid_queue {
+	uid_t uid;
+	unsigned int weight;
+	uint64_t pass;
+	int in_flight;			/* queued or running */
+	daemon_request *head, *tail;
+	struct uid_queue *next;
+} uid_queue;
+
+#define STRIDE			(1 << 20)
+
+typedef struct daemon_pool {
+	pthread_mutex_t lock;		/* everything but nss_lock */
+	pthread_cond_t work;
+	uid_queue *queues;
+	uint64_t pass;			/* of the last request dequeued */
+	int waiting;			/* requests and helpers queued */
+	daemon_request *done;		/* requests to reclaim */
+	int in_flight;
+	int max_in_flight;
+	int queued;
+	int stopping;
+	uint64_t queue_timeout;		/* ns; 0 for none */
+	uid_weight *weights;
+	int nweights;
+	int wake[2];			/* workers poke the dispatcher */
+
+	/* only the dispatcher writes these */
+	uint64_t started;
+	uint64_t connections, accepted, bad_requests, rejected;
+
+	/* only the dispatcher touches these */
+	int epfd;
+	connection *conns;
+	connection *ready, *ready_tail;	/* may have input we haven't read */
+
 	uint8_t **tokennames;
 	int ntokennames;
-} context;
+
+	/* PK11_SetPasswordFunc() is global, so logging in to a token and
+	 * anything else that might prompt for a password are serialized */
+	pthread_mutex_t nss_lock;
+
+	pthread_mutex_t signer_lock;	/* signers and executors */
+	signer *signers[SIGNER_BUCKETS];
+	token_executor *executors;
+	token_threads *token_threads;
+	int ntoken_threads;
+
+	int nworkers;
+	struct {
+		context ctx;
+		pthread_t thread;
+		int running;
+		worker_stats stats;
+	} *workers;
+} daemon_pool;
+
+/*
+ * Statistics counters have one writer each, so a plain load and store
+ * does; they're atomic so a reader never sees half of one.
+ */
+static void
+stat_add(uint64_t *counter, uint64_t n)
+{
+	__atomic_store_n(counter, __atomic_load_n(counter, __ATOMIC_RELAXED)
+				  + n, __ATOMIC_RELAXED);
+}
+
+static void
+stat_sub(uint64_t *counter, uint64_t n)
+{
+	__atomic_store_n(counter, __atomic_load_n(counter, __ATOMIC_RELAXED)
+				  - n, __ATOMIC_RELAXED);
+}
+
+static uint64_t
+stat_read(uint64_t *counter)
+{
+	return __atomic_load_n(counter, __ATOMIC_RELAXED);
+}
+
+static void
+stats_record(pesignd_histogram *hist, uint64_t ns, int failed)
+{
+	uint64_t us = ns / 1000;
+	int bucket = us ? 64 - __builtin_clzll(us) : 0;
+
+	if (bucket >= PESIGND_STATS_BUCKETS)
+		bucket = PESIGND_STATS_BUCKETS - 1;
+
+	stat_add(&hist->count, 1);
+	if (failed)
+		stat_add(&hist->errors, 1);
+	stat_add(&hist->total_us, us);
+	stat_add(&hist->buckets[bucket], 1);
+}
+
+static void
+stats_merge(pesignd_histogram *dest, pesignd_histogram *src)
+{
+	dest->count += stat_read(&src->count);
+	dest->errors += stat_read(&src->errors);
+	dest->total_us += stat_read(&src->total_us);
+	for (int i = 0; i < PESIGND_STATS_BUCKETS; i++)
+		dest->buckets[i] += stat_read(&src->buckets[i]);
+}
+
+static void
+record_phase(context *ctx, stats_phase phase, uint64_t ns)
+{
+	if (ctx->stats)
+		stats_record(&ctx->stats->phases[phase], ns, 0);
+}
+
+/*
+ * How long signing something with tokenname:certname took.  Being told
+ * the token was busy isn't a failure; that's counted on its own.
+ */
+static void
+record_key(context *ctx, const char *tokenname, const char *certname,
+	   uint64_t ns, int rc)
+{
+	worker_stats *stats = ctx->stats;
+	pesignd_histogram *hist;
+
+	if (!stats || rc == PESIGND_BUSY)
+		return;
+
+	hist = &stats->other_keys;
+	for (uint32_t i = 0; i < stats->nkeys; i++) {
+		key_stats *key = &stats->keys[i];
+		if (!strcmp(key->tokenname, tokenname) &&
+				!strcmp(key->certname, certname)) {
+			hist = &key->hist;
+			goto found;
+		}
+	}
+
+	if (stats->nkeys < STATS_KEYS) {
+		key_stats *key = &stats->keys[stats->nkeys];
+		key->tokenname = strdup(tokenname);
+		key->certname = strdup(certname);
+		if (key->tokenname && key->certname) {
+			hist = &key->hist;
+			__atomic_store_n(&stats->nkeys, stats->nkeys + 1,
+					 __ATOMIC_RELEASE);
+		} else {
+			xfree(key->tokenname);
+			xfree(key->certname);
+		}
+	}
+found:
+	stats_record(hist, ns, rc < 0);
+}
+
+static unsigned int
+uid_weight_of(daemon_pool *pool, uid_t uid)
+{
+	for (int i = 0; i < pool->nweights; i++) {
+		if (pool->weights[i].uid == uid)
+			return pool->weights[i].weight;
+	}
+	return 1;
+}
+
+/* These all need pool->lock held. */
+static uid_queue *
+find_queue(daemon_pool *pool, uid_t uid)
+{
+	for (uid_queue *queue = pool->queues; queue; queue = queue->next) {
+		if (queue->uid == uid)
+			return queue;
+	}
+	return NULL;
+}
+
+static uid_queue *
+get_queue(daemon_pool *pool, uid_t uid)
+{
+	uid_queue *queue = find_queue(pool, uid);
+	if (queue)
+		return queue;
+
+	queue = calloc(1, sizeof (*queue));
+	if (!queue)
+		return NULL;
+	queue->uid = uid;
+	queue->weight = uid_weight_of(pool, uid);
+	queue->next = pool->queues;
+	pool->queues = queue;
+	return queue;
+}
+
+/* Forget about a user once nothing of theirs is queued or running. */
+static void
+put_queue(daemon_pool *pool, uid_queue *queue)
+{
+	if (queue->in_flight || queue->head)
+		return;
+
+	for (uid_queue **queuep = &pool->queues; *queuep;
+			queuep = &(*queuep)->next) {
+		if (*queuep == queue) {
+			*queuep = queue->next;
+			break;
+		}
+	}
+	free(queue);
+}
+
+/* Requests that can keep a worker (and a token) busy for a while. */
+static int
+is_signing_command(uint32_t command)
+{
+	return command == CMD_SIGN_ATTACHED || command == CMD_SIGN_DETACHED ||
+	       command == CMD_SIGN_DIGEST || command == CMD_SIGN_BATCH;
+}
+
+/*
+ * Whether a user may have another signing request queued.  Everybody
+ * with something queued or running gets a share of max_in_flight in
+ * proportion to their weight.  Somebody who's just shown up is let in
+ * even when the others have filled the queue between them, so it can
+ * briefly hold more than max_in_flight, but never twice that.
+ */
+static int
+admit_request(daemon_pool *pool, uid_t uid)
+{
+	uid_queue *queue = find_queue(pool, uid);
+	unsigned int weight = queue ? queue->weight : uid_weight_of(pool, uid);
+	unsigned int total = weight;
+	int in_flight = queue ? queue->in_flight : 0;
+
+	for (uid_queue *other = pool->queues; other; other = other->next) {
+		if (other != queue && other->in_flight)
+			total += other->weight;
+	}
+
+	int share = (uint64_t)pool->max_in_flight * weight / total;
+	if (share < 1)
+		share = 1;
+	return in_flight < share && pool->in_flight < 2 * pool->max_in_flight;
+}
+
+static void
+enqueue_request(daemon_pool *pool, uid_queue *queue, daemon_request *req)
+{
+	/* a user who's been idle doesn't get to catch up */
+	if (!queue->head && queue->pass < pool->pass)
+		queue->pass = pool->pass;
+
+	req->queue = queue;
+	req->next = NULL;
+	if (queue->tail)
+		queue->tail->next = req;
+	else
+		queue->head = req;
+	queue->tail = req;
+
+	pool->waiting++;
+	if (!req->batch)
+		pool->queued++;
+}
+
+static daemon_request *
+dequeue_request(daemon_pool *pool)
+{
+	uid_queue *next = NULL;
+
+	for (uid_queue *queue = pool->queues; queue; queue = queue->next) {
+		if (queue->head && (!next || queue->pass < next->pass))
+			next = queue;
+	}
+	if (!next)
+		return NULL;
+
+	daemon_request *req = next->head;
+	next->head = req->next;
+	if (!next->head)
+		next->tail = NULL;
+
+	pool->pass = next->pass;
+	next->pass += STRIDE / next->weight;
+
+	pool->waiting--;
+	if (!req->batch)
+		pool->queued--;
+	return req;
+}
+
+/*
+ * Give up on a client from inside a command handler.  Other workers may
+ * still be answering its requests, so the dispatcher closes it once
+ * they're all done.
+ */
+static void
+hang_up(daemon_request *req)
+{
+	shutdown(req->fd, SHUT_RDWR);
+	req->hung_up = 1;
+}
 
 static void
 steal_from_cms(cms_context *old, cms_context *new)
@@ -62,9 +572,13 @@ steal_from_cms(cms_context *old, cms_context *new)
 	new->certname = old->certname;
 
 	new->selected_digest = old->selected_digest;
+	new->digest_set = old->digest_set;
 
 	new->log = old->log;
 	new->log_priv = old->log_priv;
+
+	if (old->timing)
+		timing_enable(new);
 }
 
 static void
@@ -75,16 +589,28 @@ hide_stolen_goods_from_cms(cms_context *new,
 	new->certname = NULL;
 }
 
-static void
-send_response(context *ctx, cms_context *cms, struct pollfd *pollfd, int32_t rc)
+/* How long the dispatcher waits for a worker to finish writing to the
+ * same client, in milliseconds. */
+#define SEND_LOCK_WAIT	100
+
+/*
+ * Send a response.  Workers can wait for the client to make room for it,
+ * but the dispatcher can't, so with dontwait it fails instead, and the
+ * connection has to be closed.  It does wait a moment for a worker that's
+ * answering another of the client's requests; that only takes long if
+ * the client isn't reading.
+ */
+static int
+send_message(context *ctx, cms_context *cms, daemon_request *req,
+	     int32_t rc, const void *data, size_t msglen, int dontwait)
 {
 	struct msghdr msg;
 	struct iovec iov;
 	ssize_t n;
-	int msglen = ctx->errstr ? strlen(ctx->errstr) + 1 : 0;
+	size_t hdrlen = req->proto >= 2 ? sizeof(pesignd_msghdr_v2)
+					: sizeof(pesignd_msghdr);
 
-	iov.iov_len = sizeof(pesignd_msghdr) + sizeof(pesignd_cmd_response)
-			+ msglen;
+	iov.iov_len = hdrlen + sizeof(pesignd_cmd_response) + msglen;
 
 	void *buffer = calloc(1, iov.iov_len);
 	if (!buffer) {
@@ -95,34 +621,129 @@ send_response(context *ctx, cms_context *cms, struct pollfd *pollfd, int32_t rc)
 
 	iov.iov_base = buffer;
 
-	pesignd_msghdr *pm = buffer;
-	pesignd_cmd_response *resp = (pesignd_cmd_response *)((uint8_t *)pm +
-					offsetof(pesignd_msghdr, size) +
-					sizeof (pm->size));
+	pesignd_msghdr_v2 *pm = buffer;
+	pesignd_cmd_response *resp = (pesignd_cmd_response *)
+					((uint8_t *)buffer + hdrlen);
 
-	pm->version = PESIGND_VERSION;
+	req->rc = rc;
+
+	pm->version = req->proto >= 2 ? PESIGND_VERSION_2 : PESIGND_VERSION;
 	pm->command = CMD_RESPONSE;
 	pm->size = sizeof(resp->rc) + msglen;
+	if (req->proto >= 2)
+		pm->id = req->id;
 
 	memset(&msg, '\0', sizeof(msg));
 	msg.msg_iov = &iov;
 	msg.msg_iovlen = 1;
 
 	resp->rc = rc;
-	if (ctx->errstr)
-		memcpy(resp->errmsg, ctx->errstr, msglen);
+	if (msglen)
+		memcpy(resp->errmsg, data, msglen);
 
-	n = sendmsg(pollfd->fd, &msg, 0);
+	if (dontwait) {
+		struct timespec ts;
+
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_nsec += SEND_LOCK_WAIT * 1000000L;
+		if (ts.tv_nsec >= 1000000000L) {
+			ts.tv_sec++;
+			ts.tv_nsec -= 1000000000L;
+		}
+		if (pthread_mutex_timedlock(&req->conn->write_lock,
+					    &ts) != 0) {
+			free(buffer);
+			return -1;
+		}
+		n = sendmsg(req->fd, &msg, MSG_NOSIGNAL|MSG_DONTWAIT);
+	} else {
+		/* the client may send its next request as soon as it has
+		 * this answer, so don't count this one against it then */
+		if (req->queue && !req->batch) {
+			daemon_pool *pool = ctx->pool;
+
+			pthread_mutex_lock(&pool->lock);
+			if (!req->answered) {
+				pool->in_flight--;
+				req->queue->in_flight--;
+				req->answered = 1;
+			}
+			pthread_mutex_unlock(&pool->lock);
+		}
+		pthread_mutex_lock(&req->conn->write_lock);
+		n = sendmsg(req->fd, &msg, MSG_NOSIGNAL);
+	}
+	pthread_mutex_unlock(&req->conn->write_lock);
 	if (n < 0)
 		cms->log(cms, ctx->priority|LOG_WARNING,
 			"could not send response to client: %m");
 
 	free(buffer);
+	return n == (ssize_t)iov.iov_len ? 0 : -1;
+}
+
+/*
+ * Set ctx->cms up for a request.  Workers hang on to the ones they used
+ * last time, with their arenas released back to where they started, so a
+ * request doesn't cost a new context and arena.
+ */
+static int
+get_request_cms(context *ctx)
+{
+	if (ctx->nspare) {
+		ctx->cms = ctx->spare_cms[--ctx->nspare];
+		if (ctx->stats)
+			stat_add(&ctx->stats->contexts_reused, 1);
+	} else {
+		int rc = cms_context_alloc(&ctx->cms);
+		if (rc < 0)
+			return rc;
+		rc = cms_context_recycle(ctx->cms);
+		if (rc < 0) {
+			cms_context_fini(ctx->cms);
+			ctx->cms = NULL;
+			return rc;
+		}
+		if (ctx->stats)
+			stat_add(&ctx->stats->contexts_created, 1);
+	}
+
+	steal_from_cms(ctx->backup_cms, ctx->cms);
+	return 0;
+}
+
+static void
+put_request_cms(context *ctx)
+{
+	cms_context *cms = ctx->cms;
+
+	ctx->cms = NULL;
+	hide_stolen_goods_from_cms(cms, ctx->backup_cms);
+	if (ctx->is_worker && ctx->nspare < MAX_PARKED + 1 &&
+			cms_context_recycle(cms) >= 0)
+		ctx->spare_cms[ctx->nspare++] = cms;
+	else
+		cms_context_fini(cms);
+}
+
+static void
+send_response_data(context *ctx, cms_context *cms, daemon_request *req,
+		   int32_t rc, const void *data, size_t msglen)
+{
+	send_message(ctx, cms, req, rc, data, msglen, 0);
+}
+
+static void
+send_response(context *ctx, cms_context *cms, daemon_request *req, int32_t rc)
+{
+	send_response_data(ctx, cms, req, rc, ctx->errstr,
+			   ctx->errstr ? strlen(ctx->errstr) + 1 : 0);
 }
 
 static void
 handle_kill_daemon(context *ctx __attribute__((__unused__)),
-		   struct pollfd *pollfd __attribute__((__unused__)),
+		   daemon_request *req __attribute__((__unused__)),
+		   char *buffer __attribute__((__unused__)),
 		   socklen_t size __attribute__((__unused__)))
 {
 	should_exit = 1;
@@ -137,101 +758,341 @@ cmpstringp(const void *p1, const void *p2)
 static int
 add_token_to_authenticated_list(context *ctx, uint8_t *tokenname)
 {
+	daemon_pool *pool = ctx->pool;
 	char *tmp;
-	uint8_t **newtokennames = realloc(ctx->tokennames,
+	int rc = -1;
+
+	pthread_mutex_lock(&pool->lock);
+	uint8_t **newtokennames = realloc(pool->tokennames,
 					sizeof (uint8_t *)
-					* (ctx->ntokennames+1));
+					* (pool->ntokennames+1));
 	if (!newtokennames)
-		return -1;
-	ctx->tokennames = newtokennames;
+		goto out;
+	pool->tokennames = newtokennames;
 
 	tmp = strdup((char *)tokenname);
 	if (!tmp)
-		return -1;
+		goto out;
 
-	newtokennames[ctx->ntokennames++] = (uint8_t *)tmp;
+	newtokennames[pool->ntokennames++] = (uint8_t *)tmp;
 
-	qsort(newtokennames, ctx->ntokennames, sizeof (char *), cmpstringp);
-	return 0;
+	qsort(newtokennames, pool->ntokennames, sizeof (char *), cmpstringp);
+	rc = 0;
+out:
+	pthread_mutex_unlock(&pool->lock);
+	return rc;
+}
+
+static unsigned int
+signer_hash(const char *tokenname, const char *certname)
+{
+	unsigned int hash = 2166136261u;
+
+	for (const char *c = tokenname; *c; c++)
+		hash = (hash ^ (unsigned char)*c) * 16777619u;
+	hash = (hash ^ 0xff) * 16777619u;
+	for (const char *c = certname; *c; c++)
+		hash = (hash ^ (unsigned char)*c) * 16777619u;
+	return hash;
 }
 
 static void
-handle_unlock_token(context *ctx, struct pollfd *pollfd, socklen_t size)
+free_signer(signer *sgn)
 {
-	struct msghdr msg;
-	struct iovec iov;
-	ssize_t n;
+	if (sgn->slot)
+		PK11_FreeSlot(sgn->slot);
+	cms_context_fini(sgn->cms);
+	free(sgn);
+}
 
-	int rc = cms_context_alloc(&ctx->cms);
-	if (rc < 0) {
-		send_response(ctx, ctx->backup_cms, pollfd, rc);
-		return;
-	}
+/*
+ * Forget every cached signer on a token, or on all of them if tokenname
+ * is NULL.  Called with signer_lock held.
+ */
+static void
+drop_signers(daemon_pool *pool, const char *tokenname)
+{
+	for (int i = 0; i < SIGNER_BUCKETS; i++) {
+		signer **sgnp = &pool->signers[i];
 
-	steal_from_cms(ctx->backup_cms, ctx->cms);
+		while (*sgnp) {
+			signer *sgn = *sgnp;
 
-	char *buffer = malloc(size);
-	if (!buffer) {
-oom:
-		ctx->cms->log(ctx->cms, ctx->priority|LOG_ERR,
-			"unable to allocate memory: %m");
-		exit(1);
+			if (tokenname && strcmp(sgn->cms->tokenname, tokenname)) {
+				sgnp = &sgn->next;
+				continue;
+			}
+			*sgnp = sgn->next;
+			free_signer(sgn);
+		}
 	}
+}
 
-	memset(&msg, '\0', sizeof(msg));
+/*
+ * A cached key is only any good while its token is still the one we
+ * found it on and we're still logged in to it.
+ */
+static int
+signer_is_current(signer *sgn)
+{
+	if (!PK11_IsPresent(sgn->slot))
+		return 0;
+	if (PK11_GetSlotSeries(sgn->slot) != sgn->series)
+		return 0;
+	if (PK11_NeedLogin(sgn->slot) && !PK11_IsLoggedIn(sgn->slot, NULL))
+		return 0;
+	return 1;
+}
 
-	iov.iov_base = buffer;
-	iov.iov_len = size;
-	msg.msg_iov = &iov;
-	msg.msg_iovlen = 1;
+/*
+ * Find the link pointing at the cached signer for cms's tokenname and
+ * certname; *result is NULL if there isn't one.  Called with signer_lock
+ * held.
+ */
+static signer **
+lookup_signer(daemon_pool *pool, cms_context *cms, unsigned int hash)
+{
+	signer **sgnp = &pool->signers[hash % SIGNER_BUCKETS];
 
-	n = recvmsg(pollfd->fd, &msg, MSG_WAITALL);
+	while (*sgnp) {
+		signer *sgn = *sgnp;
 
-	pesignd_string *tn = (pesignd_string *)buffer;
-	if (n < (long long)sizeof(tn->size)) {
-malformed:
-		ctx->cms->log(ctx->cms, ctx->priority|LOG_ERR,
-			"unlock-token: invalid data");
-		ctx->cms->log(ctx->cms, ctx->priority|LOG_ERR,
-			"possible exploit attempt. closing.");
-		close(pollfd->fd);
-		return;
+		if (sgn->hash == hash &&
+				!strcmp(sgn->cms->tokenname, cms->tokenname) &&
+				!strcmp(sgn->cms->certname, cms->certname))
+			break;
+		sgnp = &sgn->next;
 	}
-	n -= sizeof(tn->size);
-	if ((size_t)n < tn->size)
-		goto malformed;
-	n -= tn->size;
+	return sgnp;
+}
 
-	if (tn->value[tn->size - 1] != '\0')
-		goto malformed;
+static signer *
+new_signer(cms_context *cms, unsigned int hash, token_executor *executor)
+{
+	signer *sgn = calloc(1, sizeof (*sgn));
+	if (!sgn)
+		return NULL;
 
-	pesignd_string *tp = pesignd_string_next(tn);
-	if ((size_t)n < sizeof(tp->size))
-		goto malformed;
-	n -= sizeof(tp->size);
-	if ((size_t)n < tp->size)
-		goto malformed;
-	n -= tp->size;
+	if (cms_context_alloc(&sgn->cms) < 0) {
+		free(sgn);
+		return NULL;
+	}
+	sgn->cms->tokenname = PORT_ArenaStrdup(sgn->cms->arena,
+						cms->tokenname);
+	sgn->cms->certname = PORT_ArenaStrdup(sgn->cms->arena,
+						cms->certname);
+	if (!sgn->cms->tokenname || !sgn->cms->certname ||
+			cms_context_copy_signer(sgn->cms, cms) < 0) {
+		free_signer(sgn);
+		return NULL;
+	}
 
-	if (tn->value[tn->size - 1] != '\0')
-		goto malformed;
+	sgn->slot = PK11_GetSlotFromPrivateKey(cms->signing_key);
+	if (!sgn->slot) {
+		free_signer(sgn);
+		return NULL;
+	}
+	sgn->series = PK11_GetSlotSeries(sgn->slot);
+	sgn->hash = hash;
+	sgn->executor = executor;
+	return sgn;
+}
 
-	if (n != 0)
-		goto malformed;
+/*
+ * How many signatures to have a token make at once: what we were told
+ * to, or else as many as it has sessions for, up to one per worker.
+ */
+static int
+executor_threads(daemon_pool *pool, const char *tokenname,
+		 SECKEYPrivateKey *key)
+{
+	for (int i = 0; i < pool->ntoken_threads; i++) {
+		if (!strcmp(pool->token_threads[i].tokenname, tokenname))
+			return pool->token_threads[i].nthreads;
+	}
 
-	ctx->cms->log(ctx->cms, ctx->priority|LOG_NOTICE,
-		"unlocking token \"%s\"", tn->value);
+	int nthreads = pool->nworkers;
+	PK11SlotInfo *slot = PK11_GetSlotFromPrivateKey(key);
+	if (slot) {
+		CK_TOKEN_INFO info;
+
+		if (PK11_GetTokenInfo(slot, &info) == SECSuccess &&
+				info.ulMaxSessionCount != CK_EFFECTIVELY_INFINITE &&
+				info.ulMaxSessionCount !=
+						CK_UNAVAILABLE_INFORMATION &&
+				info.ulMaxSessionCount < (CK_ULONG)nthreads)
+			nthreads = info.ulMaxSessionCount;
+		PK11_FreeSlot(slot);
+	}
+	return nthreads > 0 ? nthreads : 1;
+}
 
-	/* authenticating with nss frees this ... best API ever. */
-	ctx->cms->tokenname = PORT_ArenaStrdup(ctx->cms->arena,
-						(char *)tn->value);
-	if (!ctx->cms->tokenname)
-		goto oom;
+/*
+ * Find the executor for cms->tokenname, starting one if this is the
+ * first key we've found there.  Called with signer_lock held; returns
+ * NULL if we couldn't, in which case the worker signs for itself.
+ */
+static token_executor *
+get_executor(context *ctx, cms_context *cms)
+{
+	daemon_pool *pool = ctx->pool;
+	token_executor *ex;
 
-	char *pin = (char *)tp->value;
-	if (!pin)
-		goto oom;
+	for (ex = pool->executors; ex; ex = ex->next) {
+		if (!strcmp(ex->tokenname, cms->tokenname))
+			return ex;
+	}
+
+	ex = calloc(1, sizeof (*ex));
+	if (!ex)
+		return NULL;
+	ex->tokenname = strdup(cms->tokenname);
+	ex->nthreads = executor_threads(pool, cms->tokenname,
+					cms->signing_key);
+	int max_pending = pool->nworkers * MAX_PARKED / 2;
+	if (!ex->tokenname ||
+			sign_queue_new(&ex->queue, max_pending,
+				       ex->nthreads) < 0) {
+		cms->log(cms, ctx->priority|LOG_WARNING,
+			"could not start signing threads for \"%s\": %m",
+			cms->tokenname);
+		xfree(ex->tokenname);
+		free(ex);
+		return NULL;
+	}
+
+	cms->log(cms, ctx->priority|LOG_INFO,
+		"signing with \"%s\" on %d thread%s", cms->tokenname,
+		ex->nthreads, ex->nthreads == 1 ? "" : "s");
+	ex->next = pool->executors;
+	pool->executors = ex;
+	return ex;
+}
+
+static void
+free_executors(daemon_pool *pool)
+{
+	while (pool->executors) {
+		token_executor *ex = pool->executors;
+		pool->executors = ex->next;
+		sign_queue_free(ex->queue);
+		free(ex->tokenname);
+		free(ex);
+	}
+}
+
+/* Whether a request for cms's key would have to wait for its token. */
+static int
+token_busy(cms_context *cms)
+{
+	return cms->sign_queue && sign_queue_full(cms->sign_queue);
+}
+
+/*
+ * Fill in ctx->cms's certificate, private key, and chain for its
+ * tokenname and certname, from the cache if we can, and otherwise by
+ * searching the token and then caching what we find.
+ */
+static int
+get_signer(context *ctx)
+{
+	daemon_pool *pool = ctx->pool;
+	cms_context *cms = ctx->cms;
+	unsigned int hash = signer_hash(cms->tokenname, cms->certname);
+	signer **sgnp, *sgn;
+	int rc = -1;
+
+	pthread_mutex_lock(&pool->signer_lock);
+	sgnp = lookup_signer(pool, cms, hash);
+	sgn = *sgnp;
+	if (sgn && !signer_is_current(sgn)) {
+		*sgnp = sgn->next;
+		free_signer(sgn);
+		sgn = NULL;
+	}
+	if (sgn) {
+		rc = cms_context_copy_signer(cms, sgn->cms);
+		if (sgn->executor)
+			cms->sign_queue = sgn->executor->queue;
+	}
+	pthread_mutex_unlock(&pool->signer_lock);
+	if (sgn)
+		return rc;
+
+	pthread_mutex_lock(&pool->nss_lock);
+	rc = find_certificate(cms, 1);
+	if (rc >= 0)
+		rc = cache_signing_key(cms);
+	if (rc >= 0)
+		rc = cache_certificate_list(cms);
+	pthread_mutex_unlock(&pool->nss_lock);
+	if (rc < 0)
+		return rc;
+
+	pthread_mutex_lock(&pool->signer_lock);
+	token_executor *ex = get_executor(ctx, cms);
+	pthread_mutex_unlock(&pool->signer_lock);
+	if (ex)
+		cms->sign_queue = ex->queue;
+
+	sgn = new_signer(cms, hash, ex);
+	if (!sgn) {
+		/* we can still sign this one; we just can't remember it */
+		cms->log(cms, ctx->priority|LOG_WARNING,
+			"could not cache key \"%s:%s\"",
+			cms->tokenname, cms->certname);
+		return 0;
+	}
+
+	/* if another worker beat us to it, theirs is just as good */
+	pthread_mutex_lock(&pool->signer_lock);
+	sgnp = lookup_signer(pool, cms, hash);
+	if (*sgnp) {
+		free_signer(sgn);
+	} else {
+		sgn->next = NULL;
+		*sgnp = sgn;
+	}
+	pthread_mutex_unlock(&pool->signer_lock);
+	return 0;
+}
+
+/* After a signing failure, make the next request look everything up again. */
+static void
+forget_signer(context *ctx)
+{
+	daemon_pool *pool = ctx->pool;
+	cms_context *cms = ctx->cms;
+	unsigned int hash = signer_hash(cms->tokenname, cms->certname);
+
+	pthread_mutex_lock(&pool->signer_lock);
+	signer **sgnp = lookup_signer(pool, cms, hash);
+	if (*sgnp) {
+		signer *sgn = *sgnp;
+		*sgnp = sgn->next;
+		free_signer(sgn);
+	}
+	pthread_mutex_unlock(&pool->signer_lock);
+}
+
+/* Log in to tokenname with pin, using ctx->cms. */
+static int
+unlock_token(context *ctx, char *tokenname, char *pin)
+{
+	int rc;
+
+	ctx->cms->log(ctx->cms, ctx->priority|LOG_NOTICE,
+		"unlocking token \"%s\"", tokenname);
+
+	/* authenticating with nss frees this ... best API ever. */
+	ctx->cms->tokenname = PORT_ArenaStrdup(ctx->cms->arena, tokenname);
+	if (!ctx->cms->tokenname) {
+		ctx->cms->log(ctx->cms, ctx->priority|LOG_ERR,
+			"unable to allocate memory: %m");
+		exit(1);
+	}
 
+	pthread_mutex_lock(&ctx->pool->nss_lock);
 	cms_set_pw_callback(ctx->cms, get_password_passthrough);
 	cms_set_pw_data(ctx->cms, pin);
 
@@ -239,57 +1100,91 @@ malformed:
 
 	cms_set_pw_callback(ctx->cms, get_password_fail);
 	cms_set_pw_data(ctx->cms, NULL);
+	pthread_mutex_unlock(&ctx->pool->nss_lock);
+
+	/* logging in again may have invalidated any keys we were holding */
+	pthread_mutex_lock(&ctx->pool->signer_lock);
+	drop_signers(ctx->pool, tokenname);
+	pthread_mutex_unlock(&ctx->pool->signer_lock);
 
 	if (rc == -1)
 		ctx->cms->log(ctx->cms, ctx->priority|LOG_ERR,
-			"could not find token \"%s\"", tn->value);
+			"could not find token \"%s\"", tokenname);
 	else if (rc == 0) {
 		ctx->cms->log(ctx->cms, ctx->priority|LOG_NOTICE,
 			"authentication succeeded for token \"%s\"",
-			tn->value);
-		rc = add_token_to_authenticated_list(ctx, tn->value);
+			tokenname);
+		rc = add_token_to_authenticated_list(ctx,
+						     (uint8_t *)tokenname);
 		if (rc < 0)
 			ctx->cms->log(ctx->cms, ctx->priority|LOG_ERR,
 				"couldn't add token to internal list: %m");
 	}
-
-	send_response(ctx, ctx->cms, pollfd, rc);
-	free(buffer);
-
-	hide_stolen_goods_from_cms(ctx->cms, ctx->backup_cms);
-	cms_context_fini(ctx->cms);
+	return rc;
 }
 
 static void
-handle_is_token_unlocked(context *ctx, struct pollfd *pollfd, socklen_t size)
+handle_unlock_token(context *ctx, daemon_request *req, char *buffer,
+		    socklen_t size)
 {
-	struct msghdr msg;
-	struct iovec iov;
-	ssize_t n;
+	ssize_t n = size;
 
-	int rc = cms_context_alloc(&ctx->cms);
+	int rc = get_request_cms(ctx);
 	if (rc < 0) {
-		send_response(ctx, ctx->backup_cms, pollfd, rc);
+		send_response(ctx, ctx->backup_cms, req, rc);
 		return;
 	}
 
-	steal_from_cms(ctx->backup_cms, ctx->cms);
-
-	char *buffer = malloc(size);
-	if (!buffer) {
+	pesignd_string *tn = (pesignd_string *)buffer;
+	if (n < (long long)sizeof(tn->size)) {
+malformed:
 		ctx->cms->log(ctx->cms, ctx->priority|LOG_ERR,
-			"unable to allocate memory: %m");
-		exit(1);
+			"unlock-token: invalid data");
+		ctx->cms->log(ctx->cms, ctx->priority|LOG_ERR,
+			"possible exploit attempt. closing.");
+		hang_up(req);
+		put_request_cms(ctx);
+		return;
 	}
+	n -= sizeof(tn->size);
+	if ((size_t)n < tn->size)
+		goto malformed;
+	n -= tn->size;
 
-	memset(&msg, '\0', sizeof(msg));
+	if (tn->value[tn->size - 1] != '\0')
+		goto malformed;
 
-	iov.iov_base = buffer;
-	iov.iov_len = size;
-	msg.msg_iov = &iov;
-	msg.msg_iovlen = 1;
+	pesignd_string *tp = pesignd_string_next(tn);
+	if ((size_t)n < sizeof(tp->size))
+		goto malformed;
+	n -= sizeof(tp->size);
+	if ((size_t)n < tp->size)
+		goto malformed;
+	n -= tp->size;
+
+	if (tn->value[tn->size - 1] != '\0')
+		goto malformed;
+
+	if (n != 0)
+		goto malformed;
+
+	rc = unlock_token(ctx, (char *)tn->value, (char *)tp->value);
+	send_response(ctx, ctx->cms, req, rc);
+
+	put_request_cms(ctx);
+}
+
+static void
+handle_is_token_unlocked(context *ctx, daemon_request *req, char *buffer,
+			 socklen_t size)
+{
+	ssize_t n = size;
 
-	n = recvmsg(pollfd->fd, &msg, MSG_WAITALL);
+	int rc = get_request_cms(ctx);
+	if (rc < 0) {
+		send_response(ctx, ctx->backup_cms, req, rc);
+		return;
+	}
 
 	pesignd_string *tn = (pesignd_string *)buffer;
 	if (n < (long long)sizeof(tn->size)) {
@@ -298,7 +1193,8 @@ malformed:
 			"unlock-token: invalid data");
 		ctx->cms->log(ctx->cms, ctx->priority|LOG_ERR,
 			"possible exploit attempt. closing.");
-		close(pollfd->fd);
+		hang_up(req);
+		put_request_cms(ctx);
 		return;
 	}
 	n -= sizeof(tn->size);
@@ -318,30 +1214,56 @@ malformed:
 	char *key = (char *)tn->value;
 	char *tokenname;
 
-	tokenname = bsearch(&key, ctx->tokennames, ctx->ntokennames,
-				sizeof (char *), cmpstringp);
-	send_response(ctx, ctx->cms, pollfd, tokenname == NULL ? 1 : 0);
+	pthread_mutex_lock(&ctx->pool->lock);
+	tokenname = bsearch(&key, ctx->pool->tokennames,
+			    ctx->pool->ntokennames, sizeof (char *),
+			    cmpstringp);
+	pthread_mutex_unlock(&ctx->pool->lock);
+	send_response(ctx, ctx->cms, req, tokenname == NULL ? 1 : 0);
 
 	ctx->cms->log(ctx->cms, ctx->priority|LOG_NOTICE,
 			"token \"%s\" is %sunlocked", tn->value,
 			tokenname == NULL ? "not " : "");
 
-	free(buffer);
-
-	hide_stolen_goods_from_cms(ctx->cms, ctx->backup_cms);
-	cms_context_fini(ctx->cms);
+	put_request_cms(ctx);
 }
 
 static void
-handle_get_cmd_version(context *ctx, struct pollfd *pollfd, socklen_t size);
+handle_get_cmd_version(context *ctx, daemon_request *req, char *buffer,
+		       socklen_t size);
+static void
+handle_negotiate(context *ctx, daemon_request *req, char *buffer,
+		 socklen_t size);
+static void
+handle_get_stats(context *ctx, daemon_request *req, char *buffer,
+		 socklen_t size);
+
+/* How long a worker waits for a protocol 1 client to send the file
+ * descriptors that go with its request, in seconds. */
+#define FD_WAIT		5
 
 static void
-socket_get_fd(context *ctx, int sd, int *fd)
+socket_get_fd(context *ctx, daemon_request *req, int *fd)
 {
 	struct msghdr msg;
 	struct iovec iov;
 	char buf[2];
 
+	/* with protocol 2 they came along with the request */
+	if (req->proto >= 2) {
+		if (req->nextfd < req->nfds) {
+			*fd = req->fds[req->nextfd];
+			req->fds[req->nextfd++] = -1;
+			return;
+		}
+		ctx->cms->log(ctx->cms, ctx->priority|LOG_ERR,
+			"request is missing a file descriptor");
+		ctx->cms->log(ctx->cms, ctx->priority|LOG_ERR,
+			"possible exploit attempt. closing.");
+		hang_up(req);
+		return;
+	}
+
 	size_t controllen = CMSG_SPACE(sizeof(int));
 	struct cmsghdr *cm = malloc(controllen);
 	if (!cm) {
@@ -358,15 +1280,33 @@ socket_get_fd(context *ctx, int sd, int *fd)
 	msg.msg_control = cm;
 	msg.msg_controllen = controllen;
 
+	/* a client that never sends it mustn't keep the worker forever */
+	struct timeval tv = { .tv_sec = FD_WAIT };
+	if (setsockopt(req->fd, SOL_SOCKET, SO_RCVTIMEO, &tv,
+		       sizeof (tv)) < 0) {
+		ctx->cms->log(ctx->cms, ctx->priority|LOG_ERR,
+			"could not set receive timeout: %m");
+		free(cm);
+		hang_up(req);
+		return;
+	}
+
 	ssize_t n;
-	n = recvmsg(sd, &msg, MSG_WAITALL);
+	n = recvmsg(req->fd, &msg, MSG_WAITALL);
+	if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+		ctx->cms->log(ctx->cms, ctx->priority|LOG_ERR,
+			"timed out waiting for a file descriptor. closing.");
+		free(cm);
+		hang_up(req);
+		return;
+	}
 	if (n < 0) {
 malformed:
 		ctx->cms->log(ctx->cms, ctx->priority|LOG_ERR,
 			"unlock-token: invalid data");
 		ctx->cms->log(ctx->cms, ctx->priority|LOG_ERR,
 			"possible exploit attempt. closing.");
-		close(sd);
+		hang_up(req);
 		return;
 	}
 
@@ -389,9 +1329,11 @@ malformed:
 static int
 set_up_inpe(context *ctx, int fd, Pe **pe)
 {
+	uint64_t start = timing_begin(ctx->cms);
 	*pe = pe_begin(fd, PE_C_READ_MMAP, NULL);
 	if (!*pe)
 		*pe = pe_begin(fd, PE_C_READ, NULL);
+	timing_end(ctx->cms, TIMING_PE_BEGIN, start);
 	if (!*pe) {
 		ctx->cms->log(ctx->cms, ctx->priority|LOG_ERR,
 			"could not parse PE binary: %s",
@@ -399,8 +1341,10 @@ set_up_inpe(context *ctx, int fd, Pe **pe)
 		return -1;
 	}
 
+	start = timing_begin(ctx->cms);
 	int rc = parse_signatures(&ctx->cms->signatures,
 				  &ctx->cms->num_signatures, *pe);
+	timing_end(ctx->cms, TIMING_PARSE_SIGNATURES, start);
 	if (rc < 0) {
 		ctx->cms->log(ctx->cms, ctx->priority|LOG_ERR,
 			"could not parse signature list");
@@ -414,34 +1358,18 @@ set_up_inpe(context *ctx, int fd, Pe **pe)
 static int
 set_up_outpe(context *ctx, int fd, Pe *inpe, Pe **outpe)
 {
-	size_t size;
-	char *addr;
-
-	addr = pe_rawfile(inpe, &size);
-
-	off_t offset = lseek(fd, 0, SEEK_SET);
-	if (offset < 0) {
-		ctx->cms->log(ctx->cms, ctx->priority|LOG_ERR,
-			"could not read output file: %m");
-		return -1;
-	}
-
-	int rc = ftruncate(fd, size);
-	if (rc < 0) {
-		ctx->cms->log(ctx->cms, ctx->priority|LOG_ERR,
-			"could not extend output file: %m");
-		return -1;
-	}
-	rc = write(fd, addr, size);
+	int rc = pe_copyfile(inpe, fd);
 	if (rc < 0) {
 		ctx->cms->log(ctx->cms, ctx->priority|LOG_ERR,
 			"could not write to output file: %m");
 		return -1;
 	}
 
+	uint64_t start = timing_begin(ctx->cms);
 	*outpe = pe_begin(fd, PE_C_RDWR_MMAP, NULL);
 	if (!*outpe)
 		*outpe = pe_begin(fd, PE_C_RDWR, NULL);
+	timing_end(ctx->cms, TIMING_PE_BEGIN, start);
 	if (!*outpe) {
 		ctx->cms->log(ctx->cms, ctx->priority|LOG_ERR,
 			"could not set up output: %s",
@@ -453,31 +1381,274 @@ set_up_outpe(context *ctx, int fd, Pe *inpe, Pe **outpe)
 	return 0;
 }
 
-static void
-handle_signing(context *ctx, struct pollfd *pollfd, socklen_t size,
-	int attached)
+static int
+find_signer(context *ctx)
 {
-	struct msghdr msg;
-	struct iovec iov;
-	ssize_t n;
-	char *buffer = malloc(size);
-	Pe *inpe = NULL;
+	uint64_t start = timing_now();
+	int rc = get_signer(ctx);
+	record_phase(ctx, STATS_CERT_LOOKUP, timing_now() - start);
+	return rc;
+}
 
-	if (!buffer) {
-oom:
+static int
+digest_binary(context *ctx, Pe *pe)
+{
+	uint64_t start = timing_now();
+	int rc = generate_digest(ctx->cms, pe, 1);
+	record_phase(ctx, STATS_DIGEST, timing_now() - start);
+
+	size_t size;
+	if (rc >= 0 && ctx->stats && pe_rawfile(pe, &size))
+		stat_add(&ctx->stats->bytes_hashed, size);
+	return rc;
+}
+
+static int
+sign_blob(context *ctx)
+{
+	uint64_t start = timing_now();
+	int rc = generate_signature(ctx->cms);
+	record_phase(ctx, STATS_SIGN, timing_now() - start);
+	if (rc < 0)
+		forget_signer(ctx);
+	return rc;
+}
+
+/*
+ * Everything that comes before the signature on one binary: find the
+ * key, map the input, set up the output, and hash it.  With nowait, if
+ * the key's token already has all the work it can take, give up with
+ * PESIGND_BUSY instead.
+ */
+static int
+begin_signing(context *ctx, signing *job, int nowait)
+{
+	int rc = find_signer(ctx);
+	if (rc < 0)
+		return rc;
+	if (nowait && token_busy(ctx->cms))
+		return PESIGND_BUSY;
+
+	rc = set_up_inpe(ctx, job->infd, &job->inpe);
+	if (rc < 0)
+		return rc;
+
+	if (!job->attached) {
+		ftruncate(job->outfd, 0);
+		return digest_binary(ctx, job->inpe);
+	}
+
+	uint64_t start = timing_now();
+	rc = set_up_outpe(ctx, job->outfd, job->inpe, &job->outpe);
+	if (rc < 0)
+		return rc;
+
+	rc = reserve_cert_table(job->outpe);
+	if (rc < 0) {
 		ctx->cms->log(ctx->cms, ctx->priority|LOG_ERR,
-			"unable to allocate memory: %m");
-		exit(1);
+			"could not allocate signature space: %s",
+			pe_errmsg(pe_errno()));
+		return rc;
 	}
+	job->write_ns = timing_now() - start;
 
-	memset(&msg, '\0', sizeof(msg));
+	return digest_binary(ctx, job->outpe);
+}
 
-	iov.iov_base = buffer;
-	iov.iov_len = size;
-	msg.msg_iov = &iov;
-	msg.msg_iovlen = 1;
+/* Put the new signature in the output binary, or write it by itself. */
+static int
+finish_signing(context *ctx, signing *job)
+{
+	uint64_t start = timing_now();
+	int rc = 0;
+
+	if (job->attached) {
+		insert_signature(ctx->cms, ctx->cms->num_signatures);
+		finalize_cms_signatures(ctx->cms, job->outpe);
+		update_cms_image(ctx->cms, job->outpe, PE_C_RDWR_MMAP);
+		pe_end(job->outpe);
+		job->outpe = NULL;
+	} else {
+		rc = export_signature(ctx->cms, job->outfd, 0);
+		if (rc >= 0)
+			ftruncate(job->outfd, rc);
+	}
+	record_phase(ctx, STATS_WRITE, job->write_ns + timing_now() - start);
+	return rc;
+}
+
+static void
+end_signing(signing *job, int rc)
+{
+	if (job->outpe)
+		pe_end(job->outpe);
+	if (rc < 0)
+		ftruncate(job->outfd, 0);
+	if (job->inpe)
+		pe_end(job->inpe);
+}
+
+/*
+ * Sign one binary with the key ctx->cms is set up to use, writing either
+ * the signed binary or a detached signature to outfd.
+ */
+static int
+sign_files(context *ctx, int infd, int outfd, int attached)
+{
+	signing job = {
+		.infd = infd,
+		.outfd = outfd,
+		.attached = attached,
+	};
+
+	int rc = begin_signing(ctx, &job, 0);
+	if (rc >= 0)
+		rc = sign_blob(ctx);
+	if (rc >= 0)
+		rc = finish_signing(ctx, &job);
+	end_signing(&job, rc);
+	return rc;
+}
+
+/* Called on the token's thread. */
+static void
+signing_done(SECStatus status, int error, void *arg)
+{
+	signing *job = arg;
+	daemon_pool *pool = job->owner->pool;
+
+	pthread_mutex_lock(&pool->lock);
+	job->status = status;
+	job->error = error;
+	job->next = job->owner->finished;
+	job->owner->finished = job;
+	pthread_cond_broadcast(&pool->work);
+	pthread_mutex_unlock(&pool->lock);
+}
+
+/*
+ * Build the signed attributes for a binary we've hashed and give them to
+ * its token's executor to sign.  The token hands the signature back to
+ * this worker, since nothing but the worker that owns ctx->cms may
+ * allocate from its arena.  Returns -1 if it has to be signed here.
+ */
+static int
+park_signing(context *ctx, signing *job)
+{
+	daemon_pool *pool = ctx->pool;
+	cms_context *cms = ctx->cms;
+
+	if (!cms->sign_queue || !ctx->is_worker)
+		return -1;
+
+	/* the signed attributes include the content info's digest */
+	SpcContentInfo cinfo;
+	SECOidData *oid = SECOID_FindOIDByTag(digest_get_signature_oid(cms));
+	SECItem *sattrs = PORT_ArenaZAlloc(cms->arena, sizeof (*sattrs));
+	if (!oid || !sattrs || generate_spc_content_info(cms, &cinfo) < 0 ||
+			generate_signed_attributes(cms, sattrs) < 0)
+		return -1;
+
+	job->owner = ctx;
+	job->cms = cms;
+	job->submitted = timing_now();
+
+	pthread_mutex_lock(&pool->lock);
+	ctx->parked++;
+	pthread_mutex_unlock(&pool->lock);
+
+	if (sign_queue_submit(cms->sign_queue, &job->signature, sattrs->data,
+			      sattrs->len, cms->signing_key, oid->offset,
+			      signing_done, job) < 0) {
+		pthread_mutex_lock(&pool->lock);
+		ctx->parked--;
+		pthread_mutex_unlock(&pool->lock);
+		return -1;
+	}
+
+	cms->raw_signed_attrs = sattrs;
+	job->req->parked = 1;
+	ctx->cms = NULL;
+	return 0;
+}
+
+static void
+send_token_busy(context *ctx, daemon_request *req)
+{
+	static const char msg[] = "token busy, try again later";
+
+	ctx->cms->log(ctx->cms, ctx->priority|LOG_NOTICE, "%s", msg);
+	if (ctx->stats)
+		stat_add(&ctx->stats->token_busy, 1);
+	send_response_data(ctx, ctx->cms, req, PESIGND_BUSY, msg,
+			   sizeof (msg));
+}
+
+/* Clean up after signing a binary, one way or the other, and answer. */
+static void
+complete_signing(context *ctx, signing *job, int rc)
+{
+	daemon_request *req = job->req;
+
+	end_signing(job, rc);
+	record_key(ctx, ctx->cms->tokenname, ctx->cms->certname,
+		   timing_now() - job->start, rc);
+
+	close(job->infd);
+	close(job->outfd);
+	free(job);
+
+	if (rc == PESIGND_BUSY)
+		send_token_busy(ctx, req);
+	else
+		send_response(ctx, ctx->cms, req, rc);
+	timing_log(ctx->cms, ctx->priority|LOG_INFO);
+	teardown_digests(ctx->cms);
+}
+
+/* The token has given a parked request back; finish it. */
+static void
+resume_signing(context *ctx, signing *job)
+{
+	daemon_request *req = job->req;
+	cms_context *cms = job->cms;
+	int rc = -1;
+
+	ctx->cms = cms;
+	uint64_t sign_ns = timing_now() - job->submitted;
+	record_phase(ctx, STATS_SIGN, sign_ns);
+	timing_add(cms, TIMING_SIGN_BLOB, sign_ns);
+
+	if (job->status != SECSuccess) {
+		cms->log(cms, ctx->priority|LOG_ERR, "error signing data: %s",
+			PORT_ErrorToString(job->error));
+		forget_signer(ctx);
+	} else {
+		cms->raw_signature = SECITEM_AllocItem(cms->arena, NULL,
+						       job->signature.len);
+		if (cms->raw_signature) {
+			memcpy(cms->raw_signature->data, job->signature.data,
+			       job->signature.len);
+			rc = generate_signature(cms);
+		}
+		if (rc >= 0)
+			rc = finish_signing(ctx, job);
+	}
+	PORT_Free(job->signature.data);
+
+	complete_signing(ctx, job, rc);
+	if (req->rc != PESIGND_BUSY)
+		stats_record(&ctx->stats->commands[req->command],
+			     timing_now() - req->started,
+			     req->hung_up || req->rc < 0);
+	put_request_cms(ctx);
+}
 
-	n = recvmsg(pollfd->fd, &msg, MSG_WAITALL);
+static void
+handle_signing(context *ctx, daemon_request *req, char *buffer,
+	       socklen_t size, int attached)
+{
+	ssize_t n = size;
 
 	pesignd_string *tn = (pesignd_string *)buffer;
 	if (n < (long long)sizeof(tn->size)) {
@@ -486,7 +1657,7 @@ malformed:
 			"handle_signing: invalid data");
 		ctx->cms->log(ctx->cms, ctx->priority|LOG_ERR,
 			"possible exploit attempt. closing.");
-		close(pollfd->fd);
+		hang_up(req);
 		return;
 	}
 
@@ -517,111 +1688,473 @@ malformed:
 	if (n != 0)
 		goto malformed;
 
-	int infd=-1;
-	socket_get_fd(ctx, pollfd->fd, &infd);
+	signing *job = calloc(1, sizeof (*job));
+	if (!job)
+		goto oom;
+	job->req = req;
+	job->attached = attached;
+	job->infd = job->outfd = -1;
 
-	int outfd=-1;
-	socket_get_fd(ctx, pollfd->fd, &outfd);
+	socket_get_fd(ctx, req, &job->infd);
+	if (!req->hung_up)
+		socket_get_fd(ctx, req, &job->outfd);
 
 	ctx->cms->log(ctx->cms, ctx->priority|LOG_NOTICE,
 		"attempting to sign with key \"%s:%s\"",
 		tn->value, cn->value);
-	free(buffer);
-
-	int rc = find_certificate(ctx->cms, 1);
-	if (rc < 0) {
-		goto finish;
-	}
 
-	rc = set_up_inpe(ctx, infd, &inpe);
-	if (rc < 0)
-		goto finish;
+	job->start = timing_now();
+	int rc = begin_signing(ctx, job, req->proto >= 2);
+	if (rc >= 0 && park_signing(ctx, job) >= 0)
+		return;
+	if (rc >= 0)
+		rc = sign_blob(ctx);
+	if (rc >= 0)
+		rc = finish_signing(ctx, job);
+	complete_signing(ctx, job, rc);
+	return;
+oom:
+	ctx->cms->log(ctx->cms, ctx->priority|LOG_ERR,
+		"unable to allocate memory: %m");
+	exit(1);
+}
 
-	rc = 0;
-	if (attached) {
-		Pe *outpe = NULL;
-		rc = set_up_outpe(ctx, outfd, inpe, &outpe);
-		if (rc < 0)
-			goto finish;
+static void
+handle_sign_attached(context *ctx, daemon_request *req, char *buffer,
+		     socklen_t size)
+{
+	int rc = get_request_cms(ctx);
+	if (rc < 0) {
+		send_response(ctx, ctx->backup_cms, req, rc);
+		return;
+	}
 
-		rc = generate_digest(ctx->cms, outpe, 1);
-		if (rc < 0) {
-err_attached:
-			pe_end(outpe);
-			ftruncate(outfd, 0);
-			goto finish;
-		}
-		ssize_t sigspace = calculate_signature_space(ctx->cms, outpe);
-		if (sigspace < 0)
-			goto err_attached;
-		allocate_signature_space(outpe, sigspace);
-		rc = generate_digest(ctx->cms, outpe, 1);
-		if (rc < 0)
-			goto err_attached;
-		rc = generate_signature(ctx->cms);
-		if (rc < 0)
-			goto err_attached;
-		insert_signature(ctx->cms, ctx->cms->num_signatures);
-		finalize_signatures(ctx->cms->signatures,
-				ctx->cms->num_signatures, outpe);
-		pe_end(outpe);
-	} else {
-		ftruncate(outfd, 0);
-		rc = generate_digest(ctx->cms, inpe, 1);
-		if (rc < 0) {
-err_detached:
-			ftruncate(outfd, 0);
-			goto finish;
-		}
-		rc = generate_signature(ctx->cms);
-		if (rc < 0)
-			goto err_detached;
-		rc = export_signature(ctx->cms, outfd, 0);
-		if (rc >= 0)
-			ftruncate(outfd, rc);
-		else if (rc < 0)
-			goto err_detached;
+	handle_signing(ctx, req, buffer, size, 1);
+
+	if (!req->parked)
+		put_request_cms(ctx);
+}
+
+static void
+handle_sign_detached(context *ctx, daemon_request *req, char *buffer,
+		     socklen_t size)
+{
+	int rc = get_request_cms(ctx);
+	if (rc < 0) {
+		send_response(ctx, ctx->backup_cms, req, rc);
+		return;
 	}
 
-finish:
-	if (inpe)
-		pe_end(inpe);
+	handle_signing(ctx, req, buffer, size, 0);
 
-	close(infd);
-	close(outfd);
+	if (!req->parked)
+		put_request_cms(ctx);
+}
 
-	send_response(ctx, ctx->cms, pollfd, rc);
-	teardown_digests(ctx->cms);
+/*
+ * Take the next pesignd_string off the front of a request payload, making
+ * sure it's all there, and if it's text, that it's NUL terminated.
+ */
+static pesignd_string *
+take_string(char **buffer, ssize_t *n, int text)
+{
+	pesignd_string *str = (pesignd_string *)*buffer;
+
+	if ((size_t)*n < sizeof(str->size))
+		return NULL;
+	*n -= sizeof(str->size);
+	if ((size_t)*n < str->size)
+		return NULL;
+	*n -= str->size;
+
+	if (text && (str->size == 0 || str->value[str->size - 1] != '\0'))
+		return NULL;
+
+	*buffer = (char *)pesignd_string_next(str);
+	return str;
 }
 
+/*
+ * Sign a digest the client computed itself.  We never see the binary, so
+ * how long this takes doesn't depend on how big it is.
+ */
 static void
-handle_sign_attached(context *ctx, struct pollfd *pollfd, socklen_t size)
+handle_sign_digest(context *ctx, daemon_request *req, char *buffer,
+		   socklen_t size)
 {
-	int rc = cms_context_alloc(&ctx->cms);
+	ssize_t n = size;
+	pesignd_string *tn, *cn, *dn, *dv;
+
+	int rc = get_request_cms(ctx);
+	if (rc < 0) {
+		send_response(ctx, ctx->backup_cms, req, rc);
+		return;
+	}
+
+	if (!(tn = take_string(&buffer, &n, 1)) ||
+			!(cn = take_string(&buffer, &n, 1)) ||
+			!(dn = take_string(&buffer, &n, 1)) ||
+			!(dv = take_string(&buffer, &n, 0)) ||
+			n != 0) {
+		ctx->cms->log(ctx->cms, ctx->priority|LOG_ERR,
+			"sign-digest: invalid data");
+		ctx->cms->log(ctx->cms, ctx->priority|LOG_ERR,
+			"possible exploit attempt. closing.");
+		hang_up(req);
+		goto out;
+	}
+
+	/* authenticating with nss frees these ... best API ever. */
+	ctx->cms->tokenname = PORT_ArenaStrdup(ctx->cms->arena,
+						(char *)tn->value);
+	ctx->cms->certname = PORT_ArenaStrdup(ctx->cms->arena,
+						(char *)cn->value);
+	if (!ctx->cms->tokenname || !ctx->cms->certname) {
+		ctx->cms->log(ctx->cms, ctx->priority|LOG_ERR,
+			"unable to allocate memory: %m");
+		exit(1);
+	}
+
+	ctx->cms->log(ctx->cms, ctx->priority|LOG_NOTICE,
+		"attempting to sign %s digest with key \"%s:%s\"",
+		dn->value, tn->value, cn->value);
+
+	if (!strcmp((char *)dn->value, "help") ||
+			set_digest_parameters(ctx->cms, (char *)dn->value) < 0) {
+		ctx->cms->log(ctx->cms, ctx->priority|LOG_ERR,
+			"sign-digest: unknown digest \"%s\"", dn->value);
+		rc = -1;
+		goto finish;
+	}
+
+	uint64_t start = timing_now();
+	rc = set_pe_digest(ctx->cms, dv->value, dv->size);
+	if (rc >= 0)
+		rc = find_signer(ctx);
+	if (rc >= 0 && token_busy(ctx->cms))
+		rc = PESIGND_BUSY;
+	if (rc >= 0)
+		rc = sign_blob(ctx);
+	record_key(ctx, (char *)tn->value, (char *)cn->value,
+		   timing_now() - start, rc);
+	if (rc == PESIGND_BUSY) {
+		send_token_busy(ctx, req);
+		goto done;
+	}
 	if (rc < 0)
+		goto finish;
+
+	send_response_data(ctx, ctx->cms, req, 0, ctx->cms->newsig.data,
+			   ctx->cms->newsig.len);
+	goto done;
+finish:
+	send_response(ctx, ctx->cms, req, rc);
+done:
+	timing_log(ctx->cms, ctx->priority|LOG_INFO);
+	teardown_digests(ctx->cms);
+out:
+	put_request_cms(ctx);
+}
+
+/*
+ * Sign one entry of a batch, with a cms_context of its own, and keep
+ * the result and any error message for the response.
+ */
+static void
+sign_batch_entry(context *ctx, batch_entry *entry)
+{
+	int rc = get_request_cms(ctx);
+	if (rc < 0) {
+		entry->rc = rc;
 		return;
+	}
 
-	steal_from_cms(ctx->backup_cms, ctx->cms);
+	ctx->cms->tokenname = PORT_ArenaStrdup(ctx->cms->arena,
+						entry->tokenname);
+	ctx->cms->certname = PORT_ArenaStrdup(ctx->cms->arena,
+						entry->certname);
+	if (!ctx->cms->tokenname || !ctx->cms->certname) {
+		ctx->cms->log(ctx->cms, ctx->priority|LOG_ERR,
+			"unable to allocate memory: %m");
+		exit(1);
+	}
 
-	handle_signing(ctx, pollfd, size, 1);
+	ctx->cms->log(ctx->cms, ctx->priority|LOG_NOTICE,
+		"attempting to sign with key \"%s:%s\"",
+		entry->tokenname, entry->certname);
 
-	hide_stolen_goods_from_cms(ctx->cms, ctx->backup_cms);
-	cms_context_fini(ctx->cms);
+	/* just the one digest the client asked for */
+	ctx->cms->digest_set = 0;
+	if (!strcmp(entry->digestname, "help") ||
+			set_digest_parameters(ctx->cms, entry->digestname) < 0) {
+		ctx->cms->log(ctx->cms, ctx->priority|LOG_ERR,
+			"sign-batch: unknown digest \"%s\"",
+			entry->digestname);
+		entry->rc = -1;
+		entry->errmsg = strdup("unknown digest");
+		goto out;
+	}
+
+	uint64_t start = timing_now();
+	if (entry->digest) {
+		entry->rc = set_pe_digest(ctx->cms, entry->digest->value,
+					  entry->digest->size);
+		if (entry->rc >= 0)
+			entry->rc = find_signer(ctx);
+		if (entry->rc >= 0)
+			entry->rc = sign_blob(ctx);
+		if (entry->rc >= 0) {
+			entry->siglen = ctx->cms->newsig.len;
+			entry->sig = malloc(entry->siglen);
+			if (!entry->sig) {
+				ctx->cms->log(ctx->cms, ctx->priority|LOG_ERR,
+					"unable to allocate memory: %m");
+				exit(1);
+			}
+			memcpy(entry->sig, ctx->cms->newsig.data,
+			       entry->siglen);
+		}
+	} else {
+		entry->rc = sign_files(ctx, entry->infd, entry->outfd,
+				       entry->attached);
+	}
+	record_key(ctx, entry->tokenname, entry->certname,
+		   timing_now() - start, entry->rc);
+	if (entry->rc < 0 && ctx->errstr)
+		entry->errmsg = strdup(ctx->errstr);
+out:
+	if (entry->infd >= 0)
+		close(entry->infd);
+	if (entry->outfd >= 0)
+		close(entry->outfd);
+	entry->infd = entry->outfd = -1;
+
+	timing_log(ctx->cms, ctx->priority|LOG_INFO);
+	teardown_digests(ctx->cms);
+	put_request_cms(ctx);
 }
 
 static void
-handle_sign_detached(context *ctx, struct pollfd *pollfd, socklen_t size)
+run_batch(context *ctx, sign_batch *batch)
 {
-	int rc = cms_context_alloc(&ctx->cms);
-	if (rc < 0)
+	daemon_pool *pool = ctx->pool;
+
+	pthread_mutex_lock(&pool->lock);
+	while (batch->next < batch->count) {
+		batch_entry *entry = &batch->entries[batch->next++];
+		pthread_mutex_unlock(&pool->lock);
+
+		sign_batch_entry(ctx, entry);
+
+		pthread_mutex_lock(&pool->lock);
+	}
+	pthread_mutex_unlock(&pool->lock);
+}
+
+/*
+ * Queue up to n helpers for a batch, so workers that would otherwise sit
+ * idle can take some of its entries.  They don't count against
+ * max_in_flight; the batch already does.
+ */
+static void
+queue_batch_helpers(context *ctx, sign_batch *batch, int n)
+{
+	daemon_pool *pool = ctx->pool;
+
+	pthread_mutex_lock(&pool->lock);
+	for (int i = 0; i < n; i++) {
+		daemon_request *helper = calloc(1, sizeof (*helper));
+		if (!helper)
+			break;
+		helper->command = CMD_SIGN_BATCH;
+		helper->batch = batch;
+		enqueue_request(pool, batch->queue, helper);
+	}
+	pthread_cond_broadcast(&pool->work);
+	pthread_mutex_unlock(&pool->lock);
+}
+
+/*
+ * Wait for the helpers that are working on a batch, and take back any
+ * that haven't started; by now there's nothing left for them to do, and
+ * waiting for a free worker to run them could deadlock.
+ */
+static void
+finish_batch(context *ctx, sign_batch *batch)
+{
+	daemon_pool *pool = ctx->pool;
+	uid_queue *queue = batch->queue;
+	daemon_request **reqp, *helpers = NULL;
+
+	pthread_mutex_lock(&pool->lock);
+	queue->tail = NULL;
+	for (reqp = &queue->head; *reqp; ) {
+		daemon_request *req = *reqp;
+		if (req->batch == batch) {
+			*reqp = req->next;
+			req->next = helpers;
+			helpers = req;
+			pool->waiting--;
+			continue;
+		}
+		queue->tail = req;
+		reqp = &req->next;
+	}
+	while (batch->running)
+		pthread_cond_wait(&batch->idle, &pool->lock);
+	pthread_mutex_unlock(&pool->lock);
+
+	while (helpers) {
+		daemon_request *req = helpers;
+		helpers = req->next;
+		free(req);
+	}
+}
+
+/*
+ * Sign a list of binaries in one request, handing them out to whichever
+ * workers are free, and answer with a result for each one.
+ */
+static void
+handle_sign_batch(context *ctx, daemon_request *req, char *buffer,
+		  socklen_t size)
+{
+	cms_context *cms = ctx->backup_cms;
+	ssize_t n = size;
+	uint32_t count;
+	sign_batch batch;
+
+	memset(&batch, '\0', sizeof (batch));
+
+	if (req->proto < 2 || (size_t)n < sizeof (count)) {
+malformed:
+		cms->log(cms, ctx->priority|LOG_ERR,
+			"sign-batch: invalid data");
+		cms->log(cms, ctx->priority|LOG_ERR,
+			"possible exploit attempt. closing.");
+		hang_up(req);
+		xfree(batch.entries);
 		return;
+	}
+	memcpy(&count, buffer, sizeof (count));
+	buffer += sizeof (count);
+	n -= sizeof (count);
 
-	steal_from_cms(ctx->backup_cms, ctx->cms);
+	if (count == 0 || count > PESIGND_MAX_BATCH)
+		goto malformed;
+
+	batch.entries = calloc(count, sizeof (*batch.entries));
+	if (!batch.entries) {
+		cms->log(cms, ctx->priority|LOG_ERR,
+			"unable to allocate memory: %m");
+		exit(1);
+	}
+	batch.count = count;
+
+	int nfds = 0;
+	for (uint32_t i = 0; i < count; i++) {
+		batch_entry *entry = &batch.entries[i];
+		pesignd_string *tn, *cn, *dn, *dv = NULL;
+		uint32_t flags;
+
+		if ((size_t)n < sizeof (flags))
+			goto malformed;
+		memcpy(&flags, buffer, sizeof (flags));
+		buffer += sizeof (flags);
+		n -= sizeof (flags);
+
+		if (!(tn = take_string(&buffer, &n, 1)) ||
+				!(cn = take_string(&buffer, &n, 1)) ||
+				!(dn = take_string(&buffer, &n, 1)))
+			goto malformed;
+		if ((flags & PESIGND_BATCH_DIGEST) &&
+				(!(dv = take_string(&buffer, &n, 0)) ||
+				 dv->size == 0))
+			goto malformed;
+
+		entry->attached = !!(flags & PESIGND_BATCH_ATTACHED);
+		entry->tokenname = (char *)tn->value;
+		entry->certname = (char *)cn->value;
+		entry->digestname = (char *)dn->value;
+		entry->digest = dv;
+		entry->infd = entry->outfd = -1;
+		if (!dv)
+			nfds += 2;
+	}
+	if (n != 0 || req->nfds != nfds)
+		goto malformed;
+
+	/* they're the entries' now */
+	for (uint32_t i = 0, fd = 0; i < count; i++) {
+		batch_entry *entry = &batch.entries[i];
+
+		if (entry->digest)
+			continue;
+		entry->infd = req->fds[fd];
+		entry->outfd = req->fds[fd + 1];
+		req->fds[fd] = req->fds[fd + 1] = -1;
+		fd += 2;
+	}
 
-	handle_signing(ctx, pollfd, size, 0);
+	cms->log(cms, ctx->priority|LOG_NOTICE,
+		"signing a batch of %u binaries", count);
+
+	pthread_cond_init(&batch.idle, NULL);
+	batch.queue = req->queue;
+	int helpers = ctx->pool->nworkers - 1;
+	if ((uint32_t)helpers > count - 1)
+		helpers = count - 1;
+	if (helpers > 0)
+		queue_batch_helpers(ctx, &batch, helpers);
+	run_batch(ctx, &batch);
+	finish_batch(ctx, &batch);
+	pthread_cond_destroy(&batch.idle);
+
+	size_t len = 0;
+	uint32_t failed = 0;
+	for (uint32_t i = 0; i < count; i++) {
+		batch_entry *entry = &batch.entries[i];
+		len += sizeof (entry->rc);
+		if (entry->sig)
+			len += sizeof (uint32_t) + entry->siglen;
+		else
+			len += pesignd_string_size(
+					entry->errmsg ? entry->errmsg : "");
+		if (entry->rc < 0)
+			failed++;
+	}
+
+	char *data = malloc(len);
+	if (!data) {
+		cms->log(cms, ctx->priority|LOG_ERR,
+			"unable to allocate memory: %m");
+		exit(1);
+	}
+
+	char *pos = data;
+	for (uint32_t i = 0; i < count; i++) {
+		batch_entry *entry = &batch.entries[i];
 
-	hide_stolen_goods_from_cms(ctx->cms, ctx->backup_cms);
-	cms_context_fini(ctx->cms);
+		memcpy(pos, &entry->rc, sizeof (entry->rc));
+		pos += sizeof (entry->rc);
+		pesignd_string *msg = (pesignd_string *)pos;
+		if (entry->sig) {
+			msg->size = entry->siglen;
+			memcpy(msg->value, entry->sig, entry->siglen);
+		} else {
+			pesignd_string_set(msg,
+				entry->errmsg ? entry->errmsg : "");
+		}
+		pos = (char *)pesignd_string_next(msg);
+		xfree(entry->errmsg);
+		xfree(entry->sig);
+	}
+
+	cms->log(cms, ctx->priority|LOG_NOTICE,
+		"signed %u of %u binaries", count - failed, count);
+	send_response_data(ctx, cms, req, failed ? -1 : 0, data, len);
+	free(data);
+	free(batch.entries);
 }
 
 static void
@@ -629,7 +2162,8 @@ static void
 __attribute__((noreturn))
 #endif
 handle_invalid_input(pesignd_cmd cmd, context *ctx,
-		     struct pollfd *pollfd __attribute__((__unused__)),
+		     daemon_request *req __attribute__((__unused__)),
+		     char *buffer __attribute__((__unused__)),
 		     socklen_t size __attribute__((__unused__)))
 {
 		ctx->backup_cms->log(ctx->backup_cms, ctx->priority|LOG_ERR,
@@ -638,8 +2172,8 @@ handle_invalid_input(pesignd_cmd cmd, context *ctx,
 			"possible exploit attempt");
 }
 
-typedef void (*cmd_handler)(context *ctx, struct pollfd *pollfd,
-				socklen_t size);
+typedef void (*cmd_handler)(context *ctx, daemon_request *req,
+				char *buffer, socklen_t size);
 
 typedef struct {
 	pesignd_cmd cmd;
@@ -658,244 +2192,1139 @@ cmd_table_t cmd_table[] = {
 			"is-token-unlocked", 0 },
 		{ CMD_GET_CMD_VERSION, handle_get_cmd_version,
 			"get-cmd-version", 0 },
+		{ CMD_SIGN_DIGEST, handle_sign_digest, "sign-digest", 0 },
+		{ CMD_NEGOTIATE, handle_negotiate, "negotiate", 1 },
+		{ CMD_SIGN_BATCH, handle_sign_batch, "sign-batch", 1 },
+		{ CMD_GET_STATS, handle_get_stats, "get-stats", 0 },
 		{ CMD_LIST_END, NULL, "list-end", 0 }
 	};
 
 static void
-handle_get_cmd_version(context *ctx, struct pollfd *pollfd, socklen_t size)
+handle_get_cmd_version(context *ctx, daemon_request *req, char *buffer,
+		       socklen_t size)
 {
-	struct msghdr msg;
-	struct iovec iov;
-	ssize_t n;
+	ssize_t n = size;
 
-	int rc = cms_context_alloc(&ctx->cms);
+	int rc = get_request_cms(ctx);
 	if (rc < 0) {
-		send_response(ctx, ctx->backup_cms, pollfd, rc);
+		send_response(ctx, ctx->backup_cms, req, rc);
 		return;
 	}
 
-	steal_from_cms(ctx->backup_cms, ctx->cms);
+	int32_t version = -1;
+	uint32_t command;
 
-	char *buffer = malloc(size);
-	if (!buffer) {
+	if (n < (long long)sizeof(command)) {
 		ctx->cms->log(ctx->cms, ctx->priority|LOG_ERR,
+			"unlock-token: invalid data");
+		ctx->cms->log(ctx->cms, ctx->priority|LOG_ERR,
+			"possible exploit attempt. closing.");
+		hang_up(req);
+		put_request_cms(ctx);
+		return;
+	}
+
+	memcpy(&command, buffer, sizeof (command));
+	ctx->cms->log(ctx->cms, ctx->priority|LOG_NOTICE,
+			"searching for command %d", command);
+
+	for (int i = 0; cmd_table[i].cmd != CMD_LIST_END; i++) {
+		if (cmd_table[i].cmd == command) {
+			ctx->cms->log(ctx->cms, ctx->priority|LOG_NOTICE,
+					"cmd-version: found command \"%s\" "
+					"version %d",
+					cmd_table[i].name,
+					cmd_table[i].version);
+			version = cmd_table[i].version;
+			break;
+		}
+	}
+
+	if (version == -1) {
+		ctx->cms->log(ctx->cms, ctx->priority|LOG_NOTICE,
+				"cmd-version: could not find command %d",
+				command);
+	}
+	send_response(ctx, ctx->cms, req, version);
+
+	put_request_cms(ctx);
+}
+
+/*
+ * Move a connection to a newer protocol, and tell the client how much
+ * we'll take on at once and every command we know and its version, so it
+ * doesn't have to ask about each one.  The response still uses the old
+ * protocol; what follows doesn't.
+ */
+static void
+handle_negotiate(context *ctx, daemon_request *req, char *buffer,
+		 socklen_t size)
+{
+	cms_context *cms = ctx->backup_cms;
+	uint32_t proto;
+
+	if (req->proto != 1 || size != sizeof(proto)) {
+		cms->log(cms, ctx->priority|LOG_ERR,
+			"negotiate: invalid data");
+		cms->log(cms, ctx->priority|LOG_ERR,
+			"possible exploit attempt. closing.");
+		hang_up(req);
+		return;
+	}
+
+	memcpy(&proto, buffer, sizeof(proto));
+	if (proto > PESIGND_PROTOCOL)
+		proto = PESIGND_PROTOCOL;
+
+	int ncmds = 0;
+	for (int i = 0; cmd_table[i].cmd != CMD_LIST_END; i++)
+		ncmds++;
+
+	pesignd_limits *limits = calloc(1, sizeof (*limits) +
+					   ncmds * sizeof (pesignd_cmd_version));
+	if (!limits) {
+		cms->log(cms, ctx->priority|LOG_ERR,
 			"unable to allocate memory: %m");
 		exit(1);
 	}
+	limits->workers = ctx->pool->nworkers;
+	limits->max_in_flight = ctx->pool->max_in_flight;
+
+	pesignd_cmd_version *cmds = (pesignd_cmd_version *)(limits + 1);
+	ncmds = 0;
+	for (int i = 0; cmd_table[i].cmd != CMD_LIST_END; i++) {
+		if (!cmd_table[i].func)
+			continue;
+		cmds[ncmds].command = cmd_table[i].cmd;
+		cmds[ncmds].version = cmd_table[i].version;
+		ncmds++;
+	}
+
+	cms->log(cms, ctx->priority|LOG_NOTICE,
+		"negotiated protocol version %d", proto);
+	send_response_data(ctx, cms, req, proto, limits,
+			   sizeof (*limits) + ncmds * sizeof (*cmds));
+	free(limits);
+
+	/* the dispatcher isn't reading while we have the connection */
+	if (proto >= 2)
+		req->conn->proto = proto;
+}
+
+typedef struct {
+	char *name;
+	pesignd_histogram hist;
+} stats_entry;
+
+static void
+add_stats_entry(context *ctx, stats_entry *entries, uint32_t *n,
+		char *name, pesignd_histogram *hist)
+{
+	uint32_t i;
+
+	for (i = 0; i < *n; i++) {
+		if (!strcmp(entries[i].name, name))
+			break;
+	}
+	if (i == *n) {
+		entries[i].name = strdup(name);
+		if (!entries[i].name) {
+			ctx->backup_cms->log(ctx->backup_cms,
+				ctx->priority|LOG_ERR,
+				"unable to allocate memory: %m");
+			exit(1);
+		}
+		memset(&entries[i].hist, '\0', sizeof (entries[i].hist));
+		*n += 1;
+	}
+	stats_merge(&entries[i].hist, hist);
+}
+
+/*
+ * Add up every worker's statistics and send them, with the dispatcher's,
+ * to the client.
+ */
+static void
+handle_get_stats(context *ctx, daemon_request *req,
+		 char *buffer __attribute__((__unused__)),
+		 socklen_t size)
+{
+	cms_context *cms = ctx->backup_cms;
+	daemon_pool *pool = ctx->pool;
+	pesignd_stats summary;
+
+	if (size != 0) {
+		cms->log(cms, ctx->priority|LOG_ERR,
+			"get-stats: invalid data");
+		cms->log(cms, ctx->priority|LOG_ERR,
+			"possible exploit attempt. closing.");
+		hang_up(req);
+		return;
+	}
+
+	memset(&summary, '\0', sizeof (summary));
+	summary.uptime = (timing_now() - pool->started) / 1000000000ull;
+	summary.workers = pool->nworkers;
+	summary.connections = stat_read(&pool->connections);
+	summary.accepted = stat_read(&pool->accepted);
+	summary.bad_requests = stat_read(&pool->bad_requests);
+	summary.rejected = stat_read(&pool->rejected);
+
+	struct mallinfo2 mi = mallinfo2();
+	summary.heap_in_use = mi.uordblks + mi.hblkhd;
+	pthread_mutex_lock(&pool->lock);
+	summary.queued = pool->queued;
+	summary.in_flight = pool->in_flight;
+	pthread_mutex_unlock(&pool->lock);
+
+	uint32_t ncommands = 0, nphases = 0, nkeys = 0;
+	stats_entry commands[CMD_LIST_END];
+	stats_entry phases[N_STATS_PHASES];
+	stats_entry *keys = calloc(pool->nworkers * STATS_KEYS + 1,
+				   sizeof (*keys));
+	if (!keys) {
+		cms->log(cms, ctx->priority|LOG_ERR,
+			"unable to allocate memory: %m");
+		exit(1);
+	}
+
+	for (int w = 0; w < pool->nworkers; w++) {
+		worker_stats *stats = &pool->workers[w].stats;
+
+		summary.bytes_hashed += stat_read(&stats->bytes_hashed);
+		summary.expired += stat_read(&stats->expired);
+		summary.token_busy += stat_read(&stats->token_busy);
+		summary.contexts_created +=
+			stat_read(&stats->contexts_created);
+		summary.contexts_reused += stat_read(&stats->contexts_reused);
+
+		for (int i = 0; cmd_table[i].cmd != CMD_LIST_END; i++) {
+			if (cmd_table[i].func)
+				add_stats_entry(ctx, commands, &ncommands,
+					cmd_table[i].name,
+					&stats->commands[cmd_table[i].cmd]);
+		}
+		for (int i = 0; i < N_STATS_PHASES; i++)
+			add_stats_entry(ctx, phases, &nphases,
+				(char *)stats_phase_names[i],
+				&stats->phases[i]);
+
+		uint32_t n = __atomic_load_n(&stats->nkeys, __ATOMIC_ACQUIRE);
+		for (uint32_t i = 0; i < n; i++) {
+			key_stats *key = &stats->keys[i];
+			char *name = NULL;
+
+			if (asprintf(&name, "%s:%s", key->tokenname,
+				     key->certname) < 0) {
+				cms->log(cms, ctx->priority|LOG_ERR,
+					"unable to allocate memory: %m");
+				exit(1);
+			}
+			add_stats_entry(ctx, keys, &nkeys, name, &key->hist);
+			free(name);
+		}
+		if (stat_read(&stats->other_keys.count))
+			add_stats_entry(ctx, keys, &nkeys, "(other)",
+					&stats->other_keys);
+	}
+
+	summary.ncommands = ncommands;
+	summary.nphases = nphases;
+	summary.nkeys = nkeys;
+
+	size_t len = sizeof (summary);
+	stats_entry *lists[] = { commands, phases, keys };
+	uint32_t counts[] = { ncommands, nphases, nkeys };
+	for (int l = 0; l < 3; l++) {
+		for (uint32_t i = 0; i < counts[l]; i++)
+			len += sizeof (pesignd_histogram) +
+				pesignd_string_size(lists[l][i].name);
+	}
+
+	char *data = malloc(len);
+	if (!data) {
+		cms->log(cms, ctx->priority|LOG_ERR,
+			"unable to allocate memory: %m");
+		exit(1);
+	}
+
+	char *pos = data;
+	memcpy(pos, &summary, sizeof (summary));
+	pos += sizeof (summary);
+	for (int l = 0; l < 3; l++) {
+		for (uint32_t i = 0; i < counts[l]; i++) {
+			stats_entry *entry = &lists[l][i];
+
+			memcpy(pos, &entry->hist, sizeof (entry->hist));
+			pos += sizeof (entry->hist);
+			pesignd_string *name = (pesignd_string *)pos;
+			pesignd_string_set(name, entry->name);
+			pos = (char *)pesignd_string_next(name);
+			free(entry->name);
+		}
+	}
+	free(keys);
+
+	send_response_data(ctx, cms, req, 0, data, len);
+	free(data);
+}
+
+/*
+ * Decide whether a request header we've just finished reading is one we
+ * should go on to read the payload of.
+ */
+static int
+check_request(context *ctx, connection *conn)
+{
+	pesignd_msghdr_v2 *pm = &conn->hdr;
+	uint32_t version = conn->proto >= 2 ? PESIGND_VERSION_2
+					    : PESIGND_VERSION;
+
+	if (pm->version != version) {
+		ctx->backup_cms->log(ctx->backup_cms, ctx->priority|LOG_ERR,
+			"got version %d, expected version %d",
+			pm->version, version);
+		ctx->backup_cms->log(ctx->backup_cms, ctx->priority|LOG_ERR,
+			"possible exploit attempt.  closing.");
+		return -1;
+	}
+
+	int i;
+	for (i = 0; cmd_table[i].cmd != CMD_LIST_END; i++) {
+		if (cmd_table[i].cmd == pm->command)
+			break;
+	}
+	if (cmd_table[i].func == NULL) {
+		handle_invalid_input(pm->command, ctx, NULL, NULL, pm->size);
+		return -1;
+	}
+
+	if (pm->size > MAX_REQUEST_SIZE) {
+		ctx->backup_cms->log(ctx->backup_cms, ctx->priority|LOG_ERR,
+			"got message with invalid size %u", pm->size);
+		ctx->backup_cms->log(ctx->backup_cms, ctx->priority|LOG_ERR,
+			"possible exploit attempt.  closing.");
+		return -1;
+	}
+
+	conn->payload = malloc(pm->size ? pm->size : 1);
+	if (!conn->payload) {
+		ctx->backup_cms->log(ctx->backup_cms, ctx->priority|LOG_ERR,
+			"could not allocate memory: %m");
+		exit(1);
+	}
+	return 0;
+}
+
+/*
+ * Keep any file descriptors that arrived with the data we just read.
+ * Only protocol 2 requests carry them; anywhere else they're an error.
+ */
+static int
+take_fds(context *ctx, connection *conn, struct msghdr *msg)
+{
+	int rc = 0;
+
+	if (msg->msg_flags & MSG_CTRUNC)
+		rc = -1;
+
+	for (struct cmsghdr *cm = CMSG_FIRSTHDR(msg); cm;
+			cm = CMSG_NXTHDR(msg, cm)) {
+		if (cm->cmsg_level != SOL_SOCKET ||
+				cm->cmsg_type != SCM_RIGHTS)
+			continue;
+
+		int *fds = (int *)CMSG_DATA(cm);
+		int nfds = (cm->cmsg_len - CMSG_LEN(0)) / sizeof (int);
+		for (int i = 0; i < nfds; i++) {
+			if (conn->proto < 2 || conn->nfds == MAX_REQUEST_FDS) {
+				close(fds[i]);
+				rc = -1;
+				continue;
+			}
+			conn->fds[conn->nfds++] = fds[i];
+		}
+	}
+
+	if (rc < 0) {
+		ctx->backup_cms->log(ctx->backup_cms, ctx->priority|LOG_ERR,
+			"got unexpected file descriptors");
+		ctx->backup_cms->log(ctx->backup_cms, ctx->priority|LOG_ERR,
+			"possible exploit attempt.  closing.");
+	}
+	return rc;
+}
+
+/*
+ * Read as much of the next request on a connection as the socket has
+ * without blocking.  Returns 1 once the whole request is here, 0 if we
+ * have to wait for more, and -1 if the connection should be closed.
+ * Nothing past the end of the request is read, so file descriptors a
+ * protocol 1 client sends after it are still there for the worker.
+ */
+static int
+read_request(context *ctx, connection *conn)
+{
+	size_t hdrsize = conn->proto >= 2 ? sizeof (pesignd_msghdr_v2)
+					  : sizeof (pesignd_msghdr);
+	char control[CMSG_SPACE(sizeof (int) * MAX_REQUEST_FDS)];
+	struct msghdr msg;
+	struct iovec iov;
+	size_t *pos;
+	ssize_t n;
+
+	while (1) {
+		if (conn->hdrlen < hdrsize) {
+			iov.iov_base = (char *)&conn->hdr + conn->hdrlen;
+			iov.iov_len = hdrsize - conn->hdrlen;
+			pos = &conn->hdrlen;
+		} else {
+			if (!conn->payload && check_request(ctx, conn) < 0)
+				goto bad;
+			if (conn->paylen == conn->hdr.size)
+				return 1;
+			iov.iov_base = conn->payload + conn->paylen;
+			iov.iov_len = conn->hdr.size - conn->paylen;
+			pos = &conn->paylen;
+		}
+
+		memset(&msg, '\0', sizeof(msg));
+		msg.msg_iov = &iov;
+		msg.msg_iovlen = 1;
+		msg.msg_control = control;
+		msg.msg_controllen = sizeof (control);
+
+		n = recvmsg(conn->fd, &msg, MSG_DONTWAIT|MSG_CMSG_CLOEXEC);
+		if (n > 0 && msg.msg_controllen && take_fds(ctx, conn, &msg) < 0)
+			goto bad;
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				return 0;
+			ctx->backup_cms->log(ctx->backup_cms,
+				ctx->priority|LOG_WARNING,
+				"recvmsg failed: %m");
+			return -1;
+		}
+
+		/* if recv returned 0, we're not going to get any valid data. */
+		/* This *probably* means we were hung up on. */
+		if (n == 0) {
+			if (conn->hdrlen == 0)
+				return -1;
+			ctx->backup_cms->log(ctx->backup_cms,
+				ctx->priority|LOG_ERR,
+				"got message with invalid size %zu",
+				conn->hdrlen + conn->paylen);
+			ctx->backup_cms->log(ctx->backup_cms,
+				ctx->priority|LOG_ERR,
+				"possible exploit attempt.  closing.");
+			goto bad;
+		}
+		if (conn->hdrlen == 0)
+			conn->started = timing_now();
+		*pos += n;
+	}
+bad:
+	stat_add(&ctx->pool->bad_requests, 1);
+	return -1;
+}
+
+static void
+run_request(context *ctx, daemon_request *req)
+{
+	if (req->batch) {
+		run_batch(ctx, req->batch);
+		return;
+	}
+
+	record_phase(ctx, STATS_RECEIVE, req->receive_ns);
+	record_phase(ctx, STATS_QUEUE, timing_now() - req->queued_at);
+
+	/* protocol 1 clients don't know to try again */
+	uint64_t start = timing_now();
+	req->started = start;
+	if (req->proto >= 2 && ctx->pool->queue_timeout &&
+			is_signing_command(req->command) &&
+			start - req->queued_at > ctx->pool->queue_timeout) {
+		static const char msg[] =
+			"request timed out waiting for a worker";
+
+		ctx->backup_cms->log(ctx->backup_cms,
+			ctx->priority|LOG_NOTICE, "%s", msg);
+		send_response_data(ctx, ctx->backup_cms, req, PESIGND_BUSY,
+				   msg, sizeof (msg));
+		stat_add(&ctx->stats->expired, 1);
+	} else {
+		for (int i = 0; cmd_table[i].cmd != CMD_LIST_END; i++) {
+			if (cmd_table[i].cmd == req->command) {
+				cmd_table[i].func(ctx, req, req->payload,
+						  req->size);
+				break;
+			}
+		}
+	}
+	/* being turned away is counted as that, not as a failure */
+	if (!req->parked && req->rc != PESIGND_BUSY)
+		stats_record(&ctx->stats->commands[req->command],
+			     timing_now() - start, req->hung_up || req->rc < 0);
+}
+
+static void
+free_request(daemon_request *req)
+{
+	for (int i = 0; i < req->nfds; i++) {
+		if (req->fds[i] >= 0)
+			close(req->fds[i]);
+	}
+	xfree(req->payload);
+	free(req);
+}
+
+static void
+wake_dispatcher(daemon_pool *pool)
+{
+	char c = 0;
+
+	while (write(pool->wake[1], &c, 1) < 0 && errno == EINTR)
+		;
+}
+
+/*
+ * Worker threads run one request at a time, each with its own context
+ * (and so its own cms_context and error string), and hand the request
+ * back to the dispatcher when they're done with it.
+ */
+/* Give a request back to the dispatcher.  Called with pool->lock held. */
+static void
+request_done(daemon_pool *pool, daemon_request *req)
+{
+	if (!req->answered) {
+		pool->in_flight--;
+		req->queue->in_flight--;
+	}
+	req->answered = 0;
+	put_queue(pool, req->queue);
+	req->queue = NULL;
+	req->next = pool->done;
+	pool->done = req;
+	wake_dispatcher(pool);
+}
+
+static void *
+daemon_worker(void *arg)
+{
+	context *ctx = arg;
+	daemon_pool *pool = ctx->pool;
+
+	pthread_mutex_lock(&pool->lock);
+	while (1) {
+		daemon_request *req = NULL;
+		signing *job = ctx->finished;
+
+		if (job) {
+			ctx->finished = job->next;
+			ctx->parked--;
+			req = job->req;
+			pthread_mutex_unlock(&pool->lock);
+
+			resume_signing(ctx, job);
+
+			pthread_mutex_lock(&pool->lock);
+			request_done(pool, req);
+			continue;
+		}
+
+		/* don't leave the token with more than we can finish */
+		if (ctx->parked < MAX_PARKED)
+			req = dequeue_request(pool);
+		if (!req) {
+			if (pool->stopping && !ctx->parked)
+				break;
+			pthread_cond_wait(&pool->work, &pool->lock);
+			continue;
+		}
+
+		if (req->batch)
+			req->batch->running++;
+		pthread_mutex_unlock(&pool->lock);
+
+		run_request(ctx, req);
+
+		pthread_mutex_lock(&pool->lock);
+		if (req->batch) {
+			if (--req->batch->running == 0)
+				pthread_cond_signal(&req->batch->idle);
+			free(req);
+			continue;
+		}
+		if (!req->parked)
+			request_done(pool, req);
+	}
+	pthread_mutex_unlock(&pool->lock);
+	return NULL;
+}
+
+static int
+start_workers(context *ctx, daemon_pool *pool)
+{
+	cms_context *cms = ctx->backup_cms;
+
+	pool->workers = calloc(pool->nworkers, sizeof (*pool->workers));
+	if (!pool->workers)
+		return -1;
+
+	for (int i = 0; i < pool->nworkers; i++) {
+		context *wctx = &pool->workers[i].ctx;
+
+		memcpy(wctx, ctx, sizeof (*wctx));
+		wctx->errstr = NULL;
+		wctx->cms = NULL;
+		wctx->nspare = 0;
+		wctx->is_worker = 1;
+		wctx->stats = &pool->workers[i].stats;
+
+		int rc = cms_context_alloc(&wctx->backup_cms);
+		if (rc < 0)
+			return -1;
+		wctx->backup_cms->func = cms->func;
+		wctx->backup_cms->pwdata = cms->pwdata;
+		wctx->backup_cms->selected_digest = cms->selected_digest;
+		wctx->backup_cms->digest_set = cms->digest_set;
+		wctx->backup_cms->log = cms->log;
+		wctx->backup_cms->log_priv = wctx;
+		if (cms->timing && timing_enable(wctx->backup_cms) < 0)
+			return -1;
+
+		rc = pthread_create(&pool->workers[i].thread, NULL,
+				    daemon_worker, wctx);
+		if (rc != 0) {
+			errno = rc;
+			return -1;
+		}
+		pool->workers[i].running = 1;
+	}
+	return 0;
+}
+
+static void
+stop_workers(daemon_pool *pool)
+{
+	pthread_mutex_lock(&pool->lock);
+	pool->stopping = 1;
+	pthread_cond_broadcast(&pool->work);
+	pthread_mutex_unlock(&pool->lock);
+
+	for (int i = 0; i < pool->nworkers; i++) {
+		context *wctx = &pool->workers[i].ctx;
+
+		if (pool->workers[i].running)
+			pthread_join(pool->workers[i].thread, NULL);
+		if (wctx->backup_cms)
+			cms_context_fini(wctx->backup_cms);
+		while (wctx->nspare)
+			cms_context_fini(wctx->spare_cms[--wctx->nspare]);
+		xfree(wctx->errstr);
+
+		worker_stats *stats = &pool->workers[i].stats;
+		for (uint32_t j = 0; j < stats->nkeys; j++) {
+			xfree(stats->keys[j].tokenname);
+			xfree(stats->keys[j].certname);
+		}
+	}
+	xfree(pool->workers);
+}
+
+static int
+watch_fd(daemon_pool *pool, int fd, void *data)
+{
+	struct epoll_event ev = {
+		.events = EPOLLIN|EPOLLRDHUP|EPOLLET,
+		.data.ptr = data,
+	};
+
+	return epoll_ctl(pool->epfd, EPOLL_CTL_ADD, fd, &ev);
+}
+
+static void
+add_connection(context *ctx, int fd)
+{
+	daemon_pool *pool = ctx->pool;
+	struct ucred cred;
+	socklen_t credlen = sizeof (cred);
+
+	if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &credlen) < 0) {
+		ctx->backup_cms->log(ctx->backup_cms, ctx->priority|LOG_WARNING,
+			"could not get peer credentials: %m");
+		close(fd);
+		return;
+	}
 
-	memset(&msg, '\0', sizeof(msg));
+	connection *conn = calloc(1, sizeof (*conn));
+	if (!conn) {
+		ctx->backup_cms->log(ctx->backup_cms, ctx->priority|LOG_ERR,
+			"could not allocate memory: %m");
+		exit(1);
+	}
+	conn->fd = fd;
+	conn->uid = cred.uid;
+	conn->proto = 1;
+	pthread_mutex_init(&conn->write_lock, NULL);
 
-	iov.iov_base = buffer;
-	iov.iov_len = size;
-	msg.msg_iov = &iov;
-	msg.msg_iovlen = 1;
+	if (watch_fd(pool, fd, conn) < 0) {
+		ctx->backup_cms->log(ctx->backup_cms, ctx->priority|LOG_WARNING,
+			"epoll_ctl: %m");
+		pthread_mutex_destroy(&conn->write_lock);
+		close(fd);
+		free(conn);
+		return;
+	}
 
-	n = recvmsg(pollfd->fd, &msg, MSG_WAITALL);
+	conn->next_conn = pool->conns;
+	if (pool->conns)
+		pool->conns->prev_conn = conn;
+	pool->conns = conn;
+	stat_add(&pool->connections, 1);
+	stat_add(&pool->accepted, 1);
+}
 
-	int32_t version = -1;
-	uint32_t command;
+static void
+remove_connection(daemon_pool *pool, connection *conn)
+{
+	/* closing it also takes it out of the epoll set */
+	if (conn->fd >= 0)
+		close(conn->fd);
+
+	if (conn->prev_conn)
+		conn->prev_conn->next_conn = conn->next_conn;
+	else
+		pool->conns = conn->next_conn;
+	if (conn->next_conn)
+		conn->next_conn->prev_conn = conn->prev_conn;
+
+	for (int i = 0; i < conn->nfds; i++)
+		close(conn->fds[i]);
+	xfree(conn->payload);
+	pthread_mutex_destroy(&conn->write_lock);
+	free(conn);
+	stat_sub(&pool->connections, 1);
+}
 
-	if (n < (long long)sizeof(command)) {
-		ctx->cms->log(ctx->cms, ctx->priority|LOG_ERR,
-			"unlock-token: invalid data");
-		ctx->cms->log(ctx->cms, ctx->priority|LOG_ERR,
-			"possible exploit attempt. closing.");
-		close(pollfd->fd);
+/*
+ * Stop reading from a connection; it's closed as soon as nothing we've
+ * queued from it is still running.
+ */
+static void
+close_connection(daemon_pool *pool, connection *conn)
+{
+	if (conn->refs == 0 && !conn->ready) {
+		remove_connection(pool, conn);
 		return;
 	}
+	if (!conn->closing) {
+		conn->closing = 1;
+		epoll_ctl(pool->epfd, EPOLL_CTL_DEL, conn->fd, NULL);
+	}
+}
 
-	memcpy(&command, buffer, sizeof (command));
-	ctx->cms->log(ctx->cms, ctx->priority|LOG_NOTICE,
-			"searching for command %d", command);
+/*
+ * Put a connection on the end of the ready list.  With edge-triggered
+ * epoll we won't hear about input that's already waiting again, so
+ * anything that might have some stays here until we've read it.
+ */
+static void
+mark_ready(daemon_pool *pool, connection *conn)
+{
+	if (conn->ready || conn->busy || conn->closing)
+		return;
 
-	for (int i = 0; cmd_table[i].cmd != CMD_LIST_END; i++) {
-		if (cmd_table[i].cmd == command) {
-			ctx->cms->log(ctx->cms, ctx->priority|LOG_NOTICE,
-					"cmd-version: found command \"%s\" "
-					"version %d",
-					cmd_table[i].name,
-					cmd_table[i].version);
-			version = cmd_table[i].version;
-			break;
+	conn->ready = 1;
+	conn->next = NULL;
+	if (pool->ready_tail)
+		pool->ready_tail->next = conn;
+	else
+		pool->ready = conn;
+	pool->ready_tail = conn;
+}
+
+static void
+accept_connections(context *ctx)
+{
+	while (1) {
+		struct sockaddr_un remote;
+		socklen_t len = sizeof(remote);
+		int fd = accept4(ctx->sd, &remote, &len, SOCK_CLOEXEC);
+		if (fd < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno != EAGAIN && errno != EWOULDBLOCK)
+				ctx->backup_cms->log(ctx->backup_cms,
+					ctx->priority|LOG_WARNING,
+					"accept: %m");
+			return;
 		}
+		add_connection(ctx, fd);
 	}
+}
 
-	if (version == -1) {
-		ctx->cms->log(ctx->cms, ctx->priority|LOG_NOTICE,
-				"cmd-version: could not find command %d",
-				command);
+/*
+ * Clean up after requests the workers are done with.  A protocol 1
+ * connection comes back to us too; whatever the client has sent since we
+ * handed it off hasn't been read yet.
+ */
+static void
+reclaim_requests(daemon_pool *pool)
+{
+	pthread_mutex_lock(&pool->lock);
+	daemon_request *done = pool->done;
+	pool->done = NULL;
+	pthread_mutex_unlock(&pool->lock);
+
+	while (done) {
+		daemon_request *req = done;
+		connection *conn = req->conn;
+		done = req->next;
+
+		conn->refs--;
+		conn->busy = 0;
+		if (req->hung_up || conn->closing)
+			close_connection(pool, conn);
+		else
+			mark_ready(pool, conn);
+		free_request(req);
 	}
-	send_response(ctx, ctx->cms, pollfd, version);
-
-	free(buffer);
-
-	hide_stolen_goods_from_cms(ctx->cms, ctx->backup_cms);
-	cms_context_fini(ctx->cms);
 }
 
-static int
-handle_event(context *ctx, struct pollfd *pollfd)
+/* Turn what read_request() put together into a request of its own. */
+static daemon_request *
+new_request(context *ctx, connection *conn)
 {
-	struct msghdr msg;
-	struct iovec iov;
-	ssize_t n;
-	pesignd_msghdr pm;
+	daemon_request *req = calloc(1, sizeof (*req));
+	if (!req) {
+		ctx->backup_cms->log(ctx->backup_cms, ctx->priority|LOG_ERR,
+			"could not allocate memory: %m");
+		exit(1);
+	}
 
-	msg.msg_name = NULL;
-	msg.msg_namelen = 0;
+	req->conn = conn;
+	req->fd = conn->fd;
+	req->proto = conn->proto;
+	req->command = conn->hdr.command;
+	req->size = conn->hdr.size;
+	if (conn->proto >= 2)
+		req->id = conn->hdr.id;
+	req->payload = conn->payload;
+	memcpy(req->fds, conn->fds, sizeof (req->fds));
+	req->nfds = conn->nfds;
+	req->queued_at = timing_now();
+	req->receive_ns = req->queued_at - conn->started;
+
+	conn->hdrlen = 0;
+	conn->payload = NULL;
+	conn->paylen = 0;
+	conn->nfds = 0;
+	conn->refs++;
+	return req;
+}
 
-	iov.iov_base = &pm;
-	iov.iov_len = sizeof(pm);
-	msg.msg_iov = &iov;
-	msg.msg_iovlen = 1;
+/*
+ * Tell a protocol 2 client its user already has as much queued as we'll
+ * take, so it can try again later.
+ */
+static void
+turn_away(context *ctx, daemon_request *req)
+{
+	static const char msg[] = "server busy, try again later";
+	daemon_pool *pool = ctx->pool;
+	connection *conn = req->conn;
+
+	stat_add(&pool->rejected, 1);
+	int rc = send_message(ctx, ctx->backup_cms, req, PESIGND_BUSY,
+			      msg, sizeof (msg), 1);
+	conn->refs--;
+	free_request(req);
+	if (rc < 0)
+		close_connection(pool, conn);
+}
 
-	char control[1024];
-	msg.msg_controllen = 1024;
-	msg.msg_control = control;
+static void
+dispatch_requests(context *ctx)
+{
+	daemon_pool *pool = ctx->pool;
+	connection *deferred = NULL, *deferred_tail = NULL;
+
+	while (pool->ready) {
+		connection *conn = pool->ready;
+		pool->ready = conn->next;
+		if (!pool->ready)
+			pool->ready_tail = NULL;
+		conn->ready = 0;
+
+		if (conn->closing) {
+			close_connection(pool, conn);
+			continue;
+		}
 
-	n = recvmsg(pollfd->fd, &msg, MSG_WAITALL);
-	if (n < 0) {
-		ctx->backup_cms->log(ctx->backup_cms, ctx->priority|LOG_WARNING,
-			"recvmsg failed: %m");
-		return n;
-	}
+		/* a protocol 1 client doesn't know about PESIGND_BUSY, so it
+		 * waits, unread, until its user has room */
+		if (conn->proto < 2) {
+			pthread_mutex_lock(&pool->lock);
+			int admit = admit_request(pool, conn->uid);
+			pthread_mutex_unlock(&pool->lock);
+			if (!admit) {
+				conn->next = NULL;
+				if (deferred_tail)
+					deferred_tail->next = conn;
+				else
+					deferred = conn;
+				deferred_tail = conn;
+				continue;
+			}
+		}
 
-	/* if recvmsg returned 0, we're not going to get any valid data. */
-	/* This *probably* means we were hung up on. */
-	if (n == 0)
-		return n;
+		int rc = read_request(ctx, conn);
+		if (rc < 0) {
+			close_connection(pool, conn);
+			continue;
+		}
+		if (rc == 0)
+			continue;
 
-	if (n < (long long)sizeof (pm)) {
-		ctx->backup_cms->log(ctx->backup_cms, ctx->priority|LOG_ERR,
-			"got message with invalid size %zu", n);
-		ctx->backup_cms->log(ctx->backup_cms, ctx->priority|LOG_ERR,
-			"possible exploit attempt.  closing.");
-		close(pollfd->fd);
-		return -1;
-	}
+		daemon_request *req = new_request(ctx, conn);
 
-	if (pm.version != PESIGND_VERSION) {
-		ctx->backup_cms->log(ctx->backup_cms, ctx->priority|LOG_ERR,
-			"got version %d, expected version %d",
-			pm.version, PESIGND_VERSION);
-		ctx->backup_cms->log(ctx->backup_cms, ctx->priority|LOG_ERR,
-			"possible exploit attempt.  closing.");
-		close(pollfd->fd);
-		return -1;
-	}
+		/* a protocol 1 client gets nothing more read until this is
+		 * done; a protocol 2 one can keep on sending */
+		if (conn->proto < 2)
+			conn->busy = 1;
+		else
+			mark_ready(pool, conn);
 
-	for (int i = 0; cmd_table[i].cmd != CMD_LIST_END; i++) {
-		if (cmd_table[i].cmd == pm.command) {
-			if (cmd_table[i].func == NULL) {
-				handle_invalid_input(pm.command, ctx, pollfd,
-							pm.size);
-				close(pollfd->fd);
-			}
-			cmd_table[i].func(ctx, pollfd, pm.size);
-			return 0;
+		pthread_mutex_lock(&pool->lock);
+		if (conn->proto >= 2 && is_signing_command(req->command) &&
+				!admit_request(pool, conn->uid)) {
+			pthread_mutex_unlock(&pool->lock);
+			turn_away(ctx, req);
+			continue;
+		}
+		uid_queue *queue = get_queue(pool, conn->uid);
+		if (!queue) {
+			ctx->backup_cms->log(ctx->backup_cms,
+				ctx->priority|LOG_ERR,
+				"could not allocate memory: %m");
+			exit(1);
 		}
+		queue->in_flight++;
+		enqueue_request(pool, queue, req);
+		pool->in_flight++;
+		/* a worker with requests parked might not be able to take it */
+		pthread_cond_broadcast(&pool->work);
+		pthread_mutex_unlock(&pool->lock);
 	}
 
-	handle_invalid_input(pm.command, ctx, pollfd, pm.size);
-	close(pollfd->fd);
-	return 0;
+	/* still ready; we'll look again when a request finishes */
+	while (deferred) {
+		connection *conn = deferred;
+		deferred = conn->next;
+		mark_ready(pool, conn);
+	}
 }
 
 static void
-do_shutdown(context *ctx, int nsockets, struct pollfd *pollfds)
+do_shutdown(context *ctx)
 {
+	daemon_pool *pool = ctx->pool;
+
+	stop_workers(pool);
+
 	unlink(SOCKPATH);
 	unlink(PIDFILE);
 
-	for (int i = 0; i < ctx->ntokennames; i++)
-		free(ctx->tokennames[i]);
-	if (ctx->tokennames)
-		free(ctx->tokennames);
+	for (int i = 0; i < pool->ntokennames; i++)
+		free(pool->tokennames[i]);
+	if (pool->tokennames)
+		free(pool->tokennames);
 	ctx->backup_cms->log(ctx->backup_cms, ctx->priority|LOG_NOTICE,
 			"pesignd exiting (pid %d)", getpid());
 
 	xfree(ctx->errstr);
 
-	for (int i = 0; i < nsockets; i++)
-		close(pollfds[i].fd);
-	free(pollfds);
+	drop_signers(pool, NULL);
+	free_executors(pool);
+
+	/* the workers have drained the queue, so everything's here */
+	while (pool->done) {
+		daemon_request *req = pool->done;
+		pool->done = req->next;
+		free_request(req);
+	}
+	while (pool->conns)
+		remove_connection(pool, pool->conns);
+	while (pool->queues) {
+		uid_queue *queue = pool->queues;
+		pool->queues = queue->next;
+		free(queue);
+	}
+
+	close(ctx->sd);
+	close(pool->wake[0]);
+	close(pool->wake[1]);
+	close(pool->epfd);
+
+	pthread_cond_destroy(&pool->work);
+	pthread_mutex_destroy(&pool->lock);
+	pthread_mutex_destroy(&pool->nss_lock);
+	pthread_mutex_destroy(&pool->signer_lock);
+}
+
+/*
+ * Unlock the tokens and look up the keys the configuration file names,
+ * so the first requests for them don't have to.  Something that doesn't
+ * work is logged, but the rest are still worth having.
+ */
+static void
+preload_tokens(context *ctx, daemon_options *options)
+{
+	for (int i = 0; i < options->ntokens; i++) {
+		preload_token *token = &options->tokens[i];
+		int rc = 0;
+
+		if (get_request_cms(ctx) < 0)
+			goto oom;
+		if (token->pin) {
+			rc = unlock_token(ctx, token->tokenname, token->pin);
+			memset(token->pin, 0, strlen(token->pin));
+			xfree(token->pin);
+		}
+		put_request_cms(ctx);
+		if (rc < 0)
+			continue;
+
+		for (int j = 0; j < token->ncertnames; j++) {
+			if (get_request_cms(ctx) < 0)
+				goto oom;
+			ctx->cms->tokenname = PORT_ArenaStrdup(ctx->cms->arena,
+							token->tokenname);
+			ctx->cms->certname = PORT_ArenaStrdup(ctx->cms->arena,
+							token->certnames[j]);
+			if (!ctx->cms->tokenname || !ctx->cms->certname)
+				goto oom;
+
+			if (get_signer(ctx) < 0)
+				ctx->cms->log(ctx->cms, ctx->priority|LOG_ERR,
+					"could not preload key \"%s:%s\"",
+					token->tokenname, token->certnames[j]);
+			else
+				ctx->cms->log(ctx->cms,
+					ctx->priority|LOG_NOTICE,
+					"preloaded key \"%s:%s\"",
+					token->tokenname, token->certnames[j]);
+			put_request_cms(ctx);
+		}
+	}
+	return;
+oom:
+	ctx->backup_cms->log(ctx->backup_cms, ctx->priority|LOG_ERR,
+		"unable to allocate memory: %m");
+	exit(1);
 }
 
+/*
+ * The dispatcher accepts connections and reads requests off them as the
+ * data trickles in, so a client that sends half a message only ever
+ * costs it a connection object.  Once a whole request has arrived the
+ * connection is handed to the worker pool, and isn't read from again
+ * until a worker gives it back.  Each user gets a share of
+ * max_in_flight; past that, protocol 2 requests to sign something are
+ * answered with PESIGND_BUSY, and protocol 1 input is left on the ready
+ * list until one of that user's requests finishes.
+ */
 static int
-handle_events(context *ctx)
+handle_events(context *ctx, daemon_options *options, int ready_fd)
 {
-	int rc;
-	int nsockets = 1;
+	struct epoll_event events[64];
+	daemon_pool pool = {
+		.nworkers = options->nworkers,
+		.max_in_flight = options->max_in_flight,
+		.queue_timeout = options->queue_timeout * 1000000000ull,
+		.weights = options->weights,
+		.nweights = options->nweights,
+		.token_threads = options->token_threads,
+		.ntoken_threads = options->ntoken_threads,
+	};
+	int listener, waker;
 
-	struct pollfd *pollfds = calloc(1, sizeof(struct pollfd));
+	ctx->pool = &pool;
+	pool.started = timing_now();
+	pthread_mutex_init(&pool.lock, NULL);
+	pthread_mutex_init(&pool.nss_lock, NULL);
+	pthread_mutex_init(&pool.signer_lock, NULL);
+	pthread_cond_init(&pool.work, NULL);
 
-	if (!pollfds) {
+	if (pipe2(pool.wake, O_CLOEXEC|O_NONBLOCK) < 0) {
 		ctx->backup_cms->log(ctx->backup_cms, ctx->priority|LOG_ERR,
-			"could not allocate memory: %m");
+			"could not create pipe: %m");
+		exit(1);
+	}
+
+	pool.epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (pool.epfd < 0 || watch_fd(&pool, ctx->sd, &listener) < 0 ||
+			watch_fd(&pool, pool.wake[0], &waker) < 0) {
+		ctx->backup_cms->log(ctx->backup_cms, ctx->priority|LOG_ERR,
+			"could not set up epoll: %m");
+		exit(1);
+	}
+
+	if (start_workers(ctx, &pool) < 0) {
+		ctx->backup_cms->log(ctx->backup_cms, ctx->priority|LOG_ERR,
+			"could not start worker threads: %m");
 		exit(1);
 	}
 
-	pollfds[0].fd = ctx->sd;
-	pollfds[0].events = POLLIN|POLLPRI|POLLHUP;
+	preload_tokens(ctx, options);
+
+	/* let whoever started us know they can send requests now */
+	if (ready_fd >= 0) {
+		while (write(ready_fd, "", 1) < 0 && errno == EINTR)
+			;
+		close(ready_fd);
+	}
 
 	while (1) {
 		if (should_exit != 0) {
 shutdown:
-			do_shutdown(ctx, nsockets, pollfds);
+			do_shutdown(ctx);
 			return 0;
 		}
-		rc = ppoll(pollfds, nsockets, NULL, NULL);
+
+		int n = epoll_wait(pool.epfd, events,
+				   sizeof (events) / sizeof (events[0]), -1);
 		if (should_exit != 0)
 			goto shutdown;
-		if (rc < 0) {
-			ctx->backup_cms->log(ctx->backup_cms,
-				ctx->priority|LOG_WARNING,
-				"ppoll: %m");
+		if (n < 0) {
+			if (errno != EINTR)
+				ctx->backup_cms->log(ctx->backup_cms,
+					ctx->priority|LOG_WARNING,
+					"epoll_wait: %m");
 			continue;
 		}
 
-		if (pollfds[0].revents & POLLIN) {
-			nsockets++;
-			struct pollfd *newpollfds = realloc(pollfds,
-				nsockets * sizeof(struct pollfd));
-
-			if (!newpollfds) {
-				ctx->backup_cms->log(ctx->backup_cms,
-					ctx->priority|LOG_ERR,
-					"could not allocate memory: %m");
-				exit(1);
+		for (int i = 0; i < n; i++) {
+			void *data = events[i].data.ptr;
+
+			if (data == &listener) {
+				accept_connections(ctx);
+			} else if (data == &waker) {
+				char buf[64];
+				while (read(pool.wake[0], buf, sizeof (buf)) > 0)
+					;
+			} else {
+				mark_ready(&pool, data);
 			}
-			pollfds = newpollfds;
-
-			struct sockaddr_un remote;
-			socklen_t len = sizeof(remote);
-			pollfds[nsockets-1].fd = accept(pollfds[0].fd, &remote,
-							&len);
-			pollfds[nsockets-1].events = POLLIN|POLLPRI|POLLHUP;
-			pollfds[nsockets-1].revents = pollfds[0].revents;
 		}
-		for (int i = 1; i < nsockets; i++) {
-			if (pollfds[i].revents & (POLLHUP|POLLNVAL)) {
-				close(pollfds[i].fd);
-				if (i == nsockets-1) {
-					nsockets--;
-					continue;
-				}
-				for (int j = i; j < nsockets - 1; j++) {
-					pollfds[j].fd = pollfds[j+1].fd;
-					pollfds[j].events =
-						pollfds[j].events;
-					pollfds[j].revents =
-						pollfds[j].revents;
-				}
-				nsockets--;
-				i--;
-				continue;
-			}
 
-			if (pollfds[i].revents & (POLLIN|POLLPRI))
-				handle_event(ctx, &pollfds[i]);
-		}
+		reclaim_requests(&pool);
+		dispatch_requests(ctx);
 	}
 	return 0;
 }
@@ -935,7 +3364,8 @@ quit_handler(int signal __attribute__((__unused__)))
 static int
 set_up_socket(context *ctx)
 {
-	int sd = socket(AF_UNIX, SOCK_STREAM, 0);
+	/* non-blocking, since the dispatcher accepts until it runs dry */
+	int sd = socket(AF_UNIX, SOCK_STREAM|SOCK_NONBLOCK, 0);
 	if (sd < 0) {
 		ctx->backup_cms->log(ctx->backup_cms, ctx->priority|LOG_ERR,
 			"unable to create socket: %m");
@@ -1066,8 +3496,288 @@ err:
 	close(fd);
 }
 
+/*
+ * Parse --uid-weights: a comma separated list of user:weight, where user
+ * is a name or a numeric uid.
+ */
+int
+parse_uid_weights(daemon_options *options, char *spec)
+{
+	char *copy = strdup(spec);
+	char *saveptr = NULL;
+
+	if (!copy) {
+		fprintf(stderr, "pesign: could not allocate memory: %m\n");
+		return -1;
+	}
+
+	for (char *entry = strtok_r(copy, ",", &saveptr); entry;
+			entry = strtok_r(NULL, ",", &saveptr)) {
+		char *colon = strrchr(entry, ':');
+		char *end = NULL;
+		unsigned long weight = 0;
+		uid_t uid;
+
+		if (colon) {
+			*colon = '\0';
+			weight = strtoul(colon + 1, &end, 10);
+		}
+		if (!colon || !*entry || end == colon + 1 || *end ||
+				weight < 1 || weight > 1000) {
+			fprintf(stderr, "pesign: invalid uid weights \"%s\"\n",
+				spec);
+			goto err;
+		}
+
+		struct passwd *pw = getpwnam(entry);
+		if (pw) {
+			uid = pw->pw_uid;
+		} else {
+			uid = strtoul(entry, &end, 10);
+			if (*end) {
+				fprintf(stderr, "pesign: unknown user \"%s\"\n",
+					entry);
+				goto err;
+			}
+		}
+
+		uid_weight *weights = realloc(options->weights,
+				(options->nweights + 1) * sizeof (*weights));
+		if (!weights) {
+			fprintf(stderr, "pesign: could not allocate memory: "
+				"%m\n");
+			goto err;
+		}
+		weights[options->nweights].uid = uid;
+		weights[options->nweights].weight = weight;
+		options->weights = weights;
+		options->nweights++;
+	}
+	free(copy);
+	return 0;
+err:
+	free(copy);
+	return -1;
+}
+
+int
+parse_token_threads(daemon_options *options, char *spec)
+{
+	char *copy = strdup(spec);
+	char *saveptr = NULL;
+
+	if (!copy) {
+		fprintf(stderr, "pesign: could not allocate memory: %m\n");
+		return -1;
+	}
+
+	for (char *entry = strtok_r(copy, ",", &saveptr); entry;
+			entry = strtok_r(NULL, ",", &saveptr)) {
+		char *colon = strrchr(entry, ':');
+		char *end = NULL;
+		long nthreads = 0;
+
+		if (colon) {
+			*colon = '\0';
+			nthreads = strtol(colon + 1, &end, 10);
+		}
+		if (!colon || !*entry || end == colon + 1 || *end ||
+				nthreads < 1 || nthreads > 64) {
+			fprintf(stderr, "pesign: invalid token threads \"%s\"\n",
+				spec);
+			goto err;
+		}
+
+		token_threads *tt = realloc(options->token_threads,
+				(options->ntoken_threads + 1) * sizeof (*tt));
+		if (!tt) {
+			fprintf(stderr, "pesign: could not allocate memory: "
+				"%m\n");
+			goto err;
+		}
+		options->token_threads = tt;
+		tt[options->ntoken_threads].tokenname = strdup(entry);
+		if (!tt[options->ntoken_threads].tokenname) {
+			fprintf(stderr, "pesign: could not allocate memory: "
+				"%m\n");
+			goto err;
+		}
+		tt[options->ntoken_threads].nthreads = nthreads;
+		options->ntoken_threads++;
+	}
+	free(copy);
+	return 0;
+err:
+	free(copy);
+	return -1;
+}
+
+static char *
+read_pin(int fd, const char *path)
+{
+	FILE *pinf = fd >= 0 ? fdopen(fd, "r") : fopen(path, "re");
+	char *pin = NULL;
+	size_t len = 0;
+
+	if (!pinf)
+		return NULL;
+
+	ssize_t n = getline(&pin, &len, pinf);
+	fclose(pinf);
+	if (n < 0) {
+		xfree(pin);
+		return NULL;
+	}
+	*strchrnul(pin, '\n') = '\0';
+	return pin;
+}
+
+/*
+ * Read the tokens to unlock and the keys to look up at start-up.  Each
+ * line is a keyword followed by its value, which is the rest of the line:
+ *
+ *	token NSS Certificate DB
+ *	pin-file /etc/pesign/pin
+ *	certificate Signing Key
+ *
+ * pin-fd reads the PIN from a file descriptor we were started with
+ * instead.  Blank lines and lines starting with '#' are ignored.  PINs
+ * are read now, while we can still read root's files.
+ */
+int
+parse_daemon_config(daemon_options *options, const char *path, int required)
+{
+	FILE *f = fopen(path, "re");
+	char *line = NULL;
+	size_t size = 0;
+	int lineno = 0;
+	int rc = -1;
+
+	if (!f) {
+		if (errno == ENOENT && !required)
+			return 0;
+		fprintf(stderr, "pesign: could not open \"%s\": %m\n", path);
+		return -1;
+	}
+
+	while (getline(&line, &size, f) >= 0) {
+		char *key = line + strspn(line, " \t");
+		lineno++;
+
+		*strchrnul(key, '\n') = '\0';
+		if (!*key || *key == '#')
+			continue;
+
+		char *value = key + strcspn(key, " \t");
+		if (*value)
+			*value++ = '\0';
+		value += strspn(value, " \t");
+		char *end = value + strlen(value);
+		while (end > value && (end[-1] == ' ' || end[-1] == '\t'))
+			*--end = '\0';
+		if (!*value) {
+			fprintf(stderr, "pesign: %s:%d: %s needs a value\n",
+				path, lineno, key);
+			goto out;
+		}
+
+		preload_token *token = NULL;
+		if (options->ntokens)
+			token = &options->tokens[options->ntokens - 1];
+
+		if (!strcmp(key, "token")) {
+			token = realloc(options->tokens,
+				(options->ntokens + 1) * sizeof (*token));
+			if (!token)
+				goto oom;
+			options->tokens = token;
+			token = &token[options->ntokens++];
+			memset(token, 0, sizeof (*token));
+			token->tokenname = strdup(value);
+			if (!token->tokenname)
+				goto oom;
+		} else if (!token) {
+			fprintf(stderr, "pesign: %s:%d: %s has to come after "
+				"a token\n", path, lineno, key);
+			goto out;
+		} else if (!strcmp(key, "pin-file") ||
+				!strcmp(key, "pin-fd")) {
+			int fd = -1;
+
+			if (token->pin) {
+				fprintf(stderr, "pesign: %s:%d: token \"%s\" "
+					"already has a PIN\n", path, lineno,
+					token->tokenname);
+				goto out;
+			}
+			if (!strcmp(key, "pin-fd")) {
+				char *endp = NULL;
+				long n = strtol(value, &endp, 10);
+				if (*endp || n < 0 || n > INT_MAX) {
+					fprintf(stderr, "pesign: %s:%d: invalid "
+						"file descriptor \"%s\"\n",
+						path, lineno, value);
+					goto out;
+				}
+				fd = n;
+			}
+			token->pin = read_pin(fd, value);
+			if (!token->pin) {
+				fprintf(stderr, "pesign: %s:%d: could not read "
+					"PIN from \"%s\": %m\n", path, lineno,
+					value);
+				goto out;
+			}
+		} else if (!strcmp(key, "certificate")) {
+			char **certnames = realloc(token->certnames,
+				(token->ncertnames + 1) * sizeof (char *));
+			if (!certnames)
+				goto oom;
+			token->certnames = certnames;
+			certnames[token->ncertnames] = strdup(value);
+			if (!certnames[token->ncertnames])
+				goto oom;
+			token->ncertnames++;
+		} else {
+			fprintf(stderr, "pesign: %s:%d: unknown keyword "
+				"\"%s\"\n", path, lineno, key);
+			goto out;
+		}
+	}
+	rc = 0;
+	goto out;
+oom:
+	fprintf(stderr, "pesign: could not allocate memory: %m\n");
+out:
+	xfree(line);
+	fclose(f);
+	return rc;
+}
+
+/*
+ * The daemon writes a byte to the pipe once it's ready for requests; if
+ * it exits first, all we get is EOF.
+ */
+static int
+wait_until_ready(int fd)
+{
+	char c;
+	ssize_t n;
+
+	while ((n = read(fd, &c, 1)) < 0 && errno == EINTR)
+		;
+	close(fd);
+	if (n != 1) {
+		fprintf(stderr, "pesign: pesignd exited before it was ready; "
+			"see the system log\n");
+		return -1;
+	}
+	return 0;
+}
+
 int
-daemonize(cms_context *cms_ctx, char *certdir, int do_fork)
+daemonize(cms_context *cms_ctx, char *certdir, int do_fork,
+	  daemon_options *options)
 {
 	int rc = 0;
 	context ctx = {
@@ -1089,13 +3799,19 @@ daemonize(cms_context *cms_ctx, char *certdir, int do_fork)
 
 	openlog("pesignd", LOG_PID, LOG_DAEMON);
 
+	int ready[2] = { -1, -1 };
 	if (do_fork) {
 		pid_t pid;
 
+		if (pipe2(ready, O_CLOEXEC) < 0) {
+			fprintf(stderr, "pesign: could not create pipe: %m\n");
+			exit(1);
+		}
 		if ((pid = fork())) {
-			sleep(2);
-			return 0;
+			close(ready[1]);
+			return wait_until_ready(ready[0]);
 		}
+		close(ready[0]);
 	}
 	ctx.pid = getpid();
 	write_pid_file(ctx.pid);
@@ -1234,7 +3950,7 @@ daemonize(cms_context *cms_ctx, char *certdir, int do_fork)
 	if (do_fork)
 		ctx.backup_cms->log = daemon_logger;
 
-	rc = handle_events(&ctx);
+	rc = handle_events(&ctx, options, ready[1]);
 
 	status = NSS_Shutdown();
 	if (status != SECSuccess) {
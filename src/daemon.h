@@ -19,7 +19,42 @@
 #ifndef DAEMON_H
 #define DAEMON_H 1
 
-extern int daemonize(cms_context *ctx, char *certdir, int do_fork);
+typedef struct {
+	uid_t uid;
+	unsigned int weight;
+} uid_weight;
+
+typedef struct {
+	char *tokenname;
+	int nthreads;
+} token_threads;
+
+/* A token to unlock and keys to look up before we take any requests. */
+typedef struct {
+	char *tokenname;
+	char *pin;			/* NULL if it doesn't need one */
+	char **certnames;
+	int ncertnames;
+} preload_token;
+
+typedef struct {
+	int nworkers;
+	int max_in_flight;
+	int queue_timeout;		/* seconds; 0 for none */
+	uid_weight *weights;		/* everybody else gets 1 */
+	int nweights;
+	token_threads *token_threads;	/* the rest are guessed */
+	int ntoken_threads;
+	preload_token *tokens;
+	int ntokens;
+} daemon_options;
+
+extern int parse_uid_weights(daemon_options *options, char *spec);
+extern int parse_token_threads(daemon_options *options, char *spec);
+extern int parse_daemon_config(daemon_options *options, const char *path,
+			       int required);
+extern int daemonize(cms_context *ctx, char *certdir, int do_fork,
+		     daemon_options *options);
 
 typedef struct {
 	uint32_t version;
@@ -27,6 +62,14 @@ typedef struct {
 	uint32_t size;
 } pesignd_msghdr;
 
+/* protocol 2 requests carry an id, which the response to each echoes */
+typedef struct {
+	uint32_t version;
+	uint32_t command;
+	uint32_t size;
+	uint32_t id;
+} pesignd_msghdr_v2;
+
 typedef struct  {
 	int32_t rc;
 	uint8_t errmsg[];
@@ -37,6 +80,18 @@ typedef struct {
 	uint8_t value[];
 } pesignd_string;
 
+typedef struct {
+	uint32_t command;
+	int32_t version;
+} pesignd_cmd_version;
+
+/* How much the server will take on at once, so a client sending many
+ * requests knows how many to have outstanding. */
+typedef struct {
+	uint32_t workers;
+	uint32_t max_in_flight;		/* per user, before PESIGND_BUSY */
+} pesignd_limits;
+
 typedef enum {
 	CMD_KILL_DAEMON,
 	CMD_UNLOCK_TOKEN,
@@ -45,11 +100,83 @@ typedef enum {
 	CMD_RESPONSE,
 	CMD_IS_TOKEN_UNLOCKED,
 	CMD_GET_CMD_VERSION,
+	/* token, nickname, digest name, and the digest itself, as four
+	 * pesignd_strings; a successful response carries the DER
+	 * signature where the error message would be */
+	CMD_SIGN_DIGEST,
+	/* the highest protocol the client speaks, as a uint32_t; the
+	 * response's rc is the one we'll use, and its data is a
+	 * pesignd_limits, then a pesignd_cmd_version for every command we
+	 * support */
+	CMD_NEGOTIATE,
+	/* protocol 2 only: a uint32_t count, then for each binary a
+	 * uint32_t of PESIGND_BATCH_* flags and token, nickname, and
+	 * digest name pesignd_strings, and with PESIGND_BATCH_DIGEST, the
+	 * digest itself as a fourth.  The request carries an input and an
+	 * output descriptor for each of the others.  The response has an
+	 * int32_t result and a pesignd_string for each: an error message
+	 * (empty on success), or for a digest that was signed, the DER
+	 * signature. */
+	CMD_SIGN_BATCH,
+	/* no payload; the response's data is a pesignd_stats, followed by
+	 * its ncommands, nphases, and nkeys entries, each of them a
+	 * pesignd_histogram and then a pesignd_string naming it */
+	CMD_GET_STATS,
 	CMD_LIST_END
 } pesignd_cmd;
 
 #define PESIGND_VERSION 0x2a9edaf0
+#define PESIGND_VERSION_2 0x2a9edaf2
+#define PESIGND_PROTOCOL 2
+
+/*
+ * Protocol 2 only: the request wasn't run because the server is too busy
+ * or it waited too long for a worker; it's fine to send it again.
+ */
+#define PESIGND_BUSY	(-2)
+
+#define PESIGND_BATCH_ATTACHED	0x1
+/* the client hashed it, as for CMD_SIGN_DIGEST, and writes the output */
+#define PESIGND_BATCH_DIGEST	0x2
+/* two descriptors each, and one message can't carry more than 253 */
+#define PESIGND_MAX_BATCH	126
+
+/*
+ * buckets[i] counts latencies of less than 2^i microseconds that didn't
+ * fit in buckets[i-1]; the last one also has everything longer.
+ */
+#define PESIGND_STATS_BUCKETS	32
+
+typedef struct {
+	uint64_t count;
+	uint64_t errors;
+	uint64_t total_us;
+	uint64_t buckets[PESIGND_STATS_BUCKETS];
+} pesignd_histogram;
+
+typedef struct {
+	uint64_t uptime;		/* seconds */
+	uint64_t workers;
+	uint64_t connections;		/* open right now */
+	uint64_t accepted;
+	uint64_t bad_requests;		/* connections closed for them */
+	uint64_t rejected;		/* answered PESIGND_BUSY */
+	uint64_t expired;		/* past their deadline */
+	uint64_t token_busy;		/* their token had too much queued */
+	uint64_t queued;		/* waiting for a worker */
+	uint64_t in_flight;		/* queued or running */
+	uint64_t bytes_hashed;
+	uint64_t contexts_created;	/* cms_contexts made for requests */
+	uint64_t contexts_reused;	/* and recycled for later ones */
+	uint64_t heap_in_use;		/* bytes malloc()ed right now */
+	uint32_t ncommands;
+	uint32_t nphases;
+	uint32_t nkeys;
+	uint32_t reserved;
+} pesignd_stats;
+
 #define SOCKPATH	"/var/run/pesign/socket"
 #define PIDFILE		"/var/run/pesign.pid"
+#define DAEMON_CONFIG	"/etc/pesign/daemon.conf"
 
 #endif /* DAEMON_H */
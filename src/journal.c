@@ -0,0 +1,263 @@
+/*
+ * Copyright 2026 agent <agent@local>
+ * All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 2 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Author(s): agent <agent@local>
+ */
+
+#include <fcntl.h>
+#include <libgen.h>
+#include <stdint.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "pesign.h"
+
+#define JOURNAL_MAGIC	"PESIGNJ1"
+
+/*
+ * The journal is written under a temporary name and renamed into place,
+ * so if it exists at all, it's complete.
+ */
+typedef struct {
+	char magic[8];
+	uint64_t size;			/* of the binary before we started */
+	uint32_t nrecords;
+	uint32_t reserved;
+} journal_header;
+
+/* followed by len bytes that belong at offset */
+typedef struct {
+	uint64_t offset;
+	uint64_t len;
+} journal_record;
+
+static char *
+journal_name(const char *path, const char *suffix)
+{
+	char *name = NULL;
+
+	if (asprintf(&name, "%s.pesign-journal%s", path, suffix) < 0)
+		return NULL;
+	return name;
+}
+
+static int
+sync_dir(const char *path)
+{
+	char *copy = strdup(path);
+	if (!copy)
+		return -1;
+
+	int fd = open(dirname(copy), O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+	free(copy);
+	if (fd < 0)
+		return -1;
+
+	int rc = fsync(fd);
+	close(fd);
+	return rc;
+}
+
+static int
+write_all(int fd, const void *buf, size_t len)
+{
+	const char *pos = buf;
+
+	while (len > 0) {
+		ssize_t n = write(fd, pos, len);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return -1;
+		pos += n;
+		len -= n;
+	}
+	return 0;
+}
+
+static int
+read_all(int fd, void *buf, size_t len)
+{
+	char *pos = buf;
+
+	while (len > 0) {
+		ssize_t n = read(fd, pos, len);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return -1;
+		pos += n;
+		len -= n;
+	}
+	return 0;
+}
+
+/*
+ * Put a binary back the way its journal says it was.  Returns 0 if there
+ * was no journal, 1 if we rolled the binary back, and -1 on error.
+ */
+int
+journal_recover(const char *path)
+{
+	char *name = journal_name(path, "");
+	char *tmpname = journal_name(path, ".tmp");
+	char *buf = NULL;
+	int fd = -1, outfd = -1;
+	int rc = -1;
+
+	if (!name || !tmpname)
+		goto out;
+
+	/* never renamed into place, so we never touched the binary */
+	unlink(tmpname);
+
+	fd = open(name, O_RDONLY|O_CLOEXEC);
+	if (fd < 0) {
+		if (errno == ENOENT)
+			rc = 0;
+		goto out;
+	}
+
+	journal_header hdr;
+	if (read_all(fd, &hdr, sizeof (hdr)) < 0 ||
+			memcmp(hdr.magic, JOURNAL_MAGIC, sizeof (hdr.magic))) {
+		errno = EINVAL;
+		goto out;
+	}
+
+	outfd = open(path, O_RDWR|O_CLOEXEC);
+	if (outfd < 0)
+		goto out;
+
+	for (uint32_t i = 0; i < hdr.nrecords; i++) {
+		journal_record rec;
+
+		if (read_all(fd, &rec, sizeof (rec)) < 0)
+			goto out;
+		if (rec.len > hdr.size || rec.offset > hdr.size - rec.len) {
+			errno = EINVAL;
+			goto out;
+		}
+
+		buf = realloc(buf, rec.len ? rec.len : 1);
+		if (!buf)
+			goto out;
+		if (read_all(fd, buf, rec.len) < 0 ||
+				pwrite(outfd, buf, rec.len, rec.offset) !=
+							(ssize_t)rec.len)
+			goto out;
+	}
+
+	if (ftruncate(outfd, hdr.size) < 0 || fsync(outfd) < 0)
+		goto out;
+	if (unlink(name) < 0 || sync_dir(path) < 0)
+		goto out;
+	rc = 1;
+out:
+	save_errno(({
+		xfree(buf);
+		if (outfd >= 0)
+			close(outfd);
+		if (fd >= 0)
+			close(fd);
+		xfree(tmpname);
+		xfree(name);
+	}));
+	return rc;
+}
+
+/*
+ * Save everything signing pe in place can change: the headers up to the
+ * end of the data directory, the certificate table, and the file size.
+ */
+int
+journal_begin(const char *path, Pe *pe)
+{
+	char *name = journal_name(path, "");
+	char *tmpname = journal_name(path, ".tmp");
+	data_directory *dd = NULL;
+	size_t size;
+	int fd = -1;
+	int rc = -1;
+
+	if (!name || !tmpname)
+		goto out;
+
+	char *map = pe_rawfile(pe, &size);
+	if (!map || pe_getdatadir(pe, &dd) < 0)
+		goto out;
+
+	journal_record recs[2] = {
+		{ .offset = 0, .len = (char *)(dd + 1) - map },
+		{ .offset = dd->certs.virtual_address,
+		  .len = dd->certs.size },
+	};
+	journal_header hdr = {
+		.size = size,
+		.nrecords = 1,
+	};
+	memcpy(hdr.magic, JOURNAL_MAGIC, sizeof (hdr.magic));
+	if (dd->certs.virtual_address != 0 &&
+			recs[1].len <= size && recs[1].offset <= size - recs[1].len)
+		hdr.nrecords = 2;
+
+	fd = open(tmpname, O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC, 0600);
+	if (fd < 0)
+		goto out;
+
+	if (write_all(fd, &hdr, sizeof (hdr)) < 0)
+		goto out;
+	for (uint32_t i = 0; i < hdr.nrecords; i++) {
+		if (write_all(fd, &recs[i], sizeof (recs[i])) < 0 ||
+				write_all(fd, map + recs[i].offset,
+					  recs[i].len) < 0)
+			goto out;
+	}
+	if (fsync(fd) < 0)
+		goto out;
+
+	if (rename(tmpname, name) < 0 || sync_dir(path) < 0)
+		goto out;
+	rc = 0;
+out:
+	save_errno(({
+		if (fd >= 0)
+			close(fd);
+		if (rc < 0 && tmpname)
+			unlink(tmpname);
+		xfree(tmpname);
+		xfree(name);
+	}));
+	return rc;
+}
+
+/* The new signature is in place; make sure it's on disk, then forget the
+ * old one. */
+int
+journal_commit(const char *path, int fd)
+{
+	char *name = journal_name(path, "");
+	int rc = -1;
+
+	if (!name)
+		return -1;
+
+	if (fsync(fd) == 0 && unlink(name) == 0)
+		rc = sync_dir(path);
+
+	save_errno(free(name));
+	return rc;
+}
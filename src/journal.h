@@ -0,0 +1,33 @@
+/*
+ * Copyright 2026 agent <agent@local>
+ * All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 2 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Author(s): agent <agent@local>
+ */
+#ifndef JOURNAL_H
+#define JOURNAL_H 1
+
+/*
+ * An undo journal for signing a binary in place.  Before anything in the
+ * binary changes, journal_begin() saves its headers, its certificate
+ * table, and its size next to it; journal_commit() throws that away once
+ * the new signature is on disk.  If we die in between, journal_recover()
+ * puts the binary back the way it was.
+ */
+extern int journal_recover(const char *path);
+extern int journal_begin(const char *path, Pe *pe);
+extern int journal_commit(const char *path, int fd);
+
+#endif /* JOURNAL_H */
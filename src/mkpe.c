@@ -0,0 +1,373 @@
+/*
+ * Copyright 2026 agent <agent@local>
+ * All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 2 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Author(s): agent <agent@local>
+ */
+
+/*
+ * mkpe writes synthetic PE32 and PE32+ images for "make bench".  They
+ * aren't runnable, but their headers, section table, trailing data, and
+ * certificate table are laid out the way pesign expects, so every stage
+ * of hashing and signing can be timed against images of a known shape.
+ */
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <popt.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include <libdpe/pe.h>
+
+#include "endian.h"
+
+/* wincert.h needs NSS for its prototypes; mkpe only needs the header. */
+#define WIN_CERT_TYPE_PKCS_SIGNED_DATA	0x0002
+#define WIN_CERT_REVISION_2_0		0x0200
+
+typedef struct win_certificate {
+	uint32_t length;
+	uint16_t revision;
+	uint16_t cert_type;
+} win_certificate;
+
+#define FILE_ALIGN	0x200
+#define SECTION_ALIGN	0x1000
+#define N_DATA_DIRS	16
+
+#define align_up(x, a) (((x) + (a) - 1) & ~((typeof(x))(a) - 1))
+
+static uint64_t rng_state = 0x9e3779b97f4a7c15ull;
+
+static uint64_t
+rng(void)
+{
+	/* xorshift64*; we only want the section data to not be all one
+	 * byte, and to be the same every time. */
+	rng_state ^= rng_state >> 12;
+	rng_state ^= rng_state << 25;
+	rng_state ^= rng_state >> 27;
+	return rng_state * 0x2545f4914f6cdd1dull;
+}
+
+static size_t
+parse_size(const char *arg, const char *what)
+{
+	char *end = NULL;
+	unsigned long long val;
+
+	errno = 0;
+	val = strtoull(arg, &end, 0);
+	if (errno != 0 || end == arg)
+		errx(1, "invalid %s \"%s\"", what, arg);
+
+	switch (*end) {
+	case 'G': case 'g':
+		val <<= 10;
+		/* fall through */
+	case 'M': case 'm':
+		val <<= 10;
+		/* fall through */
+	case 'K': case 'k':
+		val <<= 10;
+		end++;
+		break;
+	default:
+		break;
+	}
+	if (*end != '\0')
+		errx(1, "invalid %s \"%s\"", what, arg);
+	return val;
+}
+
+static void
+write_all(int fd, const void *buf, size_t size, off_t offset)
+{
+	const char *p = buf;
+
+	while (size) {
+		ssize_t rc = pwrite(fd, p, size, offset);
+		if (rc < 0) {
+			if (errno == EINTR)
+				continue;
+			err(1, "could not write output");
+		}
+		p += rc;
+		size -= rc;
+		offset += rc;
+	}
+}
+
+static void
+write_random(int fd, size_t size, off_t offset)
+{
+	uint64_t buf[8192];
+
+	while (size) {
+		size_t n = size < sizeof (buf) ? size : sizeof (buf);
+		for (size_t i = 0; i < (n + 7) / 8; i++)
+			buf[i] = rng();
+		write_all(fd, buf, n, offset);
+		size -= n;
+		offset += n;
+	}
+}
+
+int
+main(int argc, char *argv[])
+{
+	char *outfile = NULL;
+	int pe32 = 0;
+	int unsorted = 0;
+	int nsections = 4;
+	int nsigs = 0;
+	char *section_size_str = "64K";
+	char *trailing_str = "0";
+	char *sig_size_str = "1500";
+	int rc;
+
+	poptContext optCon;
+	struct poptOption options[] = {
+		{.argInfo = POPT_ARG_INTL_DOMAIN,
+		 .arg = "pesign" },
+		{.longName = "out",
+		 .shortName = 'o',
+		 .argInfo = POPT_ARG_STRING,
+		 .arg = &outfile,
+		 .descrip = "specify output file",
+		 .argDescrip = "<outfile>" },
+		{.longName = "pe32",
+		 .argInfo = POPT_ARG_VAL,
+		 .arg = &pe32,
+		 .val = 1,
+		 .descrip = "write a PE32 image instead of PE32+" },
+		{.longName = "sections",
+		 .shortName = 's',
+		 .argInfo = POPT_ARG_INT|POPT_ARGFLAG_SHOW_DEFAULT,
+		 .arg = &nsections,
+		 .descrip = "number of sections",
+		 .argDescrip = "<count>" },
+		{.longName = "section-size",
+		 .shortName = 'S',
+		 .argInfo = POPT_ARG_STRING|POPT_ARGFLAG_SHOW_DEFAULT,
+		 .arg = &section_size_str,
+		 .descrip = "size of each section",
+		 .argDescrip = "<bytes>[KMG]" },
+		{.longName = "unsorted",
+		 .shortName = 'u',
+		 .argInfo = POPT_ARG_VAL,
+		 .arg = &unsorted,
+		 .val = 1,
+		 .descrip = "shuffle the section table so it's not in file "
+			    "order" },
+		{.longName = "trailing",
+		 .shortName = 't',
+		 .argInfo = POPT_ARG_STRING|POPT_ARGFLAG_SHOW_DEFAULT,
+		 .arg = &trailing_str,
+		 .descrip = "bytes of data after the last section",
+		 .argDescrip = "<bytes>[KMG]" },
+		{.longName = "signatures",
+		 .shortName = 'n',
+		 .argInfo = POPT_ARG_INT|POPT_ARGFLAG_SHOW_DEFAULT,
+		 .arg = &nsigs,
+		 .descrip = "number of entries in the certificate table",
+		 .argDescrip = "<count>" },
+		{.longName = "signature-size",
+		 .argInfo = POPT_ARG_STRING|POPT_ARGFLAG_SHOW_DEFAULT,
+		 .arg = &sig_size_str,
+		 .descrip = "size of each certificate table entry's data",
+		 .argDescrip = "<bytes>[KMG]" },
+		POPT_AUTOALIAS
+		POPT_AUTOHELP
+		POPT_TABLEEND
+	};
+
+	optCon = poptGetContext("mkpe", argc, (const char **)argv, options, 0);
+
+	while ((rc = poptGetNextOpt(optCon)) > 0)
+		;
+
+	if (rc < -1)
+		errx(1, "invalid argument: %s: %s",
+			poptBadOption(optCon, 0), poptStrerror(rc));
+
+	if (poptPeekArg(optCon))
+		errx(1, "invalid argument: \"%s\"", poptPeekArg(optCon));
+
+	poptFreeContext(optCon);
+
+	if (!outfile)
+		errx(1, "no output file specified");
+	if (nsections < 1 || nsections > 96)
+		errx(1, "section count must be between 1 and 96");
+	if (nsigs < 0)
+		errx(1, "invalid signature count");
+
+	size_t section_size = parse_size(section_size_str, "section size");
+	size_t trailing = parse_size(trailing_str, "trailing data size");
+	size_t sig_size = parse_size(sig_size_str, "signature size");
+	if (section_size == 0)
+		errx(1, "section size must not be zero");
+
+	/* headers: MZ, PE, optional header, data directories, sections */
+	size_t peaddr = sizeof (struct mz_hdr);
+	size_t opthdr_size = (pe32 ? sizeof (struct pe32_opt_hdr)
+				   : sizeof (struct pe32plus_opt_hdr)) +
+			     N_DATA_DIRS * sizeof (data_dirent);
+	size_t shdr_offset = peaddr + sizeof (struct pe_hdr) + opthdr_size;
+	size_t header_size = align_up(shdr_offset +
+			nsections * sizeof (struct section_header),
+			FILE_ALIGN);
+
+	size_t raw_size = align_up(section_size, FILE_ALIGN);
+	size_t image_end = header_size + nsections * raw_size;
+	if (image_end > UINT32_MAX)
+		errx(1, "image would be larger than 4GB");
+
+	size_t cert_offset = align_up(image_end + trailing, 8);
+	size_t cert_entry = align_up(sizeof (win_certificate) + sig_size, 8);
+	size_t cert_size = nsigs ? nsigs * cert_entry : 0;
+	size_t file_size = nsigs ? cert_offset + cert_size : image_end + trailing;
+
+	char *hdr = calloc(1, header_size);
+	if (!hdr)
+		err(1, "could not allocate headers");
+
+	struct mz_hdr *mz = (struct mz_hdr *)hdr;
+	mz->magic = cpu_to_le16(MZ_MAGIC);
+	mz->peaddr = cpu_to_le32(peaddr);
+
+	struct pe_hdr *pe = (struct pe_hdr *)(hdr + peaddr);
+	pe->magic = cpu_to_le32(PE_MAGIC);
+	pe->machine = cpu_to_le16(pe32 ? IMAGE_FILE_MACHINE_I386
+				       : IMAGE_FILE_MACHINE_AMD64);
+	pe->sections = cpu_to_le16(nsections);
+	pe->opt_hdr_size = cpu_to_le16(opthdr_size);
+	pe->flags = cpu_to_le16(IMAGE_FILE_EXECUTABLE_IMAGE |
+				IMAGE_FILE_DEBUG_STRIPPED |
+				(pe32 ? IMAGE_FILE_32BIT_MACHINE
+				      : IMAGE_FILE_LARGE_ADDRESS_AWARE));
+
+	uint32_t vsize = align_up(section_size, SECTION_ALIGN);
+	uint32_t image_size = SECTION_ALIGN + nsections * vsize;
+	data_directory *dd;
+	if (pe32) {
+		struct pe32_opt_hdr *opt = (struct pe32_opt_hdr *)(pe + 1);
+		opt->magic = cpu_to_le16(PE_OPT_MAGIC_PE32);
+		opt->entry_point = cpu_to_le32(SECTION_ALIGN);
+		opt->code_base = cpu_to_le32(SECTION_ALIGN);
+		opt->section_align = cpu_to_le32(SECTION_ALIGN);
+		opt->file_align = cpu_to_le32(FILE_ALIGN);
+		opt->image_size = cpu_to_le32(image_size);
+		opt->header_size = cpu_to_le32(header_size);
+		opt->subsys = cpu_to_le16(IMAGE_SUBSYSTEM_EFI_APPLICATION);
+		opt->data_dirs = cpu_to_le32(N_DATA_DIRS);
+		dd = (data_directory *)(opt + 1);
+	} else {
+		struct pe32plus_opt_hdr *opt =
+			(struct pe32plus_opt_hdr *)(pe + 1);
+		opt->magic = cpu_to_le16(PE_OPT_MAGIC_PE32PLUS);
+		opt->entry_point = cpu_to_le32(SECTION_ALIGN);
+		opt->code_base = cpu_to_le32(SECTION_ALIGN);
+		opt->section_align = cpu_to_le32(SECTION_ALIGN);
+		opt->file_align = cpu_to_le32(FILE_ALIGN);
+		opt->image_size = cpu_to_le32(image_size);
+		opt->header_size = cpu_to_le32(header_size);
+		opt->subsys = cpu_to_le16(IMAGE_SUBSYSTEM_EFI_APPLICATION);
+		opt->data_dirs = cpu_to_le32(N_DATA_DIRS);
+		dd = (data_directory *)(opt + 1);
+	}
+	if (nsigs) {
+		dd->certs.virtual_address = cpu_to_le32(cert_offset);
+		dd->certs.size = cpu_to_le32(cert_size);
+	}
+
+	/* The sections are always in the file in order; --unsorted only
+	 * changes the order they're listed in the section table. */
+	int *order = calloc(nsections, sizeof (*order));
+	if (!order)
+		err(1, "could not allocate section table");
+	for (int i = 0; i < nsections; i++)
+		order[i] = i;
+	if (unsorted) {
+		for (int i = nsections - 1; i > 0; i--) {
+			int j = rng() % (i + 1);
+			int tmp = order[i];
+			order[i] = order[j];
+			order[j] = tmp;
+		}
+	}
+
+	struct section_header *shdrs =
+		(struct section_header *)(hdr + shdr_offset);
+	for (int i = 0; i < nsections; i++) {
+		struct section_header *shdr = &shdrs[i];
+		int n = order[i];
+
+		snprintf(shdr->name, sizeof (shdr->name), ".s%d", n);
+		shdr->virtual_size = cpu_to_le32(section_size);
+		shdr->virtual_address = cpu_to_le32(SECTION_ALIGN + n * vsize);
+		shdr->raw_data_size = cpu_to_le32(raw_size);
+		shdr->data_addr = cpu_to_le32(header_size + n * raw_size);
+		shdr->flags = cpu_to_le32(n == 0
+			? IMAGE_SCN_CNT_CODE|IMAGE_SCN_MEM_EXECUTE|
+			  IMAGE_SCN_MEM_READ
+			: IMAGE_SCN_CNT_INITIALIZED_DATA|IMAGE_SCN_MEM_READ|
+			  IMAGE_SCN_MEM_WRITE);
+	}
+
+	int fd = open(outfile, O_RDWR|O_CREAT|O_TRUNC|O_CLOEXEC, 0644);
+	if (fd < 0)
+		err(1, "could not open \"%s\"", outfile);
+
+	write_all(fd, hdr, header_size, 0);
+	for (int i = 0; i < nsections; i++)
+		write_random(fd, raw_size, header_size + i * raw_size);
+	write_random(fd, trailing, image_end);
+
+	if (nsigs) {
+		char *entry = calloc(1, cert_entry);
+		if (!entry)
+			err(1, "could not allocate certificate table");
+
+		win_certificate *wc = (win_certificate *)entry;
+		wc->length = cpu_to_le32(sizeof (*wc) + sig_size);
+		wc->revision = cpu_to_le16(WIN_CERT_REVISION_2_0);
+		wc->cert_type = cpu_to_le16(WIN_CERT_TYPE_PKCS_SIGNED_DATA);
+		for (int i = 0; i < nsigs; i++) {
+			for (size_t j = 0; j < sig_size; j++)
+				entry[sizeof (*wc) + j] = rng();
+			write_all(fd, entry, cert_entry,
+				  cert_offset + i * cert_entry);
+		}
+		free(entry);
+	}
+
+	if (ftruncate(fd, file_size) < 0)
+		err(1, "could not set size of \"%s\"", outfile);
+	close(fd);
+
+	free(order);
+	free(hdr);
+	return 0;
+}
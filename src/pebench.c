@@ -0,0 +1,459 @@
+/*
+ * Copyright 2026 agent <agent@local>
+ * All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 2 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Author(s): agent <agent@local>
+ */
+
+/*
+ * pebench times the stages pesign goes through for each image it's given:
+ * loading it, parsing and writing its certificate table, hashing it, and
+ * (given a certificate) signing the result and verifying that signature
+ * again.  It's what "make bench" runs against the images mkpe makes.
+ */
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <popt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include <nss.h>
+#include <prerror.h>
+#include <pk11pub.h>
+#include <pkcs7t.h>
+#include <secpkcs7.h>
+
+#include "pesign.h"
+
+typedef enum {
+	STAGE_PE_BEGIN,
+	STAGE_PARSE,
+	STAGE_DIGEST,
+	STAGE_FINALIZE,
+	STAGE_SIGN,
+	STAGE_VERIFY,
+	N_STAGES
+} bench_stage;
+
+static const struct {
+	const char *name;
+	int throughput;
+} stages[N_STAGES] = {
+	[STAGE_PE_BEGIN] = { "pe_begin", 0 },
+	[STAGE_PARSE] = { "parse_signatures", 0 },
+	[STAGE_DIGEST] = { "generate_digest", 1 },
+	[STAGE_FINALIZE] = { "finalize_signatures", 0 },
+	[STAGE_SIGN] = { "sign", 1 },
+	[STAGE_VERIFY] = { "verify", 1 },
+};
+
+static double
+now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1000000000.0;
+}
+
+static int
+cmp_double(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static Pe *
+open_pe(const char *path, int *fdp, Pe_Cmd cmd)
+{
+	int flags = cmd == PE_C_READ_MMAP ? O_RDONLY : O_RDWR;
+	int fd = open(path, flags|O_CLOEXEC);
+	if (fd < 0)
+		err(1, "pebench: could not open \"%s\"", path);
+
+	Pe *pe = pe_begin(fd, cmd, NULL);
+	if (!pe)
+		errx(1, "pebench: could not load \"%s\": %s", path,
+			pe_errmsg(pe_errno()));
+	*fdp = fd;
+	return pe;
+}
+
+static void
+close_pe(Pe *pe, int fd)
+{
+	pe_end(pe);
+	close(fd);
+}
+
+/* Copies are made outside of the timed sections, so the stages that
+ * write an image aren't also timing the page cache. */
+static void
+copy_file(const char *from, const char *to)
+{
+	int infd = open(from, O_RDONLY|O_CLOEXEC);
+	if (infd < 0)
+		err(1, "pebench: could not open \"%s\"", from);
+
+	struct stat sb;
+	if (fstat(infd, &sb) < 0)
+		err(1, "pebench: could not stat \"%s\"", from);
+
+	int outfd = open(to, O_RDWR|O_CREAT|O_TRUNC|O_CLOEXEC, 0600);
+	if (outfd < 0)
+		err(1, "pebench: could not open \"%s\"", to);
+
+	void *addr = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, infd, 0);
+	if (addr == MAP_FAILED)
+		err(1, "pebench: could not map \"%s\"", from);
+
+	char *p = addr;
+	size_t left = sb.st_size;
+	while (left) {
+		ssize_t rc = write(outfd, p, left);
+		if (rc < 0) {
+			if (errno == EINTR)
+				continue;
+			err(1, "pebench: could not write \"%s\"", to);
+		}
+		p += rc;
+		left -= rc;
+	}
+
+	munmap(addr, sb.st_size);
+	close(outfd);
+	close(infd);
+}
+
+static double
+time_pe_begin(cms_context *cms __attribute__((__unused__)), const char *path,
+	      const char *tmp __attribute__((__unused__)))
+{
+	int fd = open(path, O_RDONLY|O_CLOEXEC);
+	if (fd < 0)
+		err(1, "pebench: could not open \"%s\"", path);
+
+	double start = now();
+	Pe *pe = pe_begin(fd, PE_C_READ_MMAP, NULL);
+	double end = now();
+
+	if (!pe)
+		errx(1, "pebench: could not load \"%s\": %s", path,
+			pe_errmsg(pe_errno()));
+	close_pe(pe, fd);
+	return end - start;
+}
+
+static double
+time_parse(cms_context *cms, const char *path,
+	   const char *tmp __attribute__((__unused__)))
+{
+	int fd;
+	Pe *pe = open_pe(path, &fd, PE_C_READ_MMAP);
+
+	double start = now();
+	int rc = parse_signatures(&cms->signatures, &cms->num_signatures, pe);
+	double end = now();
+
+	if (rc < 0)
+		errx(1, "pebench: could not parse signatures in \"%s\"", path);
+	close_pe(pe, fd);
+	cms_context_reset(cms);
+	return end - start;
+}
+
+/* Every round gets a new Pe, so the hash plan is never already cached. */
+static double
+time_digest(cms_context *cms, const char *path,
+	    const char *tmp __attribute__((__unused__)))
+{
+	int fd;
+	Pe *pe = open_pe(path, &fd, PE_C_READ_MMAP);
+
+	double start = now();
+	int rc = generate_digest(cms, pe, 1);
+	double end = now();
+
+	if (rc < 0)
+		errx(1, "pebench: could not generate digest for \"%s\"", path);
+	close_pe(pe, fd);
+	cms_context_reset(cms);
+	return end - start;
+}
+
+static double
+time_finalize(cms_context *cms, const char *path, const char *tmp)
+{
+	int fd;
+	Pe *pe = open_pe(path, &fd, PE_C_READ_MMAP);
+	int rc = parse_signatures(&cms->signatures, &cms->num_signatures, pe);
+	if (rc < 0)
+		errx(1, "pebench: could not parse signatures in \"%s\"", path);
+	close_pe(pe, fd);
+
+	copy_file(path, tmp);
+	pe = open_pe(tmp, &fd, PE_C_RDWR_MMAP);
+
+	double start = now();
+	rc = finalize_signatures(cms->signatures, cms->num_signatures, pe);
+	double end = now();
+
+	if (rc < 0)
+		errx(1, "pebench: could not write signatures to \"%s\"", tmp);
+	pe_update(pe, PE_C_RDWR_MMAP);
+	close_pe(pe, fd);
+	cms_context_reset(cms);
+	return end - start;
+}
+
+/* This is the same sequence "pesign -s" goes through once it has its
+ * output file, replacing any signatures the image already had. */
+static double
+time_sign(cms_context *cms, const char *path, const char *tmp)
+{
+	int fd;
+
+	copy_file(path, tmp);
+
+	double start = now();
+	Pe *pe = open_pe(tmp, &fd, PE_C_RDWR_MMAP);
+	pe_clearcert(pe);
+	if (reserve_cert_table(pe) < 0)
+		errx(1, "pebench: could not allocate space for signature: %s",
+			pe_errmsg(pe_errno()));
+	if (generate_digest(cms, pe, 1) < 0)
+		errx(1, "pebench: could not generate digest for \"%s\"", path);
+	if (generate_signature(cms) < 0)
+		errx(1, "pebench: could not generate signature for \"%s\"",
+			path);
+	insert_signature(cms, -1);
+	if (finalize_signatures(cms->signatures, cms->num_signatures, pe) < 0)
+		errx(1, "pebench: could not write signature to \"%s\"", tmp);
+	pe_update(pe, PE_C_RDWR_MMAP);
+	close_pe(pe, fd);
+	double end = now();
+
+	cms_context_reset(cms);
+	return end - start;
+}
+
+/* Verify the image the sign stage left behind the way pesigcheck does:
+ * hash it, and check that against the digest the last signature holds. */
+static double
+time_verify(cms_context *cms, const char *path __attribute__((__unused__)),
+	    const char *tmp)
+{
+	int fd;
+	int ok = 0;
+
+	double start = now();
+	Pe *pe = open_pe(tmp, &fd, PE_C_READ_MMAP);
+	if (parse_signatures(&cms->signatures, &cms->num_signatures, pe) < 0
+			|| cms->num_signatures == 0)
+		errx(1, "pebench: could not parse signatures in \"%s\"", tmp);
+	if (generate_digest(cms, pe, 1) < 0)
+		errx(1, "pebench: could not generate digest for \"%s\"", tmp);
+
+	SECItem *sig = cms->signatures[cms->num_signatures - 1];
+	SEC_PKCS7ContentInfo *cinfo;
+	cinfo = SEC_PKCS7DecodeItem(sig, NULL, NULL, NULL, NULL, NULL, NULL,
+				    NULL);
+	if (cinfo && SEC_PKCS7ContentIsSigned(cinfo)) {
+		SECItem *digest = cms->digests[cms->selected_digest].pe_digest;
+		SECItem *content =
+			cinfo->content.signedData->contentInfo.content.data;
+
+		ok = content && content->len >= digest->len &&
+		     !memcmp(content->data + content->len - digest->len,
+			     digest->data, digest->len);
+	}
+	if (cinfo)
+		SEC_PKCS7DestroyContentInfo(cinfo);
+	close_pe(pe, fd);
+	double end = now();
+
+	if (!ok)
+		errx(1, "pebench: signature on \"%s\" does not match", tmp);
+	cms_context_reset(cms);
+	return end - start;
+}
+
+static double (*stage_funcs[N_STAGES])(cms_context *, const char *,
+				       const char *) = {
+	[STAGE_PE_BEGIN] = time_pe_begin,
+	[STAGE_PARSE] = time_parse,
+	[STAGE_DIGEST] = time_digest,
+	[STAGE_FINALIZE] = time_finalize,
+	[STAGE_SIGN] = time_sign,
+	[STAGE_VERIFY] = time_verify,
+};
+
+static void
+bench_image(cms_context *cms, const char *path, const char *tmp, int rounds,
+	    int sign)
+{
+	struct stat sb;
+	double samples[rounds];
+
+	if (stat(path, &sb) < 0)
+		err(1, "pebench: could not stat \"%s\"", path);
+
+	for (int i = 0; i < N_STAGES; i++) {
+		if (!sign && (i == STAGE_SIGN || i == STAGE_VERIFY))
+			continue;
+
+		for (int j = 0; j < rounds; j++)
+			samples[j] = stage_funcs[i](cms, path, tmp);
+		qsort(samples, rounds, sizeof (samples[0]), cmp_double);
+
+		double median = samples[rounds / 2];
+		printf("%-40s %-20s %10.3f %10.3f", path, stages[i].name,
+			samples[0] * 1000.0, median * 1000.0);
+		if (stages[i].throughput && median > 0)
+			printf(" %10.1f", sb.st_size / median / 1048576.0);
+		printf("\n");
+		fflush(stdout);
+	}
+}
+
+int
+main(int argc, char *argv[])
+{
+	pesign_context *ctxp;
+	char *certdir = "/etc/pki/pesign";
+	char *tokenname = "NSS Certificate DB";
+	char *certname = NULL;
+	char *digest_name = "sha256";
+	int rounds = 5;
+	int rc;
+
+	poptContext optCon;
+	struct poptOption options[] = {
+		{.argInfo = POPT_ARG_INTL_DOMAIN,
+		 .arg = "pesign" },
+		{.longName = "certdir",
+		 .shortName = 'n',
+		 .argInfo = POPT_ARG_STRING|POPT_ARGFLAG_SHOW_DEFAULT,
+		 .arg = &certdir,
+		 .descrip = "specify nss certificate database directory",
+		 .argDescrip = "<certificate directory path>" },
+		{.longName = "certificate",
+		 .shortName = 'c',
+		 .argInfo = POPT_ARG_STRING,
+		 .arg = &certname,
+		 .descrip = "time signing and verification with this "
+			    "certificate",
+		 .argDescrip = "<certificate nickname>" },
+		{.longName = "token",
+		 .shortName = 't',
+		 .argInfo = POPT_ARG_STRING|POPT_ARGFLAG_SHOW_DEFAULT,
+		 .arg = &tokenname,
+		 .descrip = "NSS token holding signing key" },
+		{.longName = "digest_type",
+		 .shortName = 'd',
+		 .argInfo = POPT_ARG_STRING|POPT_ARGFLAG_SHOW_DEFAULT,
+		 .arg = &digest_name,
+		 .descrip = "digest type to use for signing" },
+		{.longName = "rounds",
+		 .shortName = 'r',
+		 .argInfo = POPT_ARG_INT|POPT_ARGFLAG_SHOW_DEFAULT,
+		 .arg = &rounds,
+		 .descrip = "number of times to run each stage",
+		 .argDescrip = "<count>" },
+		POPT_AUTOALIAS
+		POPT_AUTOHELP
+		POPT_TABLEEND
+	};
+
+	optCon = poptGetContext("pebench", argc, (const char **)argv,
+				options, 0);
+	poptSetOtherOptionHelp(optCon, "[OPTIONS...] <image>...");
+
+	while ((rc = poptGetNextOpt(optCon)) > 0)
+		;
+
+	if (rc < -1)
+		errx(1, "pebench: invalid argument: %s: %s",
+			poptBadOption(optCon, 0), poptStrerror(rc));
+
+	if (!poptPeekArg(optCon))
+		errx(1, "pebench: no images specified");
+	if (rounds < 1)
+		errx(1, "pebench: invalid round count %d", rounds);
+
+	SECStatus status = certname ? NSS_Init(certdir)
+				    : NSS_NoDB_Init(NULL);
+	if (status != SECSuccess)
+		errx(1, "pebench: could not initialize nss: %s",
+			PORT_ErrorToString(PORT_GetError()));
+
+	rc = pesign_context_new(&ctxp);
+	if (rc < 0)
+		err(1, "pebench: could not initialize context");
+	cms_context *cms = ctxp->cms_ctx;
+
+	if (register_oids(cms) != SECSuccess)
+		errx(1, "pebench: could not register OIDs");
+
+	if (set_digest_parameters(cms, digest_name) < 0)
+		errx(1, "pebench: digest \"%s\" not found", digest_name);
+
+	if (certname) {
+		cms->tokenname = PORT_ArenaStrdup(cms->arena, tokenname);
+		cms->certname = PORT_ArenaStrdup(cms->arena, certname);
+		if (!cms->tokenname || !cms->certname)
+			errx(1, "pebench: could not allocate memory");
+
+		if (find_certificate(cms, 1) < 0)
+			errx(1, "pebench: could not find certificate %s",
+				certname);
+		if (cache_signing_key(cms) < 0 ||
+				cache_certificate_list(cms) < 0)
+			errx(1, "pebench: could not load signing key for %s",
+				certname);
+	}
+
+	char tmp[] = "/tmp/pebench.XXXXXX";
+	int tmpfd = mkstemp(tmp);
+	if (tmpfd < 0)
+		err(1, "pebench: could not create temporary file");
+	close(tmpfd);
+
+	printf("%-40s %-20s %10s %10s %10s\n", "image", "stage", "min ms",
+		"median ms", "MB/s");
+
+	const char *path;
+	while ((path = poptGetArg(optCon)) != NULL)
+		bench_image(cms, path, tmp, rounds, certname != NULL);
+
+	unlink(tmp);
+	poptFreeContext(optCon);
+	pesign_context_free(ctxp);
+
+	status = NSS_Shutdown();
+	if (status != SECSuccess)
+		errx(1, "pebench: could not shut down NSS: %s",
+			PORT_ErrorToString(PORT_GetError()));
+	return 0;
+}
@@ -53,16 +53,20 @@ open_input(pesigcheck_context *ctx)
 	}
 
 	Pe_Cmd cmd = ctx->infd == STDIN_FILENO ? PE_C_READ : PE_C_READ_MMAP;
+	uint64_t start = timing_begin(ctx->cms_ctx);
 	ctx->inpe = pe_begin(ctx->infd, cmd, NULL);
+	timing_end(ctx->cms_ctx, TIMING_PE_BEGIN, start);
 	if (!ctx->inpe) {
 		fprintf(stderr, "pesigcheck: could not load input file: %s\n",
 			pe_errmsg(pe_errno()));
 		exit(1);
 	}
 
+	start = timing_begin(ctx->cms_ctx);
 	int rc = parse_signatures(&ctx->cms_ctx->signatures,
 					&ctx->cms_ctx->num_signatures,
 					ctx->inpe);
+	timing_end(ctx->cms_ctx, TIMING_PARSE_SIGNATURES, start);
 	if (rc < 0) {
 		fprintf(stderr, "pesigcheck: could not parse signature list in "
 			"EFI binary\n");
@@ -89,6 +93,35 @@ check_inputs(pesigcheck_context *ctx)
 	}
 }
 
+static SECOidTag
+signature_digest_oid(SEC_PKCS7ContentInfo *cinfo)
+{
+	SECAlgorithmID **algs = cinfo->content.signedData->digestAlgorithms;
+
+	if (!algs || !algs[0])
+		return SEC_OID_SHA256;
+	return SECOID_GetAlgorithmTag(algs[0]);
+}
+
+/* Only digest the binary with the algorithms its signatures use. */
+static void
+add_signature_digest_types(pesigcheck_context *ctx)
+{
+	cms_context *cms = ctx->cms_ctx;
+
+	for (int i = 0; i < cms->num_signatures; i++) {
+		SEC_PKCS7ContentInfo *cinfo;
+
+		cinfo = SEC_PKCS7DecodeItem(cms->signatures[i], NULL, NULL,
+					    NULL, NULL, NULL, NULL, NULL);
+		if (!cinfo)
+			continue;
+		if (SEC_PKCS7ContentIsSigned(cinfo))
+			digest_set_add(cms, signature_digest_oid(cinfo));
+		SEC_PKCS7DestroyContentInfo(cinfo);
+	}
+}
+
 static int
 cert_matches_digest(pesigcheck_context *ctx, void *data, ssize_t datalen,
 		    SECItem *digest_out)
@@ -109,7 +142,9 @@ cert_matches_digest(pesigcheck_context *ctx, void *data, ssize_t datalen,
 		goto out;
 
 	/* TODO Find out the digest type in spc_content */
-	pe_digest = ctx->cms_ctx->digests[0].pe_digest;
+	pe_digest = find_pe_digest(ctx->cms_ctx, signature_digest_oid(cinfo));
+	if (!pe_digest)
+		goto out;
 	content = cinfo->content.signedData->contentInfo.content.data;
 	digest = content->data + content->len - pe_digest->len;
 	if (digest_out) {
@@ -226,15 +261,6 @@ print_reason(struct reason *reason)
 	}
 }
 
-static void
-get_digest(pesigcheck_context *ctx, SECItem *digest)
-{
-	struct cms_context *cms = ctx->cms_ctx;
-	struct digest *cms_digest = &cms->digests[cms->selected_digest];
-
-	memcpy(digest, cms_digest->pe_digest, sizeof (*digest));
-}
-
 static int
 check_signature(pesigcheck_context *ctx, int *nreasons,
 		struct reason **reasons)
@@ -253,22 +279,23 @@ check_signature(pesigcheck_context *ctx, int *nreasons,
 	if (!reasonps)
 		err(1, "check_signature");
 
-	generate_digest(ctx->cms_ctx, ctx->inpe, 1);
+	add_signature_digest_types(ctx);
+	add_db_hash_types(ctx);
+	if (ctx->cms_ctx->digest_set)
+		generate_digest(ctx->cms_ctx, ctx->inpe, 1);
 
-	if (check_db_hash(DBX, ctx) == FOUND) {
-		reason = &reasonps[nreason];
+	reason = &reasonps[nreason];
+	if (check_db_hash(DBX, ctx, &reason->digest) == FOUND) {
 		reason->reason = BLACKLISTED;
 		reason->type = DIGEST;
-		get_digest(ctx, &reason->digest);
-		reason += 1;
+		nreason += 1;
 		is_invalid = true;
 	}
 
-	if (check_db_hash(DB, ctx) == FOUND) {
-		reason = &reasonps[nreason];
+	reason = &reasonps[nreason];
+	if (check_db_hash(DB, ctx, &reason->digest) == FOUND) {
 		reason->reason = WHITELISTED;
 		reason->type = DIGEST;
-		get_digest(ctx, &reason->digest);
 		nreason += 1;
 		has_valid_cert = true;
 	}
@@ -316,7 +343,7 @@ check_signature(pesigcheck_context *ctx, int *nreasons,
 			reason->type = SIGNATURE;
 			reason->sig.data = data;
 			reason->sig.len = datalen;
-			reason->type = siBuffer;
+			reason->sig.type = siBuffer;
 			nreason += 1;
 			is_invalid = true;
 		}
@@ -328,7 +355,7 @@ check_signature(pesigcheck_context *ctx, int *nreasons,
 			reason->type = SIGNATURE;
 			reason->sig.data = data;
 			reason->sig.len = datalen;
-			reason->type = siBuffer;
+			reason->sig.type = siBuffer;
 			nreason += 1;
 			has_valid_cert = true;
 		}
@@ -396,6 +423,7 @@ main(int argc, char *argv[])
 	char *dbxfile = NULL;
 	char *certfile = NULL;
 	int use_system_dbs = 1;
+	int timing = timing_requested();
 
 	SECStatus status;
 
@@ -459,6 +487,11 @@ main(int argc, char *argv[])
 		 .arg = &certfile,
 		 .descrip = "import certfile (in DER encoding) for allowed certificate",
 		 .argDescrip = "<certfile>" },
+		{.longName = "timing",
+		 .argInfo = POPT_ARG_VAL,
+		 .arg = &timing,
+		 .val = 1,
+		 .descrip = "report how long each phase of the check took" },
 		POPT_AUTOALIAS
 		POPT_AUTOHELP
 		POPT_TABLEEND
@@ -492,6 +525,9 @@ main(int argc, char *argv[])
 
 	poptFreeContext(optCon);
 
+	if (timing && timing_enable(ctxp->cms_ctx) < 0)
+		exit(1);
+
 	check_inputs(ctxp);
 	open_input(ctxp);
 
@@ -514,6 +550,7 @@ main(int argc, char *argv[])
 		printf("pesigcheck: \"%s\" is %s.\n", ctx.infile,
 			rc >= 0 ? "valid" : "invalid");
 	close_input(ctxp);
+	timing_print(ctxp->cms_ctx, stderr);
 	pesigcheck_context_fini(&ctx);
 
 	NSS_Shutdown();
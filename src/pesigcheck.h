@@ -34,6 +34,7 @@
 #include "content_info.h"
 #include "signer_info.h"
 #include "signed_data.h"
+#include "timing.h"
 #include "password.h"
 
 #endif /* PESIGN_H */
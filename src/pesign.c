@@ -19,7 +19,10 @@
 
 #include <err.h>
 #include <fcntl.h>
+#include <fts.h>
 #include <glob.h>
+#include <limits.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -50,7 +53,8 @@
 #define EXPORT_PUBKEY		0x400
 #define EXPORT_CERT		0x800
 #define DAEMONIZE		0x1000
-#define FLAG_LIST_END		0x2000
+#define BATCH			0x2000
+#define FLAG_LIST_END		0x4000
 
 static struct {
 	int flag;
@@ -68,6 +72,7 @@ static struct {
 	{EXPORT_CERT, "export-cert"},
 	{REMOVE_SIGNATURE, "remove"},
 	{LIST_SIGNATURES, "list"},
+	{BATCH, "batch"},
 	{FLAG_LIST_END, NULL},
 };
 
@@ -80,39 +85,57 @@ print_flag_name(FILE *f, int flag)
 	}
 }
 
-static void
-open_input(pesign_context *ctx)
+static int
+open_input_file(pesign_context *ctx)
 {
 	if (!ctx->infile) {
 		fprintf(stderr, "pesign: No input file specified.\n");
-		exit(1);
+		return -1;
 	}
 
 	struct stat statbuf;
 	ctx->infd = open(ctx->infile, O_RDONLY|O_CLOEXEC);
-	stat(ctx->infile, &statbuf);
-	ctx->outmode = statbuf.st_mode;
-
 	if (ctx->infd < 0) {
 		fprintf(stderr, "pesign: Error opening input: %m\n");
-		exit(1);
+		return -1;
 	}
 
+	fstat(ctx->infd, &statbuf);
+	ctx->outmode = statbuf.st_mode;
+
 	Pe_Cmd cmd = ctx->infd == STDIN_FILENO ? PE_C_READ : PE_C_READ_MMAP;
+	uint64_t start = timing_begin(ctx->cms_ctx);
 	ctx->inpe = pe_begin(ctx->infd, cmd, NULL);
+	timing_end(ctx->cms_ctx, TIMING_PE_BEGIN, start);
 	if (!ctx->inpe) {
 		fprintf(stderr, "pesign: could not load input file: %s\n",
 			pe_errmsg(pe_errno()));
-		exit(1);
+		goto err;
 	}
 
+	start = timing_begin(ctx->cms_ctx);
 	int rc = parse_signatures(&ctx->cms_ctx->signatures,
 				  &ctx->cms_ctx->num_signatures, ctx->inpe);
+	timing_end(ctx->cms_ctx, TIMING_PARSE_SIGNATURES, start);
 	if (rc < 0) {
 		fprintf(stderr, "pesign: could not parse signature list in "
 			"EFI binary\n");
-		exit(1);
+		pe_end(ctx->inpe);
+		ctx->inpe = NULL;
+		goto err;
 	}
+	return 0;
+err:
+	close(ctx->infd);
+	ctx->infd = -1;
+	return -1;
+}
+
+static void
+open_input(pesign_context *ctx)
+{
+	if (open_input_file(ctx) < 0)
+		exit(1);
 }
 
 static void
@@ -125,60 +148,180 @@ close_input(pesign_context *ctx)
 	ctx->infd = -1;
 }
 
-static void
+static int
 close_output(pesign_context *ctx)
 {
 	Pe_Cmd cmd = ctx->outfd == STDOUT_FILENO ? PE_C_RDWR : PE_C_RDWR_MMAP;
+	int rc = 0;
+
+	if (finalize_cms_signatures(ctx->cms_ctx, ctx->outpe) < 0) {
+		fprintf(stderr, "pesign: could not add signatures to "
+			"output file\n");
+		rc = -1;
+	}
 
-	finalize_signatures(ctx->cms_ctx->signatures,
-				ctx->cms_ctx->num_signatures, ctx->outpe);
-	pe_update(ctx->outpe, cmd);
+	update_cms_image(ctx->cms_ctx, ctx->outpe, cmd);
 	pe_end(ctx->outpe);
 	ctx->outpe = NULL;
 
+	if (ctx->inplace && rc == 0 &&
+			journal_commit(ctx->infile, ctx->outfd) < 0) {
+		fprintf(stderr, "pesign: could not write \"%s\": %m\n",
+			ctx->infile);
+		rc = -1;
+	}
+
 	close(ctx->outfd);
 	ctx->outfd = -1;
+
+	if (ctx->inplace && rc < 0 && journal_recover(ctx->infile) < 0)
+		fprintf(stderr, "pesign: could not restore \"%s\": %m\n",
+			ctx->infile);
+	return rc;
 }
 
-static void
-open_output(pesign_context *ctx)
+/*
+ * Sign ctx->infile without making a copy of it.  The signature is made
+ * before anything in the file changes, so what's left to do is rewrite
+ * the certificate table at the end of the file and the data directory
+ * entry that points at it, under the protection of a journal.
+ */
+static int
+sign_in_place(pesign_context *ctx)
+{
+	cms_context *cms = ctx->cms_ctx;
+	data_directory *dd = NULL;
+	size_t size;
+
+	int rc = journal_recover(ctx->infile);
+	if (rc < 0) {
+		fprintf(stderr, "pesign: could not restore \"%s\" after an "
+			"interrupted signing: %m\n", ctx->infile);
+		return -1;
+	}
+	if (rc > 0)
+		fprintf(stderr, "pesign: restored \"%s\" after an interrupted "
+			"signing\n", ctx->infile);
+
+	open_input(ctx);
+
+	/* a table anywhere else gets zeroed where it is, and that's part
+	 * of what's hashed */
+	if (!pe_rawfile(ctx->inpe, &size) ||
+			pe_getdatadir(ctx->inpe, &dd) < 0 ||
+			(dd->certs.virtual_address != 0 &&
+			 dd->certs.virtual_address + dd->certs.size != size)) {
+		fprintf(stderr, "pesign: \"%s\" can't be signed in place: "
+			"its certificate table isn't at the end of the file\n",
+			ctx->infile);
+		return -1;
+	}
+
+	if (ctx->signum > cms->num_signatures) {
+		fprintf(stderr, "Invalid signature number.\n");
+		return -1;
+	}
+
+	if (generate_digest(cms, ctx->inpe, 1) < 0 ||
+			generate_signature(cms) < 0) {
+		fprintf(stderr, "pesign: could not sign \"%s\"\n",
+			ctx->infile);
+		return -1;
+	}
+	insert_signature(cms, ctx->signum);
+	close_input(ctx);
+
+	ctx->outfd = open(ctx->infile, O_RDWR|O_CLOEXEC);
+	if (ctx->outfd < 0) {
+		fprintf(stderr, "pesign: Error opening output: %m\n");
+		return -1;
+	}
+
+	ctx->outpe = pe_begin(ctx->outfd, PE_C_RDWR_MMAP, NULL);
+	if (!ctx->outpe) {
+		fprintf(stderr, "pesign: could not load output file: %s\n",
+			pe_errmsg(pe_errno()));
+		close(ctx->outfd);
+		ctx->outfd = -1;
+		return -1;
+	}
+
+	if (journal_begin(ctx->infile, ctx->outpe) < 0) {
+		fprintf(stderr, "pesign: could not journal \"%s\": %m\n",
+			ctx->infile);
+		pe_end(ctx->outpe);
+		ctx->outpe = NULL;
+		close(ctx->outfd);
+		ctx->outfd = -1;
+		return -1;
+	}
+
+	pe_clearcert(ctx->outpe);
+	if (reserve_cert_table(ctx->outpe) < 0) {
+		fprintf(stderr, "pesign: Could not allocate space for "
+			"signature: %s\n", pe_errmsg(pe_errno()));
+		pe_end(ctx->outpe);
+		ctx->outpe = NULL;
+		close(ctx->outfd);
+		ctx->outfd = -1;
+		if (journal_recover(ctx->infile) < 0)
+			fprintf(stderr, "pesign: could not restore \"%s\": "
+				"%m\n", ctx->infile);
+		return -1;
+	}
+
+	return close_output(ctx);
+}
+
+static int
+open_output_file(pesign_context *ctx)
 {
 	if (!ctx->outfile) {
 		fprintf(stderr, "pesign: No output file specified.\n");
-		exit(1);
+		return -1;
 	}
 
 	if (access(ctx->outfile, F_OK) == 0 && ctx->force == 0) {
 		fprintf(stderr, "pesign: \"%s\" exists and --force was "
 				"not given.\n", ctx->outfile);
-		exit(1);
+		return -1;
 	}
 
 	ctx->outfd = open(ctx->outfile, O_RDWR|O_CREAT|O_TRUNC|O_CLOEXEC,
 			ctx->outmode);
 	if (ctx->outfd < 0) {
 		fprintf(stderr, "pesign: Error opening output: %m\n");
-		exit(1);
+		return -1;
 	}
 
-	size_t size;
-	char *addr;
-
-	addr = pe_rawfile(ctx->inpe, &size);
-
-	ftruncate(ctx->outfd, size);
-	lseek(ctx->outfd, 0, SEEK_SET);
-	write(ctx->outfd, addr, size);
+	if (pe_copyfile(ctx->inpe, ctx->outfd) < 0) {
+		fprintf(stderr, "pesign: could not write output file: %m\n");
+		close(ctx->outfd);
+		ctx->outfd = -1;
+		return -1;
+	}
 
 	Pe_Cmd cmd = ctx->outfd == STDOUT_FILENO ? PE_C_RDWR : PE_C_RDWR_MMAP;
+	uint64_t start = timing_begin(ctx->cms_ctx);
 	ctx->outpe = pe_begin(ctx->outfd, cmd, NULL);
+	timing_end(ctx->cms_ctx, TIMING_PE_BEGIN, start);
 	if (!ctx->outpe) {
 		fprintf(stderr, "pesign: could not load output file: %s\n",
 			pe_errmsg(pe_errno()));
-		exit(1);
+		close(ctx->outfd);
+		ctx->outfd = -1;
+		return -1;
 	}
 
 	pe_clearcert(ctx->outpe);
+	return 0;
+}
+
+static void
+open_output(pesign_context *ctx)
+{
+	if (open_output_file(ctx) < 0)
+		exit(1);
 }
 
 static void
@@ -371,8 +514,12 @@ check_inputs(pesign_context *ctx)
 	}
 
 	if (!strcmp(ctx->infile, ctx->outfile)) {
-		fprintf(stderr, "pesign: in-place file editing "
-				"is not yet supported\n");
+		if (ctx->sign)
+			fprintf(stderr, "pesign: use --in-place instead of "
+				"-o to sign \"%s\" in place\n", ctx->infile);
+		else
+			fprintf(stderr, "pesign: in-place file editing "
+				"is only supported when signing\n");
 		exit(1);
 	}
 }
@@ -395,6 +542,605 @@ print_digest(pesign_context *pctx)
 	printf("\n");
 }
 
+/*
+ * Sign one binary from a batch.  Unlike the single-file paths in main(),
+ * nothing here exits; problems are reported and the caller moves on to
+ * the next entry in the manifest.
+ */
+static int
+sign_batch_entry(pesign_context *ctx)
+{
+	int rc;
+
+	rc = open_input_file(ctx);
+	if (rc < 0)
+		return -1;
+
+	if (ctx->signum > ctx->cms_ctx->num_signatures) {
+		fprintf(stderr, "pesign: Invalid signature number %d.\n",
+			ctx->signum);
+		close_input(ctx);
+		return -1;
+	}
+
+	rc = open_output_file(ctx);
+	close_input(ctx);
+	if (rc < 0)
+		return -1;
+
+	rc = reserve_cert_table(ctx->outpe);
+	if (rc < 0) {
+		fprintf(stderr, "pesign: Could not allocate space for "
+			"signature: %s\n", pe_errmsg(pe_errno()));
+		goto err;
+	}
+
+	rc = generate_digest(ctx->cms_ctx, ctx->outpe, 1);
+	if (rc < 0) {
+		fprintf(stderr, "pesign: Could not generate digest\n");
+		goto err;
+	}
+
+	rc = generate_signature(ctx->cms_ctx);
+	if (rc < 0) {
+		fprintf(stderr, "pesign: Could not generate signature\n");
+		goto err;
+	}
+
+	insert_signature(ctx->cms_ctx, ctx->signum);
+	rc = close_output(ctx);
+	if (rc < 0) {
+		unlink(ctx->outfile);
+		return -1;
+	}
+	return 0;
+err:
+	pe_end(ctx->outpe);
+	ctx->outpe = NULL;
+	close(ctx->outfd);
+	ctx->outfd = -1;
+	unlink(ctx->outfile);
+	return -1;
+}
+
+struct batch_entry {
+	char *infile;
+	char *outfile;
+	int signum;
+	/* found by walking a directory rather than named explicitly */
+	int walked;
+
+	/* filled in when hashing, for --report */
+	Pe_Kind kind;
+	size_t size;
+	int sections;
+};
+
+enum {
+	REPORT_NONE = 0,
+	REPORT_TSV,
+	REPORT_JSON,
+};
+
+typedef struct {
+	int sign;
+	int padding;
+	int report;
+
+	struct batch_entry *entries;
+	int n_entries;
+	int n_alloc;
+
+	pthread_mutex_t lock;	/* protects everything below and stdout */
+	int next;
+	int failed;
+	int skipped;
+	int reported;
+} batch_state;
+
+/*
+ * Returns 1 if the file isn't a PE image but was only found by walking a
+ * directory, in which case it's just skipped.
+ */
+static int
+hash_batch_entry(pesign_context *ctx, int padding, struct batch_entry *entry)
+{
+	int rc = -1;
+
+	ctx->infd = open(ctx->infile, O_RDONLY|O_CLOEXEC);
+	if (ctx->infd < 0) {
+		fprintf(stderr, "pesign: Error opening \"%s\": %m\n",
+			ctx->infile);
+		return -1;
+	}
+
+	uint64_t start = timing_begin(ctx->cms_ctx);
+	ctx->inpe = pe_begin(ctx->infd, PE_C_READ_MMAP, NULL);
+	timing_end(ctx->cms_ctx, TIMING_PE_BEGIN, start);
+	if (!ctx->inpe) {
+		if (entry->walked) {
+			rc = 1;
+			goto out;
+		}
+		fprintf(stderr, "pesign: could not load \"%s\": %s\n",
+			ctx->infile, pe_errmsg(pe_errno()));
+		goto out;
+	}
+
+	entry->kind = pe_kind(ctx->inpe);
+	if (entry->kind != PE_K_PE_EXE && entry->kind != PE_K_PE64_EXE) {
+		if (entry->walked) {
+			rc = 1;
+			goto out;
+		}
+		fprintf(stderr, "pesign: \"%s\" is not a PE image\n",
+			ctx->infile);
+		goto out;
+	}
+
+	struct pe_hdr pehdr;
+	pe_rawfile(ctx->inpe, &entry->size);
+	if (pe_getpehdr(ctx->inpe, &pehdr))
+		entry->sections = le16_to_cpu(pehdr.sections);
+
+	rc = generate_digest(ctx->cms_ctx, ctx->inpe, padding);
+out:
+	if (ctx->inpe) {
+		pe_end(ctx->inpe);
+		ctx->inpe = NULL;
+	}
+	close(ctx->infd);
+	ctx->infd = -1;
+	return rc;
+}
+
+static struct batch_entry *
+add_batch_entry(batch_state *batch, const char *infile)
+{
+	if (batch->n_entries == batch->n_alloc) {
+		int n_alloc = batch->n_alloc ? batch->n_alloc * 2 : 64;
+		struct batch_entry *entries = realloc(batch->entries,
+					n_alloc * sizeof (*entries));
+		if (!entries)
+			goto oom;
+		batch->entries = entries;
+		batch->n_alloc = n_alloc;
+	}
+
+	struct batch_entry *entry = &batch->entries[batch->n_entries];
+	memset(entry, '\0', sizeof (*entry));
+	entry->signum = -1;
+	entry->infile = strdup(infile);
+	if (!entry->infile)
+		goto oom;
+	batch->n_entries++;
+	return entry;
+oom:
+	fprintf(stderr, "pesign: %m\n");
+	exit(1);
+}
+
+/*
+ * Queue up every regular file under path.  Anything too small to even
+ * have an MZ header isn't worth opening.
+ */
+static void
+walk_batch_dir(batch_state *batch, char *path)
+{
+	char *paths[] = { path, NULL };
+	FTS *fts;
+	FTSENT *ent;
+
+	fts = fts_open(paths, FTS_PHYSICAL|FTS_NOCHDIR, NULL);
+	if (!fts) {
+		fprintf(stderr, "pesign: Could not walk \"%s\": %m\n", path);
+		batch->failed++;
+		return;
+	}
+
+	while ((ent = fts_read(fts)) != NULL) {
+		switch (ent->fts_info) {
+		case FTS_F:
+			if (ent->fts_statp->st_size <
+					(off_t)sizeof (struct mz_hdr))
+				break;
+			add_batch_entry(batch, ent->fts_path)->walked = 1;
+			break;
+		case FTS_DNR:
+		case FTS_ERR:
+		case FTS_NS:
+			errno = ent->fts_errno;
+			fprintf(stderr, "pesign: Could not read \"%s\": %m\n",
+				ent->fts_path);
+			batch->failed++;
+			break;
+		default:
+			break;
+		}
+	}
+	fts_close(fts);
+}
+
+static int
+read_batch_manifest(batch_state *batch, char *manifest)
+{
+	FILE *f = stdin;
+	char *line = NULL;
+	size_t linesize = 0;
+	int lineno = 0;
+	struct stat statbuf;
+
+	if (!batch->sign && stat(manifest, &statbuf) == 0 &&
+			S_ISDIR(statbuf.st_mode)) {
+		walk_batch_dir(batch, manifest);
+		return 0;
+	}
+
+	if (strcmp(manifest, "-")) {
+		f = fopen(manifest, "r");
+		if (!f) {
+			fprintf(stderr, "pesign: Could not open \"%s\": %m\n",
+				manifest);
+			return -1;
+		}
+	}
+
+	while (getline(&line, &linesize, f) >= 0) {
+		char *saveptr = NULL;
+		char *infile, *outfile = NULL, *signum = NULL, *extra;
+
+		lineno++;
+		infile = strtok_r(line, " \t\r\n", &saveptr);
+		if (!infile || infile[0] == '#')
+			continue;
+		if (batch->sign) {
+			outfile = strtok_r(NULL, " \t\r\n", &saveptr);
+			signum = strtok_r(NULL, " \t\r\n", &saveptr);
+		}
+		extra = strtok_r(NULL, " \t\r\n", &saveptr);
+
+		if ((batch->sign && !outfile) || extra) {
+			fprintf(stderr, "pesign: %s:%d: expected \"%s\"\n",
+				manifest, lineno, batch->sign
+				? "<infile> <outfile> [<signature number>]"
+				: "<infile>");
+			goto bad_entry;
+		}
+
+		long num = -1;
+		if (signum) {
+			char *end = NULL;
+			errno = 0;
+			num = strtol(signum, &end, 0);
+			if (errno != 0 || *end != '\0' || num < 0 ||
+					num > INT_MAX) {
+				fprintf(stderr, "pesign: %s:%d: invalid "
+					"signature number \"%s\"\n",
+					manifest, lineno, signum);
+				goto bad_entry;
+			}
+		}
+
+		if (outfile && !strcmp(infile, outfile)) {
+			fprintf(stderr, "pesign: %s:%d: in-place file editing "
+				"is not yet supported\n", manifest, lineno);
+			goto bad_entry;
+		}
+
+		if (!batch->sign && stat(infile, &statbuf) == 0 &&
+				S_ISDIR(statbuf.st_mode)) {
+			walk_batch_dir(batch, infile);
+			continue;
+		}
+
+		struct batch_entry *entry = add_batch_entry(batch, infile);
+		entry->signum = num;
+		if (outfile) {
+			entry->outfile = strdup(outfile);
+			if (!entry->outfile) {
+				fprintf(stderr, "pesign: %m\n");
+				exit(1);
+			}
+		}
+		continue;
+bad_entry:
+		if (batch->sign)
+			printf("failed %s\n", infile);
+		batch->failed++;
+	}
+
+	free(line);
+	if (f != stdin)
+		fclose(f);
+	fflush(stdout);
+	return 0;
+}
+
+static void
+print_hex(FILE *f, SECItem *digest)
+{
+	for (unsigned int i = 0; digest && i < digest->len; i++)
+		fprintf(f, "%02x", (unsigned char)digest->data[i]);
+}
+
+static void
+print_tsv_string(FILE *f, const char *str)
+{
+	for (; *str; str++) {
+		switch (*str) {
+		case '\\': fputs("\\\\", f); break;
+		case '\t': fputs("\\t", f); break;
+		case '\n': fputs("\\n", f); break;
+		case '\r': fputs("\\r", f); break;
+		default: fputc(*str, f); break;
+		}
+	}
+}
+
+static void
+print_json_string(FILE *f, const char *str)
+{
+	fputc('"', f);
+	for (; *str; str++) {
+		switch (*str) {
+		case '"': fputs("\\\"", f); break;
+		case '\\': fputs("\\\\", f); break;
+		case '\n': fputs("\\n", f); break;
+		case '\r': fputs("\\r", f); break;
+		case '\t': fputs("\\t", f); break;
+		default:
+			if ((unsigned char)*str < 0x20)
+				fprintf(f, "\\u%04x", (unsigned char)*str);
+			else
+				fputc(*str, f);
+			break;
+		}
+	}
+	fputc('"', f);
+}
+
+static void
+print_report_header(batch_state *batch)
+{
+	if (batch->report == REPORT_TSV)
+		printf("path\tkind\tsize\tsections\tsha1\tsha256\n");
+	else
+		printf("[");
+}
+
+static void
+print_report_footer(batch_state *batch)
+{
+	if (batch->report == REPORT_JSON)
+		printf("%s]\n", batch->reported ? "\n" : "");
+}
+
+/* Called with batch->lock held. */
+static void
+print_report_entry(batch_state *batch, struct batch_entry *entry,
+		   cms_context *cms)
+{
+	const char *kind = entry->kind == PE_K_PE64_EXE ? "pe32+" : "pe32";
+	SECItem *sha1 = find_pe_digest(cms, SEC_OID_SHA1);
+	SECItem *sha256 = find_pe_digest(cms, SEC_OID_SHA256);
+
+	if (batch->report == REPORT_TSV) {
+		print_tsv_string(stdout, entry->infile);
+		printf("\t%s\t%zu\t%d\t", kind, entry->size, entry->sections);
+		print_hex(stdout, sha1);
+		printf("\t");
+		print_hex(stdout, sha256);
+		printf("\n");
+	} else {
+		printf("%s\n  {\"path\": ", batch->reported ? "," : "");
+		print_json_string(stdout, entry->infile);
+		printf(", \"kind\": \"%s\", \"size\": %zu, \"sections\": %d, "
+			"\"sha1\": \"", kind, entry->size, entry->sections);
+		print_hex(stdout, sha1);
+		printf("\", \"sha256\": \"");
+		print_hex(stdout, sha256);
+		printf("\"}");
+	}
+	batch->reported++;
+}
+
+/*
+ * Take entries off the batch until there are none left.  This is run by
+ * every worker, each with its own context; with one job it's just run
+ * on main()'s context.
+ */
+static void
+run_batch(batch_state *batch, pesign_context *ctx)
+{
+	while (1) {
+		pthread_mutex_lock(&batch->lock);
+		int i = batch->next++;
+		pthread_mutex_unlock(&batch->lock);
+		if (i >= batch->n_entries)
+			break;
+
+		struct batch_entry *entry = &batch->entries[i];
+		ctx->infile = entry->infile;
+		ctx->outfile = entry->outfile;
+		ctx->signum = entry->signum;
+
+		void *mark = PORT_ArenaMark(ctx->cms_ctx->arena);
+		int rc;
+		if (batch->sign)
+			rc = sign_batch_entry(ctx);
+		else
+			rc = hash_batch_entry(ctx, batch->padding, entry);
+
+		pthread_mutex_lock(&batch->lock);
+		if (batch->sign)
+			printf("%s %s\n", rc < 0 ? "failed" : "signed",
+				entry->infile);
+		else if (rc < 0)
+			fprintf(stderr, "pesign: could not hash \"%s\"\n",
+				entry->infile);
+		else if (rc > 0)
+			batch->skipped++;
+		else if (batch->report)
+			print_report_entry(batch, entry, ctx->cms_ctx);
+		else
+			print_digest(ctx);
+		fflush(stdout);
+		if (rc < 0)
+			batch->failed++;
+		pthread_mutex_unlock(&batch->lock);
+
+		cms_context_reset(ctx->cms_ctx);
+		PORT_ArenaRelease(ctx->cms_ctx->arena, mark);
+		ctx->infile = NULL;
+		ctx->outfile = NULL;
+	}
+}
+
+struct batch_worker {
+	batch_state *batch;
+	pesign_context *ctx;
+	pthread_t thread;
+};
+
+static void *
+batch_thread(void *arg)
+{
+	struct batch_worker *worker = arg;
+
+	run_batch(worker->batch, worker->ctx);
+	return NULL;
+}
+
+/*
+ * Sign or hash every binary listed in manifest, using jobs threads.
+ * For signing, each non-blank, non-comment line is
+ *	<infile> <outfile> [<signature number>]
+ * and we print one status line per entry on stdout.  For hashing each
+ * line is just <infile>, or a directory to search for PE images, and we
+ * print the digests like --hash does, or as a TSV or JSON report.
+ * manifest itself may also be a directory when hashing.
+ *
+ * Everything that depends only on the certificate has been looked up
+ * once by the time the workers start, and the private key operations
+ * of all the workers go through one token thread.
+ */
+static int
+run_batch_manifest(pesign_context *ctx, char *manifest, int sign,
+		   int padding, int report, int jobs)
+{
+	batch_state batch = {
+		.sign = sign,
+		.padding = padding,
+		.report = report,
+	};
+	int total;
+
+	if (read_batch_manifest(&batch, manifest) < 0)
+		return -1;
+	total = batch.n_entries + batch.failed;
+
+	if (report) {
+		if (digest_set_add(ctx->cms_ctx, SEC_OID_SHA1) < 0 ||
+				digest_set_add(ctx->cms_ctx,
+					       SEC_OID_SHA256) < 0) {
+			fprintf(stderr, "pesign: Could not set up digests\n");
+			exit(1);
+		}
+		print_report_header(&batch);
+	}
+
+	/* Do this before any of the per-binary allocations, so that
+	 * resetting the arena between binaries leaves it in place. */
+	if (sign && (cache_signing_key(ctx->cms_ctx) < 0 ||
+			cache_certificate_list(ctx->cms_ctx) < 0)) {
+		fprintf(stderr, "pesign: Could not set up certificate %s\n",
+			ctx->cms_ctx->certname);
+		exit(1);
+	}
+
+	if (jobs > batch.n_entries)
+		jobs = batch.n_entries;
+
+	pthread_mutex_init(&batch.lock, NULL);
+	if (jobs <= 1) {
+		run_batch(&batch, ctx);
+	} else {
+		sign_queue *sq = NULL;
+		struct batch_worker *workers = calloc(jobs, sizeof (*workers));
+		if (!workers) {
+			fprintf(stderr, "pesign: %m\n");
+			exit(1);
+		}
+
+		if (sign) {
+			if (sign_queue_new(&sq, jobs, 1) < 0) {
+				fprintf(stderr, "pesign: Could not start "
+					"signing thread: %m\n");
+				exit(1);
+			}
+			ctx->cms_ctx->sign_queue = sq;
+		}
+
+		for (int i = 0; i < jobs; i++) {
+			struct batch_worker *worker = &workers[i];
+
+			worker->batch = &batch;
+			if (pesign_context_new(&worker->ctx) < 0 ||
+					cms_context_share_signer(
+						worker->ctx->cms_ctx,
+						ctx->cms_ctx) < 0) {
+				fprintf(stderr, "pesign: Could not initialize "
+					"worker context\n");
+				exit(1);
+			}
+			worker->ctx->force = ctx->force;
+			worker->ctx->verbose = ctx->verbose;
+			if (ctx->cms_ctx->timing &&
+					timing_enable(worker->ctx->cms_ctx) < 0)
+				exit(1);
+
+			int rc = pthread_create(&worker->thread, NULL,
+						batch_thread, worker);
+			if (rc != 0) {
+				errno = rc;
+				fprintf(stderr, "pesign: Could not start "
+					"worker thread: %m\n");
+				exit(1);
+			}
+		}
+
+		for (int i = 0; i < jobs; i++) {
+			pthread_join(workers[i].thread, NULL);
+			timing_merge(ctx->cms_ctx, workers[i].ctx->cms_ctx);
+			pesign_context_free(workers[i].ctx);
+		}
+
+		if (sq) {
+			ctx->cms_ctx->sign_queue = NULL;
+			sign_queue_free(sq);
+		}
+		free(workers);
+	}
+	pthread_mutex_destroy(&batch.lock);
+
+	if (report)
+		print_report_footer(&batch);
+	total -= batch.skipped;
+
+	for (int i = 0; i < batch.n_entries; i++) {
+		free(batch.entries[i].infile);
+		free(batch.entries[i].outfile);
+	}
+	free(batch.entries);
+
+	if (batch.failed) {
+		fprintf(stderr, "pesign: %d of %d binaries could not be %s\n",
+			batch.failed, total, sign ? "signed" : "hashed");
+		return -1;
+	}
+	return 0;
+}
+
 int
 main(int argc, char *argv[])
 {
@@ -408,6 +1154,7 @@ main(int argc, char *argv[])
 	int fork = 1;
 	int padding = 0;
 	int need_db = 0;
+	int timing = timing_requested();
 
 	char *digest_name = "sha256";
 	char *tokenname = "NSS Certificate DB";
@@ -415,6 +1162,15 @@ main(int argc, char *argv[])
 	char *certname = NULL;
 	char *certdir = "/etc/pki/pesign";
 	char *signum = NULL;
+	char *batch = NULL;
+	int jobs = 0;
+	int max_in_flight = 0;
+	int queue_timeout = 60;
+	char *uid_weights = NULL;
+	char *token_threads = NULL;
+	char *daemon_config = NULL;
+	char *report_name = NULL;
+	int report = REPORT_NONE;
 
 	setenv("NSS_DEFAULT_DB_TYPE", "sql", 0);
 
@@ -458,6 +1214,11 @@ main(int argc, char *argv[])
 		 .arg = &ctxp->force,
 		 .val = 1,
 		 .descrip = "force overwriting of output file" },
+		{.longName = "in-place",
+		 .argInfo = POPT_ARG_VAL,
+		 .arg = &ctxp->inplace,
+		 .val = 1,
+		 .descrip = "sign the input file instead of writing a new one" },
 		{.longName = "sign",
 		 .shortName = 's',
 		 .argInfo = POPT_ARG_VAL,
@@ -498,6 +1259,56 @@ main(int argc, char *argv[])
 		 .arg = &ctxp->rawsig,
 		 .descrip = "import raw signature from file",
 		 .argDescrip = "<inraw>" },
+		{.longName = "batch",
+		 .shortName = 'B',
+		 .argInfo = POPT_ARG_STRING,
+		 .arg = &batch,
+		 .descrip = "sign or hash every binary listed in a manifest",
+		 .argDescrip = "<manifest>" },
+		{.longName = "jobs",
+		 .shortName = 'j',
+		 .argInfo = POPT_ARG_INT,
+		 .arg = &jobs,
+		 .descrip = "number of binaries to process at once with "
+			    "--batch, or of worker threads with --daemonize",
+		 .argDescrip = "<jobs>" },
+		{.longName = "max-in-flight",
+		 .argInfo = POPT_ARG_INT,
+		 .arg = &max_in_flight,
+		 .descrip = "with --daemonize, how many requests may be queued "
+			    "or running at once",
+		 .argDescrip = "<requests>" },
+		{.longName = "queue-timeout",
+		 .argInfo = POPT_ARG_INT|POPT_ARGFLAG_SHOW_DEFAULT,
+		 .arg = &queue_timeout,
+		 .descrip = "with --daemonize, how long a signing request may "
+			    "wait for a worker",
+		 .argDescrip = "<seconds>" },
+		{.longName = "uid-weights",
+		 .argInfo = POPT_ARG_STRING,
+		 .arg = &uid_weights,
+		 .descrip = "with --daemonize, give these users a bigger or "
+			    "smaller share of the workers",
+		 .argDescrip = "<user:weight,...>" },
+		{.longName = "token-threads",
+		 .argInfo = POPT_ARG_STRING,
+		 .arg = &token_threads,
+		 .descrip = "with --daemonize, how many signatures each of "
+			    "these tokens may make at once",
+		 .argDescrip = "<token:threads,...>" },
+		{.longName = "daemon-config",
+		 .argInfo = POPT_ARG_STRING,
+		 .arg = &daemon_config,
+		 .descrip = "with --daemonize, unlock the tokens and look up "
+			    "the keys listed in this file at start-up (default "
+			    DAEMON_CONFIG ")",
+		 .argDescrip = "<file>" },
+		{.longName = "report",
+		 .argInfo = POPT_ARG_STRING,
+		 .arg = &report_name,
+		 .descrip = "with --hash --batch, write a report of every PE "
+			    "image's size, sections, and digests",
+		 .argDescrip = "<tsv|json>" },
 		{.longName = "signature-number",
 		 .shortName = 'u',
 		 .argInfo = POPT_ARG_STRING,
@@ -573,6 +1384,11 @@ main(int argc, char *argv[])
 		 .arg = &padding,
 		 .val = 1,
 		 .descrip = "pad data section" },
+		{.longName = "timing",
+		 .argInfo = POPT_ARG_VAL,
+		 .arg = &timing,
+		 .val = 1,
+		 .descrip = "report how long each phase of the work took" },
 		POPT_AUTOALIAS
 		POPT_AUTOHELP
 		POPT_TABLEEND
@@ -660,6 +1476,85 @@ main(int argc, char *argv[])
 	if (ctxp->hash)
 		action |= GENERATE_DIGEST|PRINT_DIGEST;
 
+	if (ctxp->inplace && (!ctxp->sign || ctxp->outfile || ctxp->outsig ||
+			      batch)) {
+		fprintf(stderr, "pesign: --in-place can only be used with "
+			"--sign and --in\n");
+		exit(1);
+	}
+
+	if (batch) {
+		action |= BATCH;
+		if (ctxp->infile || ctxp->outfile) {
+			fprintf(stderr, "pesign: --batch cannot be used with "
+				"--in or --out\n");
+			exit(1);
+		}
+	}
+
+	if (jobs < 0) {
+		fprintf(stderr, "pesign: invalid number of jobs: %d\n", jobs);
+		exit(1);
+	}
+	if (jobs == 0) {
+		jobs = 1;
+		if (daemon) {
+			long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+			if (ncpus > 1)
+				jobs = ncpus;
+		}
+	}
+
+	if (max_in_flight < 0) {
+		fprintf(stderr, "pesign: invalid number of requests: %d\n",
+			max_in_flight);
+		exit(1);
+	}
+	if (max_in_flight == 0)
+		max_in_flight = jobs * 4;
+
+	if (queue_timeout < 0) {
+		fprintf(stderr, "pesign: invalid queue timeout: %d\n",
+			queue_timeout);
+		exit(1);
+	}
+
+	daemon_options dopts = {
+		.nworkers = jobs,
+		.max_in_flight = max_in_flight,
+		.queue_timeout = queue_timeout,
+	};
+	if (uid_weights && parse_uid_weights(&dopts, uid_weights) < 0)
+		exit(1);
+	if (token_threads && parse_token_threads(&dopts, token_threads) < 0)
+		exit(1);
+	if (daemon && parse_daemon_config(&dopts,
+			daemon_config ? daemon_config : DAEMON_CONFIG,
+			daemon_config != NULL) < 0)
+		exit(1);
+
+	if (timing && timing_enable(ctxp->cms_ctx) < 0)
+		exit(1);
+
+	if (report_name) {
+		if (!strcmp(report_name, "tsv")) {
+			report = REPORT_TSV;
+		} else if (!strcmp(report_name, "json")) {
+			report = REPORT_JSON;
+		} else {
+			fprintf(stderr, "pesign: unknown report format "
+				"\"%s\"\n", report_name);
+			exit(1);
+		}
+		free(report_name);
+
+		if (!batch || !ctxp->hash) {
+			fprintf(stderr, "pesign: --report requires --hash and "
+				"--batch\n");
+			exit(1);
+		}
+	}
+
 	if (!daemon) {
 		SECStatus status;
 		int error;
@@ -765,10 +1660,14 @@ main(int argc, char *argv[])
 			open_input(ctxp);
 			open_output(ctxp);
 			close_input(ctxp);
+			rc = reserve_cert_table(ctxp->outpe);
+			if (rc < 0) {
+				fprintf(stderr, "pesign: Could not allocate "
+					"space for signature: %s\n",
+					pe_errmsg(pe_errno()));
+				exit(1);
+			}
 			generate_digest(ctxp->cms_ctx, ctxp->outpe, 1);
-			sigspace = calculate_signature_space(ctxp->cms_ctx,
-								ctxp->outpe);
-			allocate_signature_space(ctxp->outpe, sigspace);
 			generate_signature(ctxp->cms_ctx);
 			insert_signature(ctxp->cms_ctx, ctxp->signum);
 			close_output(ctxp);
@@ -892,7 +1791,8 @@ main(int argc, char *argv[])
 			break;
 		/* generate a signature and embed it in the binary */
 		case IMPORT_SIGNATURE|GENERATE_SIGNATURE:
-			check_inputs(ctxp);
+			if (!ctxp->inplace)
+				check_inputs(ctxp);
 			rc = find_certificate(ctxp->cms_ctx, 1);
 			if (rc < 0) {
 				fprintf(stderr, "pesign: Could not find "
@@ -900,6 +1800,15 @@ main(int argc, char *argv[])
 					ctxp->cms_ctx->certname);
 				exit(1);
 			}
+			if (ctxp->inplace) {
+				if (!ctxp->infile) {
+					fprintf(stderr, "pesign: No input file "
+						"specified.\n");
+					exit(1);
+				}
+				rc = sign_in_place(ctxp);
+				break;
+			}
 			if (ctxp->signum > ctxp->cms_ctx->num_signatures + 1) {
 				fprintf(stderr, "Invalid signature number.\n");
 				exit(1);
@@ -907,17 +1816,39 @@ main(int argc, char *argv[])
 			open_input(ctxp);
 			open_output(ctxp);
 			close_input(ctxp);
-			generate_digest(ctxp->cms_ctx, ctxp->outpe, 1);
-			sigspace = calculate_signature_space(ctxp->cms_ctx,
-							     ctxp->outpe);
-			allocate_signature_space(ctxp->outpe, sigspace);
+			rc = reserve_cert_table(ctxp->outpe);
+			if (rc < 0) {
+				fprintf(stderr, "pesign: Could not allocate "
+					"space for signature: %s\n",
+					pe_errmsg(pe_errno()));
+				exit(1);
+			}
 			generate_digest(ctxp->cms_ctx, ctxp->outpe, 1);
 			generate_signature(ctxp->cms_ctx);
 			insert_signature(ctxp->cms_ctx, ctxp->signum);
 			close_output(ctxp);
 			break;
+		/* sign every binary in a manifest with one certificate */
+		case BATCH|IMPORT_SIGNATURE|GENERATE_SIGNATURE:
+			rc = find_certificate(ctxp->cms_ctx, 1);
+			if (rc < 0) {
+				fprintf(stderr, "pesign: Could not find "
+					"certificate %s\n",
+					ctxp->cms_ctx->certname);
+				exit(1);
+			}
+			rc = run_batch_manifest(ctxp, batch, 1, 1,
+						REPORT_NONE, jobs);
+			free(batch);
+			break;
+		/* hash every binary in a manifest */
+		case BATCH|GENERATE_DIGEST|PRINT_DIGEST:
+			rc = run_batch_manifest(ctxp, batch, 0, padding,
+						report, jobs);
+			free(batch);
+			break;
 		case DAEMONIZE:
-			rc = daemonize(ctxp->cms_ctx, certdir, fork);
+			rc = daemonize(ctxp->cms_ctx, certdir, fork, &dopts);
 			break;
 		default:
 			fprintf(stderr, "Incompatible flags (0x%08x): ", action);
@@ -928,6 +1859,8 @@ main(int argc, char *argv[])
 			fprintf(stderr, "\n");
 			exit(1);
 	}
+	if (!daemon)
+		timing_print(ctxp->cms_ctx, stderr);
 	pesign_context_free(ctxp);
 
 	if (!daemon) {
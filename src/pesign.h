@@ -35,6 +35,9 @@
 #include "content_info.h"
 #include "signer_info.h"
 #include "signed_data.h"
+#include "sign_queue.h"
+#include "timing.h"
+#include "journal.h"
 #include "password.h"
 
 #endif /* PESIGN_H */
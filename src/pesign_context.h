@@ -67,6 +67,7 @@ typedef struct {
 	int ascii;
 	int sign;
 	int hash;
+	int inplace;
 } pesign_context;
 
 extern int pesign_context_new(pesign_context **ctx);
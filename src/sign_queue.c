@@ -0,0 +1,261 @@
+/*
+ * Copyright 2026 agent <agent@local>
+ * All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 2 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Author(s): agent <agent@local>
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <cryptohi.h>
+#include <secerr.h>
+
+#include "sign_queue.h"
+
+struct sign_request {
+	SECItem *result;
+	const unsigned char *buf;
+	int len;
+	SECKEYPrivateKey *pk;
+	SECOidTag algid;
+
+	SECStatus status;
+	int error;
+	int done;
+	sign_queue_callback callback;	/* sign_queue_submit() only */
+	void *arg;
+
+	struct sign_request *next;
+};
+
+struct sign_queue {
+	pthread_mutex_t lock;
+	pthread_cond_t work;	/* a request was queued, or we're stopping */
+	pthread_cond_t space;	/* a request left the queue */
+	pthread_cond_t done;	/* a request was signed */
+
+	struct sign_request *head;
+	struct sign_request *tail;
+	int pending;
+	int max_pending;
+	int stopping;
+
+	int nthreads;
+	pthread_t *threads;
+};
+
+static void *
+sign_queue_thread(void *arg)
+{
+	sign_queue *sq = arg;
+
+	pthread_mutex_lock(&sq->lock);
+	while (1) {
+		while (!sq->head && !sq->stopping)
+			pthread_cond_wait(&sq->work, &sq->lock);
+		if (!sq->head)
+			break;
+
+		struct sign_request *req = sq->head;
+		sq->head = req->next;
+		if (!sq->head)
+			sq->tail = NULL;
+		sq->pending--;
+		pthread_cond_signal(&sq->space);
+		pthread_mutex_unlock(&sq->lock);
+
+		req->status = SEC_SignData(req->result, req->buf, req->len,
+					   req->pk, req->algid);
+		req->error = req->status == SECSuccess ? 0 : PORT_GetError();
+
+		if (req->callback) {
+			req->callback(req->status, req->error, req->arg);
+			free(req);
+			pthread_mutex_lock(&sq->lock);
+			continue;
+		}
+
+		pthread_mutex_lock(&sq->lock);
+		req->done = 1;
+		pthread_cond_broadcast(&sq->done);
+	}
+	pthread_mutex_unlock(&sq->lock);
+	return NULL;
+}
+
+void
+sign_queue_free(sign_queue *sq)
+{
+	if (!sq)
+		return;
+
+	pthread_mutex_lock(&sq->lock);
+	sq->stopping = 1;
+	pthread_cond_broadcast(&sq->work);
+	pthread_mutex_unlock(&sq->lock);
+
+	for (int i = 0; i < sq->nthreads; i++)
+		pthread_join(sq->threads[i], NULL);
+
+	pthread_cond_destroy(&sq->done);
+	pthread_cond_destroy(&sq->space);
+	pthread_cond_destroy(&sq->work);
+	pthread_mutex_destroy(&sq->lock);
+	free(sq->threads);
+	free(sq);
+}
+
+/*
+ * max_pending bounds how many requests may wait for the token at once;
+ * submitters block beyond that.  nthreads is how many sessions we keep
+ * busy on the token.
+ */
+int
+sign_queue_new(sign_queue **sqp, int max_pending, int nthreads)
+{
+	if (max_pending < 1 || nthreads < 1) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	sign_queue *sq = calloc(1, sizeof (*sq));
+	if (!sq)
+		return -1;
+
+	sq->threads = calloc(nthreads, sizeof (pthread_t));
+	if (!sq->threads) {
+		free(sq);
+		return -1;
+	}
+
+	pthread_mutex_init(&sq->lock, NULL);
+	pthread_cond_init(&sq->work, NULL);
+	pthread_cond_init(&sq->space, NULL);
+	pthread_cond_init(&sq->done, NULL);
+	sq->max_pending = max_pending;
+
+	for (int i = 0; i < nthreads; i++) {
+		int rc = pthread_create(&sq->threads[i], NULL,
+					sign_queue_thread, sq);
+		if (rc != 0) {
+			sign_queue_free(sq);
+			errno = rc;
+			return -1;
+		}
+		sq->nthreads++;
+	}
+
+	*sqp = sq;
+	return 0;
+}
+
+/* Whether sign_queue_sign() would have to wait for room right now. */
+int
+sign_queue_full(sign_queue *sq)
+{
+	pthread_mutex_lock(&sq->lock);
+	int full = sq->pending >= sq->max_pending;
+	pthread_mutex_unlock(&sq->lock);
+	return full;
+}
+
+/*
+ * Same contract as SEC_SignData(), but the signature is made by one of
+ * the queue's token threads.  Blocks until it's done.
+ */
+SECStatus
+sign_queue_sign(sign_queue *sq, SECItem *result, const unsigned char *buf,
+		int len, SECKEYPrivateKey *pk, SECOidTag algid)
+{
+	struct sign_request req = {
+		.result = result,
+		.buf = buf,
+		.len = len,
+		.pk = pk,
+		.algid = algid,
+		.status = SECFailure,
+	};
+
+	pthread_mutex_lock(&sq->lock);
+	while (sq->pending >= sq->max_pending && !sq->stopping)
+		pthread_cond_wait(&sq->space, &sq->lock);
+	if (sq->stopping) {
+		pthread_mutex_unlock(&sq->lock);
+		PORT_SetError(SEC_ERROR_LIBRARY_FAILURE);
+		return SECFailure;
+	}
+
+	if (sq->tail)
+		sq->tail->next = &req;
+	else
+		sq->head = &req;
+	sq->tail = &req;
+	sq->pending++;
+	pthread_cond_signal(&sq->work);
+
+	while (!req.done)
+		pthread_cond_wait(&sq->done, &sq->lock);
+	pthread_mutex_unlock(&sq->lock);
+
+	if (req.status != SECSuccess)
+		PORT_SetError(req.error);
+	return req.status;
+}
+
+/*
+ * Same as sign_queue_sign(), but don't wait: callback gets the result,
+ * on the token thread, once it's done.  result and buf have to stay
+ * around until then.  This never waits for room, either, so callers
+ * have to limit how many they have outstanding themselves.
+ */
+int
+sign_queue_submit(sign_queue *sq, SECItem *result, const unsigned char *buf,
+		  int len, SECKEYPrivateKey *pk, SECOidTag algid,
+		  sign_queue_callback callback, void *arg)
+{
+	struct sign_request *req = calloc(1, sizeof (*req));
+	if (!req)
+		return -1;
+
+	req->result = result;
+	req->buf = buf;
+	req->len = len;
+	req->pk = pk;
+	req->algid = algid;
+	req->status = SECFailure;
+	req->callback = callback;
+	req->arg = arg;
+
+	pthread_mutex_lock(&sq->lock);
+	if (sq->stopping) {
+		pthread_mutex_unlock(&sq->lock);
+		free(req);
+		errno = ESHUTDOWN;
+		return -1;
+	}
+
+	if (sq->tail)
+		sq->tail->next = req;
+	else
+		sq->head = req;
+	sq->tail = req;
+	sq->pending++;
+	pthread_cond_signal(&sq->work);
+	pthread_mutex_unlock(&sq->lock);
+	return 0;
+}
@@ -0,0 +1,45 @@
+/*
+ * Copyright 2026 agent <agent@local>
+ * All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 2 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Author(s): agent <agent@local>
+ */
+#ifndef SIGN_QUEUE_H
+#define SIGN_QUEUE_H 1
+
+#include <keyhi.h>
+#include <secoidt.h>
+
+/*
+ * A sign_queue funnels private key operations from any number of threads
+ * to a fixed number of threads that talk to the token.  Tokens are often
+ * single-session, and this lets the CPU-bound work (digesting, building
+ * attributes, writing output) run wide while the token just signs.
+ */
+typedef struct sign_queue sign_queue;
+typedef void (*sign_queue_callback)(SECStatus status, int error, void *arg);
+
+extern int sign_queue_new(sign_queue **sqp, int max_pending, int nthreads);
+extern void sign_queue_free(sign_queue *sq);
+extern int sign_queue_full(sign_queue *sq);
+extern SECStatus sign_queue_sign(sign_queue *sq, SECItem *result,
+				 const unsigned char *buf, int len,
+				 SECKEYPrivateKey *pk, SECOidTag algid);
+extern int sign_queue_submit(sign_queue *sq, SECItem *result,
+			     const unsigned char *buf, int len,
+			     SECKEYPrivateKey *pk, SECOidTag algid,
+			     sign_queue_callback callback, void *arg);
+
+#endif /* SIGN_QUEUE_H */
@@ -77,6 +77,12 @@ static int
 generate_certificate_list(cms_context *cms, SECItem ***certificate_list_p)
 {
 	SECItem **certificates = NULL;
+
+	if (cms->certificate_list) {
+		*certificate_list_p = cms->certificate_list;
+		return 0;
+	}
+
 	void *mark = PORT_ArenaMark(cms->arena);
 
 	certificates = PORT_ArenaZAlloc(cms->arena, sizeof (SECItem *) * 3);
@@ -118,10 +124,26 @@ generate_certificate_list(cms_context *cms, SECItem ***certificate_list_p)
 		}
 	}
 
+	PORT_ArenaUnmark(cms->arena, mark);
 	*certificate_list_p = certificates;
 	return 0;
 }
 
+/*
+ * Build the signer's certificate chain once and reuse it for every
+ * SignedData we generate with this context.
+ */
+int
+cache_certificate_list(cms_context *cms)
+{
+	SECItem **certificates = NULL;
+
+	if (generate_certificate_list(cms, &certificates) < 0)
+		return -1;
+	cms->certificate_list = certificates;
+	return 0;
+}
+
 typedef enum {
 	PE_SIGNER_INFO,
 	AUTHVAR_SIGNER_INFO,
@@ -19,6 +19,7 @@
 #ifndef SIGNED_DATA_H
 #define SIGNED_DATA_H 1
 
+extern int cache_certificate_list(cms_context *cms);
 extern int generate_spc_signed_data(cms_context *cms, SECItem *sdp);
 extern int generate_authvar_signed_data(cms_context *cms, SECItem *sdp);
 
@@ -157,6 +157,34 @@ err:
 	return -1;
 }
 
+static SECKEYPrivateKey *
+find_signing_key(cms_context *cms)
+{
+	PK11_SetPasswordFunc(cms->func ? cms->func : readpw);
+	SECKEYPrivateKey *privkey = PK11_FindKeyByAnyCert(cms->cert,
+				cms->pwdata ? cms->pwdata : NULL);
+	if (!privkey)
+		cms->log(cms, LOG_ERR, "could not get private key: %s",
+			PORT_ErrorToString(PORT_GetError()));
+	return privkey;
+}
+
+/*
+ * Keep the private key for cms->cert on the context, so signing a
+ * batch of binaries doesn't search the token once per signature.
+ */
+int
+cache_signing_key(cms_context *cms)
+{
+	if (cms->signing_key)
+		return 0;
+
+	cms->signing_key = find_signing_key(cms);
+	if (!cms->signing_key)
+		return -1;
+	return 0;
+}
+
 static int
 sign_blob(cms_context *cms, SECItem *sigitem, SECItem *sign_content)
 {
@@ -173,22 +201,28 @@ sign_blob(cms_context *cms, SECItem *sigitem, SECItem *sign_content)
 	if (!oid)
 		goto err;
 
-	PK11_SetPasswordFunc(cms->func ? cms->func : readpw);
-	SECKEYPrivateKey *privkey = PK11_FindKeyByAnyCert(cms->cert,
-				cms->pwdata ? cms->pwdata : NULL);
+	SECKEYPrivateKey *privkey = cms->signing_key;
 	if (!privkey) {
-		cms->log(cms, LOG_ERR, "could not get private key: %s",
-			PORT_ErrorToString(PORT_GetError()));
-		goto err;
+		privkey = find_signing_key(cms);
+		if (!privkey)
+			goto err;
 	}
-	
+
 	SECItem *signature, tmp;
 	memset (&tmp, '\0', sizeof (tmp));
 
 	SECStatus status;
-	status = SEC_SignData(&tmp, sign_content->data, sign_content->len,
-			privkey, oid->offset);
-	SECKEY_DestroyPrivateKey(privkey);
+	uint64_t start = timing_begin(cms);
+	if (cms->sign_queue)
+		status = sign_queue_sign(cms->sign_queue, &tmp,
+				sign_content->data, sign_content->len,
+				privkey, oid->offset);
+	else
+		status = SEC_SignData(&tmp, sign_content->data,
+				sign_content->len, privkey, oid->offset);
+	timing_end(cms, TIMING_SIGN_BLOB, start);
+	if (privkey != cms->signing_key)
+		SECKEY_DestroyPrivateKey(privkey);
 	privkey = NULL;
 
 	if (status != SECSuccess) {
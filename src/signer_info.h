@@ -61,6 +61,7 @@ typedef struct {
 } SpcSignerInfo;
 extern SEC_ASN1Template SpcSignerInfoTemplate[];
 
+extern int cache_signing_key(cms_context *cms);
 extern int generate_signed_attributes(cms_context *cms, SECItem *sattrs);
 extern int generate_spc_signer_info(cms_context *cms, SpcSignerInfo *sip);
 extern int generate_authvar_signer_info(cms_context *cms, SpcSignerInfo *sip);
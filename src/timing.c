@@ -0,0 +1,179 @@
+/*
+ * Copyright 2026 agent <agent@local>
+ * All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 2 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Author(s): agent <agent@local>
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/resource.h>
+
+#include "pesign.h"
+
+static const char *phase_names[N_TIMING_PHASES] = {
+	[TIMING_PE_BEGIN] = "pe_begin",
+	[TIMING_PARSE_SIGNATURES] = "parse_signatures",
+	[TIMING_FIND_CERTIFICATE] = "find_certificate",
+	[TIMING_GENERATE_DIGEST] = "generate_digest",
+	[TIMING_SIGN_BLOB] = "sign_blob",
+	[TIMING_FINALIZE_SIGNATURES] = "finalize_signatures",
+	[TIMING_PE_UPDATE] = "pe_update",
+	[TIMING_MSYNC] = "msync",
+};
+
+static uint64_t
+now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/* For callers that keep their own accounting, on the same clock. */
+uint64_t
+timing_now(void)
+{
+	return now_ns();
+}
+
+/* PESIGN_TIMING turns timing on without having to pass --timing. */
+int
+timing_requested(void)
+{
+	char *env = getenv("PESIGN_TIMING");
+
+	return env && *env && strcmp(env, "0");
+}
+
+int
+timing_enable(cms_context *cms)
+{
+	if (cms->timing)
+		return 0;
+
+	cms->timing = calloc(1, sizeof (*cms->timing));
+	if (!cms->timing) {
+		cms->log(cms, LOG_ERR, "%s:%s:%d could not allocate memory: %m",
+			__FILE__, __func__, __LINE__);
+		return -1;
+	}
+	return 0;
+}
+
+void
+timing_disable(cms_context *cms)
+{
+	xfree(cms->timing);
+}
+
+void
+timing_clear(cms_context *cms)
+{
+	if (cms->timing)
+		memset(cms->timing, '\0', sizeof (*cms->timing));
+}
+
+uint64_t
+timing_begin(cms_context *cms)
+{
+	return cms->timing ? now_ns() : 0;
+}
+
+void
+timing_add(cms_context *cms, timing_phase phase, uint64_t ns)
+{
+	struct timing *t = cms->timing;
+
+	if (!t)
+		return;
+
+	t->total[phase] += ns;
+	if (ns > t->max[phase])
+		t->max[phase] = ns;
+	t->count[phase]++;
+}
+
+void
+timing_end(cms_context *cms, timing_phase phase, uint64_t start)
+{
+	if (cms->timing)
+		timing_add(cms, phase, now_ns() - start);
+}
+
+void
+timing_merge(cms_context *cms, cms_context *src)
+{
+	struct timing *t = cms->timing, *s = src->timing;
+
+	if (!t || !s)
+		return;
+
+	for (int i = 0; i < N_TIMING_PHASES; i++) {
+		t->total[i] += s->total[i];
+		if (s->max[i] > t->max[i])
+			t->max[i] = s->max[i];
+		t->count[i] += s->count[i];
+	}
+}
+
+void
+timing_print(cms_context *cms, FILE *out)
+{
+	struct timing *t = cms->timing;
+
+	if (!t)
+		return;
+
+	fprintf(out, "%-20s %8s %12s %12s %12s\n", "phase", "calls",
+		"total ms", "mean ms", "max ms");
+	for (int i = 0; i < N_TIMING_PHASES; i++) {
+		if (!t->count[i])
+			continue;
+		fprintf(out, "%-20s %8u %12.3f %12.3f %12.3f\n",
+			phase_names[i], t->count[i], t->total[i] / 1000000.0,
+			t->total[i] / 1000000.0 / t->count[i],
+			t->max[i] / 1000000.0);
+	}
+
+	/* the whole process's high-water mark, mapped images included */
+	struct rusage ru;
+	if (getrusage(RUSAGE_SELF, &ru) == 0)
+		fprintf(out, "%-20s %8ld kB\n", "peak_rss", ru.ru_maxrss);
+}
+
+/* One line of key=value pairs, so it's easy to pull out of syslog. */
+void
+timing_log(cms_context *cms, int priority)
+{
+	struct timing *t = cms->timing;
+	char buf[1024];
+	size_t len = 0;
+
+	if (!t)
+		return;
+
+	buf[0] = '\0';
+	for (int i = 0; i < N_TIMING_PHASES; i++) {
+		if (!t->count[i] || len >= sizeof (buf))
+			continue;
+		len += snprintf(buf + len, sizeof (buf) - len,
+				" %s_ms=%.3f", phase_names[i],
+				t->total[i] / 1000000.0);
+	}
+	cms->log(cms, priority, "timing:%s", buf);
+}
@@ -0,0 +1,62 @@
+/*
+ * Copyright 2026 agent <agent@local>
+ * All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 2 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Author(s): agent <agent@local>
+ */
+#ifndef TIMING_H
+#define TIMING_H 1
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include "cms_common.h"
+
+/*
+ * Opt-in accounting of where the time goes when signing or checking a
+ * binary.  Nothing is recorded unless timing_enable() has been called on
+ * the cms_context, so the instrumented paths cost one branch otherwise.
+ */
+typedef enum {
+	TIMING_PE_BEGIN,
+	TIMING_PARSE_SIGNATURES,
+	TIMING_FIND_CERTIFICATE,
+	TIMING_GENERATE_DIGEST,
+	TIMING_SIGN_BLOB,
+	TIMING_FINALIZE_SIGNATURES,
+	TIMING_PE_UPDATE,
+	TIMING_MSYNC,
+	N_TIMING_PHASES
+} timing_phase;
+
+struct timing {
+	uint64_t total[N_TIMING_PHASES];
+	uint64_t max[N_TIMING_PHASES];
+	unsigned int count[N_TIMING_PHASES];
+};
+
+extern int timing_requested(void);
+extern uint64_t timing_now(void);
+extern int timing_enable(cms_context *cms);
+extern void timing_disable(cms_context *cms);
+extern void timing_clear(cms_context *cms);
+extern uint64_t timing_begin(cms_context *cms);
+extern void timing_end(cms_context *cms, timing_phase phase, uint64_t start);
+extern void timing_add(cms_context *cms, timing_phase phase, uint64_t ns);
+extern void timing_merge(cms_context *cms, cms_context *src);
+extern void timing_print(cms_context *cms, FILE *out);
+extern void timing_log(cms_context *cms, int priority);
+
+#endif /* TIMING_H */
@@ -99,47 +99,6 @@ read_file(int fd, char **bufp, size_t *lenptr) {
     return 0;
 }
 
-static int
-compare_shdrs (const void *a, const void *b)
-{
-	const struct section_header *shdra = (const struct section_header *)a;
-	const struct section_header *shdrb = (const struct section_header *)b;
-	int rc;
-
-	if (shdra->data_addr > shdrb->data_addr)
-		return 1;
-	if (shdrb->data_addr > shdra->data_addr)
-		return -1;
-
-	if (shdra->virtual_address > shdrb->virtual_address)
-		return 1;
-	if (shdrb->virtual_address > shdra->virtual_address)
-		return -1;
-
-	rc = strcmp(shdra->name, shdrb->name);
-	if (rc != 0)
-		return rc;
-
-	if (shdra->virtual_size > shdrb->virtual_size)
-		return 1;
-	if (shdrb->virtual_size > shdra->virtual_size)
-		return -1;
-
-	if (shdra->raw_data_size > shdrb->raw_data_size)
-		return 1;
-	if (shdrb->raw_data_size > shdra->raw_data_size)
-		return -1;
-
-	return 0;
-}
-
-static void
-__attribute__ ((unused))
-sort_shdrs (struct section_header *shdrs, size_t sections)
-{
-	qsort(shdrs, sections, sizeof(*shdrs), compare_shdrs);
-}
-
 static void
 __attribute__ ((unused))
 free_poison(void  *addrv, ssize_t len)
@@ -280,20 +280,18 @@ available_cert_space(Pe *pe)
 		get_current_sigspace_in_use(pe);
 }
 
-ssize_t
-calculate_signature_space(cms_context *cms, Pe *pe)
+/*
+ * The certificate table always starts on the first octaword boundary after
+ * the image, and nothing we put in it is covered by the digest.  So rather
+ * than building a whole signature just to find out how big it'll be, lay
+ * the (empty) table out now; the image is then byte for byte what
+ * finalize_signatures() will leave in front of the real table, and a
+ * single digest of it is the one we need to sign.
+ */
+int
+reserve_cert_table(Pe *pe)
 {
-	SECItem sig = { 0, };
-
-	int rc = generate_spc_signed_data(cms, &sig);
-	if (rc < 0) {
-		fprintf(stderr, "Could not generate signed data: %m\n");
-		exit(1);
-	}
-
-	ssize_t ret = get_total_sigspace_size(cms, pe, &sig);
-	free_poison(sig.data, sig.len);
-	return ret;
+	return pe_alloccert(pe, 0);
 }
 
 ssize_t
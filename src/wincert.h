@@ -55,7 +55,7 @@ typedef struct {
 extern int cert_iter_init(cert_iter *iter, Pe *pe);
 extern int next_cert(cert_iter *iter, void **cert, ssize_t *cert_size);
 extern ssize_t available_cert_space(Pe *pe);
-extern ssize_t calculate_signature_space(cms_context *cms, Pe *pe);
+extern int reserve_cert_table(Pe *pe);
 extern int parse_signatures(SECItem ***sigs, int *num_sigs, Pe *pe);
 extern int finalize_signatures(SECItem **sigs, int num_sigs, Pe *pe);
 extern size_t get_reserved_sig_space(cms_context *cms, Pe *pe);